@@ -0,0 +1,580 @@
+/**
+    bench.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+/* Runs one headless recording against a synthetic workload and prints the
+ * results as a line of JSON. The driver plays the part of the user: it
+ * draws into a window, drags the selection with XTest, presses the save
+ * shortcut and waits for the file. Meant to be run by run.sh on Xvfb. */
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+#include <X11/keysym.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/limits.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define CELL_WIDTH 8
+#define CELL_HEIGHT 16
+#define DRAG_WIDTH 320
+#define DRAG_HEIGHT 240
+#define TIMEOUT 30 /* seconds to wait for evid at any step */
+
+typedef struct Options Options;
+struct Options {
+  const char *evid;
+  const char *workload;
+  const char *format;
+  const char *output;
+  int framerate;
+  double duration;
+  int width;
+  int height;
+};
+
+typedef struct Bench Bench;
+struct Bench {
+  Display *dpy;
+  Window root;
+  Window window;
+  Window dragged;
+  GC gc;
+  XImage *image;
+  int x;
+  int y;
+  int width;
+  int height;
+  uint32_t seed;
+  unsigned long frame;
+};
+
+static void die(const char *message) {
+  fprintf(stderr, "evid-bench: %s\n", message);
+  exit(EXIT_FAILURE);
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(long long when) {
+  struct timespec ts = {.tv_sec = when / NSEC_PER_SEC,
+                        .tv_nsec = when % NSEC_PER_SEC};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+/* xorshift32, every run draws the same frames */
+static uint32_t next_random(Bench *bench) {
+  uint32_t x = bench->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return bench->seed = x;
+}
+
+static void set_color(Bench *bench, unsigned long color) {
+  XSetForeground(bench->dpy, bench->gc, color);
+}
+
+/* Glyphs are a few random strokes, no fonts needed on the server */
+static void draw_text_line(Bench *bench, Drawable drawable, int y) {
+  XRectangle strokes[512];
+  int count = 0;
+  int columns = bench->width / CELL_WIDTH;
+  int length = columns / 4 + next_random(bench) % (columns * 3 / 4);
+  for (int column = 0; column < length; ++column) {
+    if (next_random(bench) % 6 == 0) {
+      continue; /* space */
+    }
+    for (int i = 0; i < 2 && count < (int)(sizeof(strokes) / sizeof(*strokes));
+         ++i) {
+      uint32_t r = next_random(bench);
+      XRectangle *s = &strokes[count++];
+      s->x = column * CELL_WIDTH + 1 + r % 4;
+      s->y = y + 3 + (r >> 8) % 8;
+      s->width = 1 + (r >> 16) % 4;
+      s->height = 1 + (r >> 24) % 8;
+    }
+  }
+  set_color(bench, 0xD0D0D0);
+  XFillRectangles(bench->dpy, drawable, bench->gc, strokes, count);
+}
+
+static void draw_terminal(Bench *bench) {
+  set_color(bench, 0x1E1E1E);
+  XFillRectangle(bench->dpy, bench->window, bench->gc, 0, 0, bench->width,
+                 bench->height);
+  for (int y = 0; y + CELL_HEIGHT <= bench->height; y += CELL_HEIGHT) {
+    draw_text_line(bench, bench->window, y);
+  }
+}
+
+/* An idle terminal, only the cursor blinks twice a second */
+static void static_frame(Bench *bench, int framerate) {
+  if (!bench->frame) {
+    draw_terminal(bench);
+  }
+  int half = framerate / 2 > 0 ? framerate / 2 : 1;
+  set_color(bench, (bench->frame / half) % 2 ? 0x1E1E1E : 0xD0D0D0);
+  XFillRectangle(bench->dpy, bench->window, bench->gc, CELL_WIDTH,
+                 bench->height - 2 * CELL_HEIGHT, CELL_WIDTH, CELL_HEIGHT);
+}
+
+/* Output scrolling by one line every frame */
+static void scroll_frame(Bench *bench, int framerate) {
+  if (!bench->frame) {
+    draw_terminal(bench);
+    return;
+  }
+  int bottom = bench->height / CELL_HEIGHT * CELL_HEIGHT - CELL_HEIGHT;
+  XCopyArea(bench->dpy, bench->window, bench->window, bench->gc, 0,
+            CELL_HEIGHT, bench->width, bottom, 0, 0);
+  set_color(bench, 0x1E1E1E);
+  XFillRectangle(bench->dpy, bench->window, bench->gc, 0, bottom,
+                 bench->width, CELL_HEIGHT);
+  draw_text_line(bench, bench->window, bottom);
+}
+
+/* Every pixel changes: moving gradients with noise on top */
+static void video_frame(Bench *bench, int framerate) {
+  XImage *image = bench->image;
+  unsigned long t = bench->frame;
+  for (int y = 0; y < image->height; ++y) {
+    uint32_t *row =
+        (uint32_t *)(image->data + (size_t)y * image->bytes_per_line);
+    for (int x = 0; x < image->width; ++x) {
+      uint32_t noise = next_random(bench) & 0x1F1F1F;
+      uint32_t r = (x + t * 3) & 0xFF;
+      uint32_t g = (y + t * 2) & 0xFF;
+      uint32_t b = ((x ^ y) + t) & 0xFF;
+      row[x] = ((r << 16 | g << 8 | b) & 0xE0E0E0) + noise;
+    }
+  }
+  XPutImage(bench->dpy, bench->window, bench->gc, image, 0, 0, 0, 0,
+            image->width, image->height);
+}
+
+/* A window dragged around over a static background */
+static void drag_frame(Bench *bench, int framerate) {
+  if (!bench->frame) {
+    draw_terminal(bench);
+    XMapRaised(bench->dpy, bench->dragged);
+  }
+  double t = (double)bench->frame / framerate;
+  int range_x = bench->width - DRAG_WIDTH;
+  int range_y = bench->height - DRAG_HEIGHT;
+  /* Lissajous path through the whole area */
+  double fx = 0.5 + 0.5 * sin(t * 1.3);
+  double fy = 0.5 + 0.5 * sin(t * 1.7 + 1);
+  XMoveWindow(bench->dpy, bench->dragged, range_x > 0 ? fx * range_x : 0,
+              range_y > 0 ? fy * range_y : 0);
+}
+
+typedef struct Workload Workload;
+struct Workload {
+  const char *name;
+  void (*frame)(Bench *bench, int framerate);
+};
+
+static const Workload workloads[] = {
+    {"static", static_frame},
+    {"scroll", scroll_frame},
+    {"video", video_frame},
+    {"drag", drag_frame},
+};
+
+static void open_bench(Bench *bench, Options *options) {
+  bench->dpy = XOpenDisplay(NULL);
+  if (!bench->dpy) {
+    die("can't open the display");
+  }
+  int event_base, error_base, major, minor;
+  if (!XTestQueryExtension(bench->dpy, &event_base, &error_base, &major,
+                           &minor)) {
+    die("the X server lacks the XTEST extension");
+  }
+  int screen = DefaultScreen(bench->dpy);
+  bench->root = RootWindow(bench->dpy, screen);
+  int screen_width = DisplayWidth(bench->dpy, screen);
+  int screen_height = DisplayHeight(bench->dpy, screen);
+  bench->width = options->width < screen_width - 2 ? options->width
+                                                   : screen_width - 2;
+  bench->height = options->height < screen_height - 2 ? options->height
+                                                      : screen_height - 2;
+  bench->x = (screen_width - bench->width) / 2;
+  bench->y = (screen_height - bench->height) / 2;
+  bench->seed = 0x9E3779B9;
+
+  /* No window manager on Xvfb, the window places and focuses itself */
+  XSetWindowAttributes wa = {0};
+  wa.override_redirect = True;
+  wa.background_pixel = BlackPixel(bench->dpy, screen);
+  bench->window = XCreateWindow(
+      bench->dpy, bench->root, bench->x, bench->y, bench->width,
+      bench->height, 0, CopyFromParent, InputOutput, CopyFromParent,
+      CWOverrideRedirect | CWBackPixel, &wa);
+  wa.background_pixel = 0x3465A4;
+  bench->dragged = XCreateWindow(
+      bench->dpy, bench->window, 0, 0, DRAG_WIDTH, DRAG_HEIGHT, 0,
+      CopyFromParent, InputOutput, CopyFromParent, CWBackPixel, &wa);
+  bench->gc = XCreateGC(bench->dpy, bench->window, 0, NULL);
+  bench->image = XCreateImage(bench->dpy, DefaultVisual(bench->dpy, screen),
+                              DefaultDepth(bench->dpy, screen), ZPixmap, 0,
+                              NULL, bench->width, bench->height, 32, 0);
+  if (!bench->image ||
+      !(bench->image->data =
+            malloc((size_t)bench->image->bytes_per_line * bench->height))) {
+    die("can't allocate the frame");
+  }
+
+  XMapRaised(bench->dpy, bench->window);
+  XSync(bench->dpy, False);
+  XSetInputFocus(bench->dpy, bench->window, RevertToPointerRoot, CurrentTime);
+  /* evid grabs its shortcuts on the active window */
+  Atom net_active_window =
+      XInternAtom(bench->dpy, "_NET_ACTIVE_WINDOW", False);
+  XChangeProperty(bench->dpy, bench->root, net_active_window, XA_WINDOW, 32,
+                  PropModeReplace, (unsigned char *)&bench->window, 1);
+  XSync(bench->dpy, False);
+}
+
+static void close_bench(Bench *bench) {
+  XDestroyImage(bench->image);
+  XFreeGC(bench->dpy, bench->gc);
+  XDestroyWindow(bench->dpy, bench->window);
+  XCloseDisplay(bench->dpy);
+}
+
+/* evid holds the pointer grab while the region is being selected */
+static int wait_for_selection(Bench *bench, pid_t pid) {
+  long long deadline = now_ns() + TIMEOUT * NSEC_PER_SEC;
+  while (now_ns() < deadline) {
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+      return -1;
+    }
+    int status = XGrabPointer(bench->dpy, bench->root, False, 0,
+                              GrabModeAsync, GrabModeAsync, None, None,
+                              CurrentTime);
+    if (status == AlreadyGrabbed) {
+      return 0;
+    }
+    if (status == GrabSuccess) {
+      XUngrabPointer(bench->dpy, CurrentTime);
+    }
+    XSync(bench->dpy, False);
+    usleep(1000);
+  }
+  return -1;
+}
+
+static void select_region(Bench *bench) {
+  Display *dpy = bench->dpy;
+  XTestFakeMotionEvent(dpy, -1, bench->x, bench->y, CurrentTime);
+  XTestFakeButtonEvent(dpy, 1, True, CurrentTime);
+  XTestFakeMotionEvent(dpy, -1, bench->x + bench->width / 2,
+                       bench->y + bench->height / 2, CurrentTime);
+  XTestFakeMotionEvent(dpy, -1, bench->x + bench->width,
+                       bench->y + bench->height, CurrentTime);
+  XTestFakeButtonEvent(dpy, 1, False, CurrentTime);
+  /* Out of the way of the recording */
+  XTestFakeMotionEvent(dpy, -1, 0, 0, CurrentTime);
+  XSync(dpy, False);
+}
+
+static void press_save(Bench *bench) {
+  Display *dpy = bench->dpy;
+  KeyCode control = XKeysymToKeycode(dpy, XK_Control_L);
+  KeyCode save = XKeysymToKeycode(dpy, XK_s);
+  XTestFakeKeyEvent(dpy, control, True, CurrentTime);
+  XTestFakeKeyEvent(dpy, save, True, CurrentTime);
+  XTestFakeKeyEvent(dpy, save, False, CurrentTime);
+  XTestFakeKeyEvent(dpy, control, False, CurrentTime);
+  XSync(dpy, False);
+}
+
+/* The summary is written once the recording is in place */
+static int find_outputs(const char *dir, char *recording, char *summary) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return -1;
+  }
+  recording[0] = summary[0] = '\0';
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    size_t length = strlen(entry->d_name);
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    if (length > 5 && !strcmp(entry->d_name + length - 5, ".json")) {
+      snprintf(summary, PATH_MAX, "%s/%s", dir, entry->d_name);
+    } else {
+      snprintf(recording, PATH_MAX, "%s/%s", dir, entry->d_name);
+    }
+  }
+  closedir(d);
+  return summary[0] && recording[0] ? 0 : -1;
+}
+
+static double json_number(const char *json, const char *key) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char *value = strstr(json, pattern);
+  return value ? strtod(value + strlen(pattern), NULL) : -1;
+}
+
+static int read_file(const char *file, char *buffer, size_t size) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    return -1;
+  }
+  size_t length = fread(buffer, 1, size - 1, f);
+  buffer[length] = '\0';
+  fclose(f);
+  return 0;
+}
+
+static pid_t spawn_evid(Options *options) {
+  char framerate[16];
+  snprintf(framerate, sizeof(framerate), "%d", options->framerate);
+  char *argv[12];
+  int argc = 0;
+  argv[argc++] = (char *)options->evid;
+  argv[argc++] = "-i";
+  argv[argc++] = "-f";
+  argv[argc++] = framerate;
+  argv[argc++] = "-o";
+  argv[argc++] = (char *)options->output;
+  if (!strcmp(options->format, "lqgif")) {
+    argv[argc++] = "-g";
+  } else if (!strcmp(options->format, "hqgif")) {
+    argv[argc++] = "-gg";
+  }
+  argv[argc] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+static int wait_exit(pid_t pid, long long deadline) {
+  for (;;) {
+    pid_t done = waitpid(pid, NULL, WNOHANG);
+    if (done == pid) {
+      return 0;
+    }
+    if (done == -1 || now_ns() > deadline) {
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      return -1;
+    }
+    usleep(10000);
+  }
+}
+
+static double cpu_seconds(struct rusage *usage) {
+  return usage->ru_utime.tv_sec + usage->ru_stime.tv_sec +
+         (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+}
+
+static void print_usage(void) {
+  fprintf(stderr,
+          "Usage: evid-bench [OPTIONS]\n"
+          " --evid PATH\tevid binary to run, defaults to bin/evid\n"
+          " --workload NAME\tstatic, scroll, video or drag\n"
+          " --format FORMAT\tmp4, lqgif or hqgif\n"
+          " --output DIR\tempty directory the recording is saved into\n"
+          " --duration SECONDS\tlength of the recording, defaults to 5\n"
+          " --framerate FRAMES\tdefaults to 30\n"
+          " --size WIDTHxHEIGHT\trecorded area, defaults to 1280x720\n");
+}
+
+static void parse_options(Options *options, int argc, char **argv) {
+  struct option long_opts[] = {{"evid", required_argument, NULL, 'e'},
+                               {"workload", required_argument, NULL, 'w'},
+                               {"format", required_argument, NULL, 'F'},
+                               {"output", required_argument, NULL, 'o'},
+                               {"duration", required_argument, NULL, 'd'},
+                               {"framerate", required_argument, NULL, 'f'},
+                               {"size", required_argument, NULL, 's'},
+                               {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'e': {
+      options->evid = optarg;
+      break;
+    }
+    case 'w': {
+      options->workload = optarg;
+      break;
+    }
+    case 'F': {
+      options->format = optarg;
+      break;
+    }
+    case 'o': {
+      options->output = optarg;
+      break;
+    }
+    case 'd': {
+      options->duration = strtod(optarg, NULL);
+      break;
+    }
+    case 'f': {
+      options->framerate = atoi(optarg);
+      break;
+    }
+    case 's': {
+      if (sscanf(optarg, "%dx%d", &options->width, &options->height) != 2) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    default: {
+      print_usage();
+      exit(EXIT_FAILURE);
+    }
+    }
+  }
+  if (!options->output || options->duration <= 0 ||
+      options->framerate <= 0 || options->width <= 0 ||
+      options->height <= 0) {
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv) {
+  Options options = {.evid = "bin/evid",
+                     .workload = "static",
+                     .format = "mp4",
+                     .framerate = 30,
+                     .duration = 5,
+                     .width = 1280,
+                     .height = 720};
+  parse_options(&options, argc, argv);
+
+  const Workload *workload = NULL;
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); ++i) {
+    if (!strcmp(workloads[i].name, options.workload)) {
+      workload = &workloads[i];
+    }
+  }
+  if (!workload) {
+    die("unknown workload");
+  }
+
+  Bench bench = {0};
+  open_bench(&bench, &options);
+  long long interval = NSEC_PER_SEC / options.framerate;
+  workload->frame(&bench, options.framerate);
+  bench.frame++;
+  XSync(bench.dpy, False);
+
+  struct rusage before, after;
+  getrusage(RUSAGE_CHILDREN, &before);
+  long long spawned = now_ns();
+  pid_t pid = spawn_evid(&options);
+  if (pid == -1 || wait_for_selection(&bench, pid)) {
+    die("evid didn't start selecting a region");
+  }
+  /* From launching evid until the selection overlay takes input */
+  long long selecting = now_ns();
+  select_region(&bench);
+  long long started = now_ns();
+
+  long long next = started;
+  long long stop = started + (long long)(options.duration * NSEC_PER_SEC);
+  while (next < stop) {
+    workload->frame(&bench, options.framerate);
+    bench.frame++;
+    XFlush(bench.dpy);
+    next += interval;
+    sleep_until(next);
+  }
+  XSync(bench.dpy, False);
+  long long stopped = now_ns();
+  press_save(&bench);
+
+  char recording[PATH_MAX], summary[PATH_MAX];
+  long long deadline = stopped + TIMEOUT * NSEC_PER_SEC;
+  while (find_outputs(options.output, recording, summary)) {
+    if (now_ns() > deadline || waitpid(pid, NULL, WNOHANG) == pid) {
+      die("evid didn't save the recording");
+    }
+    usleep(2000);
+  }
+  long long saved = now_ns();
+  /* Includes ffmpeg, evid waits for it before exiting */
+  if (wait_exit(pid, saved + TIMEOUT * NSEC_PER_SEC)) {
+    die("evid didn't exit");
+  }
+  getrusage(RUSAGE_CHILDREN, &after);
+  close_bench(&bench);
+
+  char json[4096];
+  struct stat st;
+  if (read_file(summary, json, sizeof(json)) || stat(recording, &st)) {
+    die("can't read the results");
+  }
+  double frames = json_number(json, "frames");
+  double first_frame =
+      json_number(json, "start") + json_number(json, "first_frame");
+  double cpu = cpu_seconds(&after) - cpu_seconds(&before);
+  printf("{\"workload\": \"%s\", \"format\": \"%s\", \"width\": %d, "
+         "\"height\": %d, \"framerate\": %d, \"duration\": %.3f, "
+         "\"frames\": %.0f, \"fps\": %.2f, \"dropped\": %.0f, "
+         "\"cpu_seconds\": %.3f, \"cpu_ms_per_frame\": %.3f, "
+         "\"startup_ms\": %.1f, \"first_frame_ms\": %.1f, "
+         "\"stop_to_saved_ms\": %.1f, "
+         "\"size\": %lld, \"peak_rss_kb\": %.0f}\n",
+         workload->name, options.format, bench.width, bench.height,
+         options.framerate, (stopped - started) / 1e9, frames,
+         json_number(json, "fps"), json_number(json, "drop_frames"), cpu,
+         frames > 0 ? cpu * 1000 / frames : 0, (selecting - spawned) / 1e6,
+         (first_frame - started / 1e9) * 1000, (saved - stopped) / 1e6,
+         (long long)st.st_size, json_number(json, "peak_rss_kb"));
+  return EXIT_SUCCESS;
+}
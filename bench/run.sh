@@ -0,0 +1,68 @@
+#!/bin/sh
+# Runs every workload with every output format on a private Xvfb and
+# collects the results, one JSON object per line. Tweak with BENCH_*
+# variables, e.g. BENCH_WORKLOADS=video BENCH_FORMATS=mp4 make bench
+
+EVID=${1:-bin/evid}
+BENCH=${2:-bin/evid-bench}
+RESULTS=${BENCH_RESULTS:-bin/bench-results.jsonl}
+WORKLOADS=${BENCH_WORKLOADS:-"static scroll video drag"}
+FORMATS=${BENCH_FORMATS:-"mp4 lqgif hqgif"}
+DURATION=${BENCH_DURATION:-5}
+FRAMERATE=${BENCH_FRAMERATE:-30}
+SIZE=${BENCH_SIZE:-1280x720}
+SCREEN=${BENCH_SCREEN:-1920x1080}
+
+if ! command -v Xvfb >/dev/null; then
+  echo "bench: Xvfb is needed to run the benchmarks" >&2
+  exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+trap 'kill $XVFB_PID 2>/dev/null; rm -rf "$WORK_DIR"' EXIT INT TERM
+
+# Xvfb picks a free display and writes its number once it's ready
+Xvfb -displayfd 3 -screen 0 "${SCREEN}x24" -nolisten tcp \
+  3>"$WORK_DIR/display" 2>"$WORK_DIR/xvfb.log" &
+XVFB_PID=$!
+for _ in $(seq 100); do
+  [ -s "$WORK_DIR/display" ] && break
+  sleep 0.1
+done
+if [ ! -s "$WORK_DIR/display" ]; then
+  echo "bench: Xvfb didn't start" >&2
+  cat "$WORK_DIR/xvfb.log" >&2
+  exit 1
+fi
+DISPLAY=:$(cat "$WORK_DIR/display")
+export DISPLAY
+# Temporary recordings stay out of the way of the real ones
+TMPDIR=$WORK_DIR
+export TMPDIR
+
+VERSION=$("$EVID" -v | awk '{ print $NF }')
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+mkdir -p "$(dirname "$RESULTS")"
+: >"$RESULTS"
+
+failed=0
+for workload in $WORKLOADS; do
+  for format in $FORMATS; do
+    output="$WORK_DIR/$workload-$format"
+    mkdir -p "$output"
+    if result=$("$BENCH" --evid "$EVID" --workload "$workload" \
+      --format "$format" --output "$output" --duration "$DURATION" \
+      --framerate "$FRAMERATE" --size "$SIZE"); then
+      result="{\"version\": \"$VERSION\", \"commit\": \"$COMMIT\", ${result#\{}"
+      echo "$result" >>"$RESULTS"
+      echo "$result"
+    else
+      echo "bench: $workload $format failed" >&2
+      failed=1
+    fi
+    rm -rf "$output"
+  done
+done
+
+echo "Results written to $RESULTS"
+exit $failed
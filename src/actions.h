@@ -22,19 +22,29 @@
 #include "X11/keysym.h"
 
 #define ABORT 1 << 7
+#define PAUSE 1 << 2
 #define SAVE 1 << 1
 #define COPY 1 << 0
 
+/* Starts a recording when running as a daemon */
+#define RECORD_KEYSYM XK_r
+#define RECORD_MODFIELD (Mod4Mask | ShiftMask)
+#define RECORD_KEYCODE(dpy) XKeysymToKeycode(dpy, RECORD_KEYSYM)
+
 #define ABORT_KEYSYM XK_Escape
 #define SAVE_KEYSYM XK_s
 #define COPY_KEYSYM XK_c
+/* Pauses the recording and resumes it */
+#define PAUSE_KEYSYM XK_p
 
 #define ABORT_MODFIELD 0
 #define SAVE_MODFIELD ControlMask
 #define COPY_MODFIELD ControlMask
+#define PAUSE_MODFIELD ControlMask
 
 #define ABORT_KEYCODE(dpy) XKeysymToKeycode(dpy, ABORT_KEYSYM)
 #define SAVE_KEYCODE(dpy) XKeysymToKeycode(dpy, SAVE_KEYSYM)
 #define COPY_KEYCODE(dpy) XKeysymToKeycode(dpy, COPY_KEYSYM)
+#define PAUSE_KEYCODE(dpy) XKeysymToKeycode(dpy, PAUSE_KEYSYM)
 
 #endif
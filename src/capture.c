@@ -0,0 +1,1189 @@
+/**
+    capture.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#define _GNU_SOURCE
+
+#include "capture.h"
+#include "convert.h"
+#include "trace.h"
+#include "util.h"
+
+#include <X11/X.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#ifdef HAVE_XEXTENSIONS
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/shape.h>
+#endif
+
+#ifdef HAVE_XCOMPOSITE
+#include <X11/extensions/Xcomposite.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/uio.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define REGION_BORDER 3
+
+#ifdef HAVE_XEXTENSIONS
+
+static int shm_error = 0;
+
+static int handle_shm_error(Display *dpy, XErrorEvent *error) {
+  /* Attaching fails on displays that don't share memory with us */
+  shm_error = 1;
+  return 0;
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static double parse_framerate(const char *framerate) {
+  char *end;
+  double rate = strtod(framerate, &end);
+  if (*end == '/') {
+    double den = strtod(end + 1, NULL);
+    rate = den > 0 ? rate / den : 0;
+  }
+  return rate;
+}
+
+static int create_segment(Capture *capture, XShmSegmentInfo *segment,
+                          XImage **out) {
+  XImage *image = XShmCreateImage(capture->dpy, capture->visual,
+                                  capture->depth, ZPixmap, NULL, segment,
+                                  capture->region.w, capture->region.h);
+  if (!image) {
+    return -1;
+  }
+  segment->shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
+                          IPC_CREAT | 0600);
+  if (segment->shmid == -1) {
+    XDestroyImage(image);
+    return -1;
+  }
+  segment->shmaddr = image->data = shmat(segment->shmid, NULL, 0);
+  /* Mark it for removal now so it goes away with the process */
+  shmctl(segment->shmid, IPC_RMID, NULL);
+  if (segment->shmaddr == (char *)-1) {
+    XDestroyImage(image);
+    return -1;
+  }
+  segment->readOnly = False;
+  if (!XShmAttach(capture->dpy, segment)) {
+    shmdt(segment->shmaddr);
+    XDestroyImage(image);
+    return -1;
+  }
+  *out = image;
+  return 0;
+}
+
+static void destroy_segment(Capture *capture, XShmSegmentInfo *segment,
+                            XImage **image) {
+  if (*image) {
+    XShmDetach(capture->dpy, segment);
+    XDestroyImage(*image);
+    shmdt(segment->shmaddr);
+    *image = NULL;
+  }
+}
+
+static void show_region(Capture *capture) {
+  const int border = REGION_BORDER;
+  _Region r = capture->region;
+
+  XSetWindowAttributes wa = {0};
+  wa.override_redirect = True;
+  wa.background_pixel = WhitePixel(capture->dpy, DefaultScreen(capture->dpy));
+  capture->region_window = XCreateWindow(
+      capture->dpy, capture->root, r.x - border, r.y - border,
+      r.w + 2 * border, r.h + 2 * border, 0, CopyFromParent, InputOutput,
+      CopyFromParent, CWOverrideRedirect | CWBackPixel, &wa);
+
+  XRectangle inner = {border, border, r.w, r.h};
+  XShapeCombineRectangles(capture->dpy, capture->region_window,
+                          ShapeBounding, 0, 0, &inner, 1, ShapeSubtract,
+                          Unsorted);
+  /* Let the clicks through so the recorded area stays usable */
+  XShapeCombineRectangles(capture->dpy, capture->region_window, ShapeInput, 0,
+                          0, NULL, 0, ShapeSet, Unsorted);
+  XMapRaised(capture->dpy, capture->region_window);
+}
+
+static void draw_cursor(Capture *capture, XImage *image,
+                        XFixesCursorImage *cursor) {
+  int x0 = cursor->x - cursor->xhot - capture->origin_x - capture->source_x;
+  int y0 = cursor->y - cursor->yhot - capture->origin_y - capture->source_y;
+  for (int cy = 0; cy < cursor->height; ++cy) {
+    int y = y0 + cy;
+    if (y < 0 || y >= image->height) {
+      continue;
+    }
+    unsigned int *row =
+        (unsigned int *)(image->data + (size_t)y * image->bytes_per_line);
+    for (int cx = 0; cx < cursor->width; ++cx) {
+      int x = x0 + cx;
+      if (x < 0 || x >= image->width) {
+        continue;
+      }
+      /* XFixes hands out premultiplied ARGB stored in longs */
+      unsigned long src = cursor->pixels[cy * cursor->width + cx];
+      unsigned int alpha = (src >> 24) & 0xFF;
+      if (!alpha) {
+        continue;
+      }
+      if (capture->pix_fmt[0] == 'r') {
+        src = (src & 0xFF00FF00) | ((src >> 16) & 0xFF) | ((src & 0xFF) << 16);
+      }
+      unsigned int dst = row[x];
+      unsigned int pixel = 0;
+      for (int shift = 0; shift < 24; shift += 8) {
+        unsigned int s = (src >> shift) & 0xFF;
+        unsigned int d = (dst >> shift) & 0xFF;
+        pixel |= ((s + d * (255 - alpha) / 255) & 0xFF) << shift;
+      }
+      row[x] = pixel;
+    }
+  }
+}
+
+static void slot_planes(Capture *capture, CaptureSlot *slot,
+                        uint8_t *planes[3], int strides[3]) {
+  int width = capture->width & ~1;
+  int height = capture->height & ~1;
+  planes[0] = slot->yuv;
+  planes[1] = planes[0] + (size_t)width * height;
+  planes[2] = planes[1] + (size_t)(width / 2) * (height / 2);
+  strides[0] = width;
+  strides[1] = strides[2] = width / 2;
+}
+
+static int write_data(Capture *capture, char *data, size_t left) {
+  while (left > 0) {
+    ssize_t sent;
+    if (capture->zero_copy) {
+      struct iovec iov = {.iov_base = data, .iov_len = left};
+      sent = vmsplice(capture->fd, &iov, 1, 0);
+    } else {
+      sent = write(capture->fd, data, left);
+    }
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += sent;
+    left -= sent;
+  }
+  return 0;
+}
+
+static int write_slot(Capture *capture, CaptureSlot *slot,
+                      long long timestamp) {
+  XImage *image = slot->image;
+  if (capture->encoder) {
+    if (capture->convert) {
+      uint8_t *planes[3];
+      int strides[3];
+      slot_planes(capture, slot, planes, strides);
+      return encoder_write_yuv(capture->encoder, planes, strides, timestamp);
+    }
+    if (capture->scaled_size) {
+      return encoder_write(capture->encoder, (char *)slot->scaled,
+                           capture->width * 4, timestamp);
+    }
+    return encoder_write(capture->encoder, image->data,
+                         image->bytes_per_line, timestamp);
+  }
+  if (capture->convert) {
+    return write_data(capture, (char *)slot->yuv, capture->yuv_size);
+  }
+  if (capture->scaled_size) {
+    return write_data(capture, (char *)slot->scaled, capture->scaled_size);
+  }
+  return write_data(capture, image->data, capture->frame_size);
+}
+
+static void block_signals(void) {
+  /* Signals are left to the supervisor */
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+/* Hands a grabbed slot to the workers, or straight to the writer when there
+ * is nothing to convert */
+static void submit_slot(Capture *capture, CaptureSlot *slot) {
+  slot->sequence = capture->sequence++;
+  if (capture->workers_count) {
+    queue_push(&capture->captured, slot);
+    sem_post(&capture->captured_count);
+  } else {
+    queue_push(&capture->ready, slot);
+    sem_post(&capture->ready_count);
+  }
+}
+
+/* Waits for the next slot in queue, NULL once nothing more will come */
+static CaptureSlot *wait_slot(Queue *queue, sem_t *count, atomic_int *more) {
+  while (sem_wait(count) == -1 && errno == EINTR) {
+  }
+  for (;;) {
+    /* Read first: once cleared every push has been published */
+    int producing = atomic_load(more);
+    CaptureSlot *slot = queue_pop(queue);
+    if (slot || !producing) {
+      return slot;
+    }
+    /* Another producer claimed a cell before this one but isn't done */
+    sched_yield();
+  }
+}
+
+static void *convert_loop(void *arg) {
+  Capture *capture = arg;
+  block_signals();
+
+  int width = capture->width & ~1;
+  int height = capture->height & ~1;
+  int bgr = capture->pix_fmt[0] == 'b';
+  CaptureSlot *slot;
+  while ((slot = wait_slot(&capture->captured, &capture->captured_count,
+                           &capture->grabbing))) {
+    const uint8_t *pixels = (const uint8_t *)slot->image->data;
+    int stride = slot->image->bytes_per_line;
+    if (capture->scaled_size) {
+      convert_scale(pixels, stride, capture->region.w, capture->region.h,
+                    slot->scaled, capture->width * 4, capture->width,
+                    capture->height);
+      pixels = slot->scaled;
+      stride = capture->width * 4;
+    }
+    if (capture->convert) {
+      uint8_t *planes[3];
+      int strides[3];
+      slot_planes(capture, slot, planes, strides);
+      convert_i420(pixels, stride, width, height, bgr ? 2 : 0, bgr ? 0 : 2,
+                   planes, strides);
+    }
+    queue_push(&capture->ready, slot);
+    sem_post(&capture->ready_count);
+  }
+
+  if (atomic_fetch_sub(&capture->workers_running, 1) == 1) {
+    atomic_store(&capture->producing, 0);
+    sem_post(&capture->ready_count);
+  }
+  return NULL;
+}
+
+/* Writes frames in capture order. The last slot written is held on to until
+ * the next one is out: it's what gets repeated, and pages handed over with
+ * vmsplice must not be touched before ffmpeg read them. As long as a frame
+ * doesn't fit in the pipe, finishing the splice of one frame means the ones
+ * before it have been consumed entirely. */
+static void *write_loop(void *arg) {
+  Capture *capture = arg;
+  block_signals();
+
+  CaptureSlot *waiting[CAPTURE_SLOTS] = {0};
+  CaptureSlot *last = NULL;
+  unsigned long next = 0;
+  CaptureSlot *slot;
+  while ((slot = wait_slot(&capture->ready, &capture->ready_count,
+                           &capture->producing))) {
+    /* Workers may finish out of order */
+    waiting[slot->sequence % CAPTURE_SLOTS] = slot;
+
+    while ((slot = waiting[next % CAPTURE_SLOTS]) && slot->sequence == next) {
+      waiting[next % CAPTURE_SLOTS] = NULL;
+      next++;
+      if (!capture->failed && last && !capture->encoder && !capture->vfr) {
+        /* ffmpeg derives timestamps from the frame count, ticks that were
+         * dropped are filled with the last frame to stay in sync with the
+         * wall clock. The in-process encoder just skips them. */
+        long long ticks = (slot->timestamp - last->timestamp +
+                           capture->frame_interval / 2) /
+                          capture->frame_interval;
+        for (; ticks > 1 && !capture->failed; --ticks) {
+          capture->failed = write_slot(capture, last, 0) == -1;
+          atomic_fetch_add(&capture->duplicated, 1);
+        }
+      }
+      if (!capture->failed &&
+          write_slot(capture, slot, slot->timestamp) == -1) {
+        capture->failed = 1;
+      }
+      if (!capture->failed) {
+        if (!atomic_load(&capture->written)) {
+          atomic_store(&capture->first_written, now_ns());
+          trace("first frame written");
+        }
+        atomic_fetch_add(&capture->written, 1);
+        atomic_store(&capture->written_until, slot->timestamp);
+      }
+      if (capture->failed) {
+        atomic_store(&capture->stop, 1);
+      }
+      if (last) {
+        queue_push(&capture->free_slots, last);
+      }
+      last = slot;
+    }
+  }
+
+  /* Repeat the last frame so it lasts until the end of the recording */
+  if (last && capture->vfr && !capture->failed) {
+    write_slot(capture, last, now_ns() - capture->shift);
+  }
+  if (last) {
+    queue_push(&capture->free_slots, last);
+  }
+  eventfd_write(capture->done_fd, 1);
+  return NULL;
+}
+
+#if defined(HAVE_XDAMAGE) || defined(HAVE_XCOMPOSITE)
+/* r is in source coordinates and within the region */
+static void grab_rectangle(Capture *capture, XImage *image, XRectangle *r) {
+  XImage *scratch = XShmCreateImage(
+      capture->dpy, capture->visual, capture->depth, ZPixmap,
+      capture->scratch_segment.shmaddr, &capture->scratch_segment, r->width,
+      r->height);
+  if (!scratch) {
+    return;
+  }
+  XShmGetImage(capture->dpy, capture->source, scratch, r->x, r->y,
+               AllPlanes);
+  int x = r->x - capture->source_x;
+  int y = r->y - capture->source_y;
+  for (int row = 0; row < r->height; ++row) {
+    memcpy(image->data + (size_t)(y + row) * image->bytes_per_line + x * 4,
+           scratch->data + (size_t)row * scratch->bytes_per_line,
+           (size_t)r->width * 4);
+  }
+  XDestroyImage(scratch);
+}
+#endif
+
+#ifdef HAVE_XCOMPOSITE
+/* The part of the region the followed window covers, in its coordinates */
+static XRectangle window_area(Capture *capture) {
+  XRectangle area = {0, 0, capture->region.w, capture->region.h};
+  if ((unsigned int)capture->window_w < capture->region.w) {
+    area.width = capture->window_w;
+  }
+  if ((unsigned int)capture->window_h < capture->region.h) {
+    area.height = capture->window_h;
+  }
+  return area;
+}
+#endif
+
+static void grab_frame(Capture *capture, XImage *image) {
+#ifdef HAVE_XCOMPOSITE
+  XRectangle area = window_area(capture);
+  if (capture->window && (area.width != capture->region.w ||
+                          area.height != capture->region.h)) {
+    /* The size is fixed, what the shrunk window doesn't cover is black */
+    memset(image->data, 0, capture->frame_size);
+    if (area.width && area.height) {
+      grab_rectangle(capture, image, &area);
+    }
+    return;
+  }
+#endif
+  XShmGetImage(capture->dpy, capture->source, image, capture->source_x,
+               capture->source_y, AllPlanes);
+}
+
+#ifdef HAVE_XCOMPOSITE
+static Display *follow_dpy = NULL;
+static XErrorHandler previous_error_handler = NULL;
+
+static int handle_follow_error(Display *dpy, XErrorEvent *error) {
+  /* The followed window can go away between any two requests, the capture
+   * learns about it from the DestroyNotify that follows */
+  if (dpy == follow_dpy) {
+    return 0;
+  }
+  return previous_error_handler(dpy, error);
+}
+
+static void name_pixmap(Capture *capture) {
+  if (capture->pixmap) {
+    XFreePixmap(capture->dpy, capture->pixmap);
+  }
+  capture->pixmap = XCompositeNameWindowPixmap(capture->dpy, capture->window);
+  capture->source = capture->pixmap;
+}
+
+/* The window got a new pixmap, every slot needs to be grabbed again */
+static void refresh_window(Capture *capture) {
+#ifdef HAVE_XDAMAGE
+  if (!capture->vfr) {
+    return;
+  }
+  XRectangle area = window_area(capture);
+  XFixesSetRegion(capture->dpy, capture->area, &area, 1);
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    capture->slots[i].stale = 1;
+    XFixesSetRegion(capture->dpy, capture->pending[i], NULL, 0);
+  }
+#endif
+}
+
+static void handle_window_event(Capture *capture, XEvent *event) {
+  switch (event->type) {
+  case ConfigureNotify: {
+    XConfigureEvent *ce = &event->xconfigure;
+    if (ce->window != capture->window) {
+      break;
+    }
+    capture->origin_x = ce->x;
+    capture->origin_y = ce->y;
+    if (capture->region_window) {
+      XMoveWindow(capture->dpy, capture->region_window, ce->x - REGION_BORDER,
+                  ce->y - REGION_BORDER);
+    }
+    if (ce->width != capture->window_w || ce->height != capture->window_h) {
+      capture->window_w = ce->width;
+      capture->window_h = ce->height;
+      /* Resizing allocates a new pixmap, the named one stops updating */
+      if (capture->mapped) {
+        name_pixmap(capture);
+      }
+      refresh_window(capture);
+    }
+    break;
+  }
+  case MapNotify: {
+    if (event->xmap.window == capture->window && !capture->mapped) {
+      capture->mapped = 1;
+      name_pixmap(capture);
+      refresh_window(capture);
+    }
+    break;
+  }
+  case UnmapNotify: {
+    /* Naming fails while unmapped, the last pixmap is recorded meanwhile */
+    if (event->xunmap.window == capture->window) {
+      capture->mapped = 0;
+    }
+    break;
+  }
+  case DestroyNotify: {
+    if (event->xdestroywindow.window == capture->window) {
+      capture->mapped = 0;
+      capture->gone = 1;
+    }
+    break;
+  }
+  default: {
+    break;
+  }
+  }
+}
+
+/* Follows the window by grabbing its own pixmap, which is kept up to date
+ * offscreen whether it's covered or not and doesn't care where it is. */
+static void init_follow(Capture *capture, Window window) {
+  Display *dpy = capture->dpy;
+  int event_base, error_base;
+  int major = 0, minor = 2;
+  if (!XCompositeQueryExtension(dpy, &event_base, &error_base) ||
+      !XCompositeQueryVersion(dpy, &major, &minor) ||
+      (major == 0 && minor < 2)) {
+    return;
+  }
+
+  follow_dpy = dpy;
+  /* Grabs on the main thread swap handlers too, it may be back already */
+  XErrorHandler previous = XSetErrorHandler(&handle_follow_error);
+  if (previous != &handle_follow_error) {
+    previous_error_handler = previous;
+  }
+  /* It may already be gone when the daemon records the same region again.
+   * Pixmaps of other depths or with borders can't be copied as they are. */
+  XWindowAttributes attrs;
+  Visual *visual = capture->visual;
+  if (!XGetWindowAttributes(dpy, window, &attrs) ||
+      attrs.map_state != IsViewable || attrs.depth != capture->depth ||
+      attrs.border_width || attrs.visual->red_mask != visual->red_mask ||
+      attrs.visual->green_mask != visual->green_mask ||
+      attrs.visual->blue_mask != visual->blue_mask ||
+      create_segment(capture, &capture->scratch_segment, &capture->scratch)) {
+    XSetErrorHandler(previous_error_handler);
+    follow_dpy = NULL;
+    return;
+  }
+
+  XSelectInput(dpy, window, StructureNotifyMask);
+  XCompositeRedirectWindow(dpy, window, CompositeRedirectAutomatic);
+  capture->window = window;
+  capture->window_w = attrs.width;
+  capture->window_h = attrs.height;
+  capture->mapped = 1;
+  capture->origin_x = attrs.x;
+  capture->origin_y = attrs.y;
+  capture->source_x = capture->source_y = 0;
+  name_pixmap(capture);
+}
+#endif
+
+/* Keeps up with the followed window, anything else queued is dropped */
+static void handle_events(Capture *capture) {
+  XEvent event;
+  while (XPending(capture->dpy)) {
+    XNextEvent(capture->dpy, &event);
+#ifdef HAVE_XCOMPOSITE
+    if (capture->window) {
+      handle_window_event(capture, &event);
+    }
+#endif
+  }
+}
+
+/* Blocks while paused, returns for how long */
+static long long wait_resumed(Capture *capture) {
+  if (!atomic_load(&capture->paused)) {
+    return 0;
+  }
+  long long start = now_ns();
+  pthread_mutex_lock(&capture->pause_lock);
+  while (atomic_load(&capture->paused) && !atomic_load(&capture->stop)) {
+    pthread_cond_wait(&capture->resumed, &capture->pause_lock);
+  }
+  pthread_mutex_unlock(&capture->pause_lock);
+  return now_ns() - start;
+}
+
+#ifdef HAVE_XDAMAGE
+/* Brings the slot up to date with everything damaged since it was last
+ * sent, returns 0 when nothing in it would change. */
+static int grab_damage(Capture *capture, CaptureSlot *slot) {
+  Display *dpy = capture->dpy;
+  XImage *image = slot->image;
+  int current = slot->index;
+
+  handle_events(capture);
+
+#ifdef HAVE_XCOMPOSITE
+  if (capture->gone) {
+    /* Its damage went with it, nothing will change anymore */
+    XFixesSetRegion(dpy, capture->fresh, NULL, 0);
+  } else {
+    XDamageSubtract(dpy, capture->damage, None, capture->fresh);
+  }
+#else
+  XDamageSubtract(dpy, capture->damage, None, capture->fresh);
+#endif
+  XFixesIntersectRegion(dpy, capture->fresh, capture->fresh, capture->area);
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    XFixesUnionRegion(dpy, capture->pending[i], capture->pending[i],
+                      capture->fresh);
+  }
+
+  int changed = 0;
+  XFixesCursorImage *cursor = NULL;
+  if (capture->draw_mouse) {
+    cursor = XFixesGetCursorImage(dpy);
+    /* Relative to the source, a followed window may move under it */
+    int cursor_x = cursor ? cursor->x - capture->origin_x : 0;
+    int cursor_y = cursor ? cursor->y - capture->origin_y : 0;
+    if (cursor &&
+        (cursor_x != capture->cursor_x || cursor_y != capture->cursor_y ||
+         cursor->cursor_serial != capture->cursor_serial)) {
+      changed = 1;
+      capture->cursor_x = cursor_x;
+      capture->cursor_y = cursor_y;
+      capture->cursor_serial = cursor->cursor_serial;
+    }
+    /* Pixels under the pointer drawn last time this slot was used */
+    XRectangle *under = &capture->cursor_rects[current];
+    if (under->width && under->height) {
+      XserverRegion r = XFixesCreateRegion(dpy, under, 1);
+      XFixesIntersectRegion(dpy, r, r, capture->area);
+      XFixesUnionRegion(dpy, capture->pending[current],
+                        capture->pending[current], r);
+      XFixesDestroyRegion(dpy, r);
+    }
+  }
+
+  int nrects = 0;
+  XRectangle *rects =
+      XFixesFetchRegion(dpy, capture->pending[current], &nrects);
+  if (!nrects && !changed && !slot->stale) {
+    if (rects) {
+      XFree(rects);
+    }
+    if (cursor) {
+      XFree(cursor);
+    }
+    return 0;
+  }
+
+  unsigned long damaged = 0;
+  for (int i = 0; i < nrects; ++i) {
+    damaged += (unsigned long)rects[i].width * rects[i].height;
+  }
+  if (slot->stale ||
+      damaged * 2 > (unsigned long)capture->region.w * capture->region.h) {
+    grab_frame(capture, image);
+    slot->stale = 0;
+  } else {
+    for (int i = 0; i < nrects; ++i) {
+      grab_rectangle(capture, image, &rects[i]);
+    }
+  }
+  if (rects) {
+    XFree(rects);
+  }
+  XFixesSetRegion(dpy, capture->pending[current], NULL, 0);
+
+  if (cursor) {
+    draw_cursor(capture, image, cursor);
+    XRectangle *under = &capture->cursor_rects[current];
+    under->x = cursor->x - cursor->xhot - capture->origin_x;
+    under->y = cursor->y - cursor->yhot - capture->origin_y;
+    under->width = cursor->width;
+    under->height = cursor->height;
+    XFree(cursor);
+  }
+  return 1;
+}
+
+static void damage_loop(Capture *capture) {
+  CaptureSlot *slot = NULL;
+  long long next = now_ns();
+
+  while (!atomic_load(&capture->stop)) {
+    long long paused = wait_resumed(capture);
+    if (paused) {
+      /* Whatever changed meanwhile comes with the first frame after */
+      capture->shift += paused;
+      next = now_ns();
+      if (atomic_load(&capture->stop)) {
+        break;
+      }
+    }
+    /* Damage piles up in the server while no slot is free */
+    if (!slot) {
+      slot = queue_pop(&capture->free_slots);
+    }
+    if (slot && grab_damage(capture, slot)) {
+      slot->timestamp = now_ns() - capture->shift;
+      submit_slot(capture, slot);
+      slot = NULL;
+    }
+
+    /* Timestamps come from the wall clock, late ticks are simply skipped */
+    next += capture->frame_interval;
+    long long now = now_ns();
+    if (now > next) {
+      next = now;
+    }
+    struct timespec ts = {.tv_sec = next / NSEC_PER_SEC,
+                          .tv_nsec = next % NSEC_PER_SEC};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+  }
+
+  if (slot) {
+    queue_push(&capture->free_slots, slot);
+  }
+}
+#endif
+
+static void constant_loop(Capture *capture) {
+  long long next = now_ns();
+
+  while (!atomic_load(&capture->stop)) {
+    if (wait_resumed(capture)) {
+      if (atomic_load(&capture->stop)) {
+        break;
+      }
+      /* Picks up a tick after the last frame, as if it never stopped */
+      long long now = now_ns();
+      if (now > next) {
+        capture->shift += now - next;
+        next = now;
+      }
+    }
+    CaptureSlot *slot = queue_pop(&capture->free_slots);
+    if (slot) {
+      XImage *image = slot->image;
+      handle_events(capture);
+      grab_frame(capture, image);
+      if (capture->draw_mouse) {
+        XFixesCursorImage *cursor = XFixesGetCursorImage(capture->dpy);
+        if (cursor) {
+          draw_cursor(capture, image, cursor);
+          XFree(cursor);
+        }
+      }
+      slot->timestamp = next - capture->shift;
+      submit_slot(capture, slot);
+    } else {
+      /* Everything is still in flight, the encoder is behind */
+      atomic_fetch_add(&capture->dropped, 1);
+    }
+
+    /* Ticks missed while grabbing took too long are dropped as well */
+    next += capture->frame_interval;
+    while (now_ns() > next + capture->frame_interval &&
+           !atomic_load(&capture->stop)) {
+      atomic_fetch_add(&capture->dropped, 1);
+      next += capture->frame_interval;
+    }
+
+    struct timespec ts = {.tv_sec = next / NSEC_PER_SEC,
+                          .tv_nsec = next % NSEC_PER_SEC};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+  }
+}
+
+static void finish_grabbing(Capture *capture) {
+  /* Wake everyone waiting downstream so they notice the end */
+  atomic_store(&capture->grabbing, 0);
+  if (capture->workers_count) {
+    for (int i = 0; i < capture->workers_count; ++i) {
+      sem_post(&capture->captured_count);
+    }
+  } else {
+    atomic_store(&capture->producing, 0);
+    sem_post(&capture->ready_count);
+  }
+}
+
+static void *capture_loop(void *arg) {
+  Capture *capture = arg;
+  block_signals();
+
+#ifdef HAVE_XDAMAGE
+  if (capture->vfr) {
+    damage_loop(capture);
+  } else {
+    constant_loop(capture);
+  }
+#else
+  constant_loop(capture);
+#endif
+
+  finish_grabbing(capture);
+  return NULL;
+}
+
+#ifdef HAVE_XDAMAGE
+static void init_damage(Capture *capture) {
+  Display *dpy = capture->dpy;
+  int event_base, error_base;
+  if (!XDamageQueryExtension(dpy, &event_base, &error_base) ||
+      (!capture->scratch &&
+       create_segment(capture, &capture->scratch_segment, &capture->scratch))) {
+    return;
+  }
+
+  XRectangle area = {capture->source_x, capture->source_y, capture->region.w,
+                     capture->region.h};
+  capture->area = XFixesCreateRegion(dpy, &area, 1);
+  capture->fresh = XFixesCreateRegion(dpy, NULL, 0);
+  /* Every slot starts out empty and needs a full grab */
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    capture->pending[i] = XFixesCreateRegion(dpy, &area, 1);
+  }
+  Drawable drawable = capture->root;
+#ifdef HAVE_XCOMPOSITE
+  /* In window coordinates, which are the pixmap's too without a border */
+  if (capture->window) {
+    drawable = capture->window;
+  }
+#endif
+  capture->damage = XDamageCreate(dpy, drawable, XDamageReportNonEmpty);
+  capture->cursor_x = capture->cursor_y = -1;
+  capture->vfr = 1;
+}
+#endif
+
+int capture_init(Capture *capture, Display *dpy, Args *args,
+                 _Region region) {
+  capture->fd = -1;
+  capture->done_fd = -1;
+  double framerate = parse_framerate(args->framerate);
+  if (!dpy || framerate <= 0) {
+    return -1;
+  }
+
+  capture->dpy = dpy;
+  if (!XShmQueryExtension(capture->dpy)) {
+    capture_destroy(capture);
+    return -1;
+  }
+
+  int screen = DefaultScreen(capture->dpy);
+  Visual *visual = DefaultVisual(capture->dpy, screen);
+  capture->visual = visual;
+  capture->depth = DefaultDepth(capture->dpy, screen);
+  capture->root = RootWindow(capture->dpy, screen);
+  capture->region = region;
+  capture->source = capture->root;
+  capture->source_x = region.x;
+  capture->source_y = region.y;
+  capture->draw_mouse = args->draw_mouse;
+  capture->frame_interval = NSEC_PER_SEC / framerate;
+
+  if (visual->red_mask == 0xFF0000 && visual->green_mask == 0xFF00 &&
+      visual->blue_mask == 0xFF) {
+    capture->pix_fmt = "bgr0";
+  } else if (visual->red_mask == 0xFF && visual->green_mask == 0xFF00 &&
+             visual->blue_mask == 0xFF0000) {
+    capture->pix_fmt = "rgb0";
+  } else {
+    capture_destroy(capture);
+    return -1;
+  }
+
+  shm_error = 0;
+  XSetErrorHandler(&handle_shm_error);
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    CaptureSlot *slot = &capture->slots[i];
+    slot->index = i;
+    if (create_segment(capture, &slot->segment, &slot->image)) {
+      break;
+    }
+  }
+  XSync(capture->dpy, False);
+  if (shm_error || !capture->slots[CAPTURE_SLOTS - 1].image) {
+    capture_destroy(capture);
+    XSetErrorHandler(NULL);
+    return -1;
+  }
+  XSetErrorHandler(NULL);
+
+  XImage *image = capture->slots[0].image;
+  if (image->bits_per_pixel != 32 ||
+      image->bytes_per_line != image->width * 4) {
+    capture_destroy(capture);
+    return -1;
+  }
+  capture->frame_size = (size_t)image->bytes_per_line * image->height;
+  /* Downscaled here, the encoder never sees the full resolution */
+  get_scaled_size(args, region.w, region.h, &capture->width,
+                  &capture->height);
+  capture->scaled_size =
+      capture->width != (int)region.w || capture->height != (int)region.h
+          ? (size_t)capture->width * capture->height * 4
+          : 0;
+  /* Everything but low quality gifs ends up as yuv420p, converting it here
+   * spares ffmpeg a crop filter and a swscale pass */
+  capture->yuv = (!args->gif || args->replay) && capture->width >= 2 &&
+                 capture->height >= 2;
+
+#ifdef HAVE_XCOMPOSITE
+  if (region.window) {
+    init_follow(capture, region.window);
+  }
+#endif
+
+#ifdef HAVE_XDAMAGE
+  if (args->damage) {
+    init_damage(capture);
+  }
+#endif
+
+  if (args->show_region) {
+    show_region(capture);
+    XFlush(capture->dpy);
+  }
+
+  return 0;
+}
+
+static int init_pipeline(Capture *capture) {
+  if (queue_init(&capture->free_slots, CAPTURE_SLOTS) ||
+      queue_init(&capture->captured, CAPTURE_SLOTS) ||
+      queue_init(&capture->ready, CAPTURE_SLOTS)) {
+    return -1;
+  }
+  sem_init(&capture->captured_count, 0, 0);
+  sem_init(&capture->ready_count, 0, 0);
+  pthread_mutex_init(&capture->pause_lock, NULL);
+  pthread_cond_init(&capture->resumed, NULL);
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    queue_push(&capture->free_slots, &capture->slots[i]);
+  }
+  capture->sequence = 0;
+  atomic_store(&capture->dropped, 0);
+  atomic_store(&capture->written, 0);
+  atomic_store(&capture->duplicated, 0);
+  atomic_store(&capture->written_until, 0);
+  atomic_store(&capture->first_written, 0);
+  atomic_store(&capture->grabbing, 1);
+  atomic_store(&capture->producing, 1);
+  atomic_store(&capture->stop, 0);
+  atomic_store(&capture->paused, 0);
+  atomic_store(&capture->paused_time, 0);
+  capture->shift = 0;
+  return 0;
+}
+
+static void release_pipeline(Capture *capture) {
+  if (capture->free_slots.cells) {
+    sem_destroy(&capture->captured_count);
+    sem_destroy(&capture->ready_count);
+    pthread_mutex_destroy(&capture->pause_lock);
+    pthread_cond_destroy(&capture->resumed);
+  }
+  queue_destroy(&capture->free_slots);
+  queue_destroy(&capture->captured);
+  queue_destroy(&capture->ready);
+}
+
+int capture_start(Capture *capture, int fd, Encoder *encoder) {
+  capture->fd = fd;
+  capture->encoder = encoder;
+  capture->failed = 0;
+  /* libav wants yuv420p as well, gifs are quantized from the pixels */
+  capture->convert = encoder ? !encoder->gif : capture->yuv;
+
+  size_t size = capture->frame_size;
+  if (capture->scaled_size) {
+    for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+      CaptureSlot *slot = &capture->slots[i];
+      if (!slot->scaled && !(slot->scaled = malloc(capture->scaled_size))) {
+        return -1;
+      }
+    }
+    size = capture->scaled_size;
+  }
+  if (capture->convert) {
+    capture->yuv_size =
+        convert_i420_size(capture->width & ~1, capture->height & ~1);
+    for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+      CaptureSlot *slot = &capture->slots[i];
+      if (!slot->yuv && !(slot->yuv = malloc(capture->yuv_size))) {
+        return -1;
+      }
+    }
+    size = capture->yuv_size;
+  }
+  capture->zero_copy = 0;
+  if (fd != -1) {
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    capture->zero_copy = pipe_size > 0 && size > (size_t)pipe_size;
+  }
+
+  capture->done_fd = eventfd(0, EFD_CLOEXEC);
+  if (capture->done_fd == -1 || init_pipeline(capture)) {
+    release_pipeline(capture);
+    return -1;
+  }
+
+  capture->workers_count = 0;
+  int process = capture->convert || capture->scaled_size;
+  if (process) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    capture->workers_count =
+        cpus - 1 < 1                     ? 1
+        : cpus - 1 > CAPTURE_MAX_WORKERS ? CAPTURE_MAX_WORKERS
+                                         : cpus - 1;
+  }
+  atomic_store(&capture->workers_running, capture->workers_count);
+
+  if (pthread_create(&capture->writer, NULL, write_loop, capture)) {
+    release_pipeline(capture);
+    return -1;
+  }
+  int workers_count = capture->workers_count;
+  for (int i = 0; i < workers_count; ++i) {
+    if (pthread_create(&capture->workers[i], NULL, convert_loop, capture)) {
+      /* Go on with the ones that did start */
+      atomic_fetch_sub(&capture->workers_running, workers_count - i);
+      capture->workers_count = i;
+      break;
+    }
+  }
+  if ((process && !capture->workers_count) ||
+      pthread_create(&capture->thread, NULL, capture_loop, capture)) {
+    finish_grabbing(capture);
+    for (int i = 0; i < capture->workers_count; ++i) {
+      pthread_join(capture->workers[i], NULL);
+    }
+    pthread_join(capture->writer, NULL);
+    release_pipeline(capture);
+    return -1;
+  }
+  capture->running = 1;
+  return 0;
+}
+
+void capture_stop(Capture *capture) {
+  if (!capture->running) {
+    return;
+  }
+  atomic_store(&capture->stop, 1);
+  /* Wakes up the capture thread if it's paused */
+  capture_pause(capture, 0);
+  /* Frames already grabbed are still written */
+  pthread_join(capture->thread, NULL);
+  for (int i = 0; i < capture->workers_count; ++i) {
+    pthread_join(capture->workers[i], NULL);
+  }
+  pthread_join(capture->writer, NULL);
+  capture->running = 0;
+  release_pipeline(capture);
+  /* Closing the pipe is what tells ffmpeg to finish the file */
+  if (capture->fd != -1) {
+    close(capture->fd);
+    capture->fd = -1;
+  }
+}
+
+int capture_pausable(Capture *capture) {
+  return capture->encoder || !capture->vfr;
+}
+
+void capture_pause(Capture *capture, int paused) {
+  if (!capture->running) {
+    return;
+  }
+  pthread_mutex_lock(&capture->pause_lock);
+  if (paused && !atomic_load(&capture->paused)) {
+    capture->paused_at = now_ns();
+  } else if (!paused && atomic_load(&capture->paused)) {
+    atomic_fetch_add(&capture->paused_time, now_ns() - capture->paused_at);
+  }
+  atomic_store(&capture->paused, paused);
+  pthread_cond_signal(&capture->resumed);
+  pthread_mutex_unlock(&capture->pause_lock);
+}
+
+long long capture_paused_time(Capture *capture) {
+  long long paused_time = atomic_load(&capture->paused_time);
+  if (capture->running && atomic_load(&capture->paused)) {
+    paused_time += now_ns() - capture->paused_at;
+  }
+  return paused_time;
+}
+
+void capture_destroy(Capture *capture) {
+  if (!capture->dpy) {
+    return;
+  }
+  if (capture->done_fd != -1) {
+    close(capture->done_fd);
+    capture->done_fd = -1;
+  }
+  if (capture->region_window) {
+    XDestroyWindow(capture->dpy, capture->region_window);
+    capture->region_window = 0;
+  }
+#ifdef HAVE_XDAMAGE
+  if (capture->vfr) {
+    /* Gone along with a destroyed window */
+#ifdef HAVE_XCOMPOSITE
+    if (!capture->gone) {
+      XDamageDestroy(capture->dpy, capture->damage);
+    }
+#else
+    XDamageDestroy(capture->dpy, capture->damage);
+#endif
+    XFixesDestroyRegion(capture->dpy, capture->area);
+    XFixesDestroyRegion(capture->dpy, capture->fresh);
+    for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+      XFixesDestroyRegion(capture->dpy, capture->pending[i]);
+    }
+    capture->vfr = 0;
+  }
+#endif
+  destroy_segment(capture, &capture->scratch_segment, &capture->scratch);
+#ifdef HAVE_XCOMPOSITE
+  if (capture->window) {
+    if (!capture->gone) {
+      XSelectInput(capture->dpy, capture->window, NoEventMask);
+      XCompositeUnredirectWindow(capture->dpy, capture->window,
+                                 CompositeRedirectAutomatic);
+    }
+    if (capture->pixmap) {
+      XFreePixmap(capture->dpy, capture->pixmap);
+      capture->pixmap = 0;
+    }
+    capture->window = 0;
+  }
+#endif
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    CaptureSlot *slot = &capture->slots[i];
+    destroy_segment(capture, &slot->segment, &slot->image);
+    free(slot->yuv);
+    slot->yuv = NULL;
+    free(slot->scaled);
+    slot->scaled = NULL;
+  }
+  /* The connection outlives the capture, leave it with nothing queued */
+  XSync(capture->dpy, True);
+#ifdef HAVE_XCOMPOSITE
+  if (follow_dpy == capture->dpy) {
+    XSetErrorHandler(previous_error_handler);
+    follow_dpy = NULL;
+  }
+#endif
+  capture->dpy = NULL;
+}
+
+#else
+
+int capture_init(Capture *capture, Display *dpy, Args *args,
+                 _Region region) {
+  return -1;
+}
+
+int capture_start(Capture *capture, int fd, Encoder *encoder) { return -1; }
+
+void capture_stop(Capture *capture) {}
+
+int capture_pausable(Capture *capture) { return 0; }
+
+void capture_pause(Capture *capture, int paused) {}
+
+long long capture_paused_time(Capture *capture) { return 0; }
+
+void capture_destroy(Capture *capture) {}
+
+#endif
@@ -0,0 +1,166 @@
+/**
+    capture.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_CAPTURE_H
+#define EVID_CAPTURE_H
+
+#include "encoder.h"
+#include "queue.h"
+#include "types.h"
+
+#include <X11/Xlib.h>
+
+#ifdef HAVE_XEXTENSIONS
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#endif
+
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
+
+#ifdef HAVE_XCOMPOSITE
+#include <X11/extensions/Xcomposite.h>
+#endif
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Frames go around a ring of slots: the capture thread grabs into a free
+ * one, conversion workers turn it into yuv420p and the writer thread hands
+ * it to the encoder before recycling it. When no slot is free the frame is
+ * dropped rather than stalling the frame clock. */
+#define CAPTURE_SLOTS 6
+#define CAPTURE_MAX_WORKERS 3
+
+typedef struct CaptureSlot CaptureSlot;
+struct CaptureSlot {
+  int index;
+  unsigned long sequence;
+  long long timestamp; /* nanoseconds */
+#ifdef HAVE_XEXTENSIONS
+  XImage *image;
+  XShmSegmentInfo segment;
+#endif
+  uint8_t *yuv;
+  uint8_t *scaled; /* the frame at the output size, when downscaling */
+#ifdef HAVE_XDAMAGE
+  int stale; /* needs a full grab, the followed window was resized */
+#endif
+};
+
+typedef struct Capture Capture;
+struct Capture {
+  Display *dpy;
+  Visual *visual;
+  int depth;
+  Window root;
+  Window region_window;
+  _Region region;
+  Drawable source; /* frames are grabbed from it */
+  int source_x;    /* where the region starts in source */
+  int source_y;
+  int origin_x; /* root coordinates of the source's origin */
+  int origin_y;
+  int draw_mouse;
+  const char *pix_fmt;
+  long long frame_interval; /* nanoseconds */
+  size_t frame_size;
+  int width;  /* size of the frames handed over, smaller than the region */
+  int height; /* when downscaling */
+  size_t scaled_size; /* bytes of a downscaled frame, 0 when not scaling */
+  int fd;
+  Encoder *encoder;
+  int zero_copy;
+  int vfr; /* frames are only sent when the region changes */
+  int yuv; /* frames are piped as yuv420p, cropped to even sizes */
+  int convert; /* slots are converted to yuv420p by the workers */
+  size_t yuv_size;
+  CaptureSlot slots[CAPTURE_SLOTS];
+  Queue free_slots; /* recycled by the writer */
+  Queue captured;   /* waiting for a conversion worker */
+  Queue ready;      /* waiting for the writer, in any order */
+  sem_t captured_count;
+  sem_t ready_count;
+  unsigned long sequence;
+  atomic_ulong dropped;
+  atomic_ulong written;    /* frames handed to the pipe or the encoder */
+  atomic_ulong duplicated; /* repeated to fill ticks that were dropped */
+  atomic_llong written_until; /* timestamp of the last frame written */
+  atomic_llong first_written; /* when the first frame was out, 0 before */
+  atomic_int grabbing;  /* cleared once the capture thread is done */
+  atomic_int producing; /* cleared once nothing more reaches ready */
+  atomic_int workers_running;
+  pthread_t thread;
+  pthread_t workers[CAPTURE_MAX_WORKERS];
+  int workers_count;
+  pthread_t writer;
+  int running;
+  int done_fd; /* readable once the last frame has been written */
+  int failed;
+  atomic_int stop;
+  /* Nothing is grabbed while paused and the time spent is left out of the
+   * timestamps, the encoder sees one continuous recording */
+  atomic_int paused;
+  pthread_mutex_t pause_lock;
+  pthread_cond_t resumed;
+  long long paused_at;      /* when the current pause started */
+  atomic_llong paused_time; /* spent in the pauses before, nanoseconds */
+  long long shift; /* taken off the timestamps, by the capture thread */
+#ifdef HAVE_XDAMAGE
+  Damage damage;
+  XserverRegion area;
+  XserverRegion fresh;
+  XserverRegion pending[CAPTURE_SLOTS]; /* damage not yet in each slot */
+  XRectangle cursor_rects[CAPTURE_SLOTS];
+  int cursor_x;
+  int cursor_y;
+  unsigned long cursor_serial;
+#endif
+#ifdef HAVE_XEXTENSIONS
+  XImage *scratch; /* for grabbing parts of the region */
+  XShmSegmentInfo scratch_segment;
+#endif
+#ifdef HAVE_XCOMPOSITE
+  Window window; /* followed window, 0 when grabbing from the root */
+  Pixmap pixmap; /* the window's contents, redirected offscreen */
+  int window_w;
+  int window_h;
+  int mapped;
+  int gone; /* destroyed, its last pixmap is still around */
+#endif
+};
+
+/* dpy is used by the capture thread alone and is left open afterwards. A
+ * clicked region.window is followed when it can be, grabbing its own pixels
+ * wherever it moves and whatever covers it. */
+int capture_init(Capture *capture, Display *dpy, Args *args, _Region region);
+/* Frames are either written to fd or encoded in-process by encoder */
+int capture_start(Capture *capture, int fd, Encoder *encoder);
+void capture_stop(Capture *capture);
+/* Only frames the encoder times itself can be paused, ffmpeg stamping them
+ * on arrival would see the gap */
+int capture_pausable(Capture *capture);
+void capture_pause(Capture *capture, int paused);
+/* Nanoseconds spent paused so far */
+long long capture_paused_time(Capture *capture);
+void capture_destroy(Capture *capture);
+
+#endif
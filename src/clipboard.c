@@ -3,12 +3,64 @@
 #include "util.h"
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-enum { XA_TARGETS, XA_URI_LIST, XA_GNOME_COPY, XA_LAST };
+/* Properties written at once, anything bigger goes through INCR */
+#define CLIPBOARD_CHUNK (256 * 1024)
+/* Pastes served at the same time, the oldest gives way after that */
+#define CLIPBOARD_TRANSFERS 8
+/* A paste whose requestor deleted nothing for that long is given up */
+#define CLIPBOARD_STALL_TIMEOUT 30000 /* ms */
+
+enum { XA_TARGETS, XA_URI_LIST, XA_GNOME_COPY, XA_MEDIA, XA_LAST };
+
+typedef struct Media Media;
+struct Media {
+  const char *data; /* the whole file, mapped */
+  size_t size;
+  size_t chunk;
+  Atom incr;
+};
+
+/* An INCR transfer, the next chunk goes out once the requestor deleted the
+ * previous one */
+typedef struct Transfer Transfer;
+struct Transfer {
+  Window requestor; /* None when unused */
+  Atom property;
+  Atom target;
+  size_t offset;
+  int done;           /* the closing empty chunk was sent */
+  long long started;  /* ms */
+  long long progress; /* ms, when the requestor last took a chunk */
+};
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Frees the slot and stops listening to a requestor it was the last of */
+static void drop_transfer(Display *dpy, Transfer *transfers,
+                          Transfer *transfer) {
+  Window requestor = transfer->requestor;
+  transfer->requestor = None;
+  for (int i = 0; i < CLIPBOARD_TRANSFERS; ++i) {
+    if (transfers[i].requestor == requestor) {
+      return;
+    }
+  }
+  XSelectInput(dpy, requestor, NoEventMask);
+}
 
 static void deny_selection_request(Display *dpy, XSelectionRequestEvent *sev) {
   XSelectionEvent ssev;
@@ -72,6 +124,165 @@ static void send_gnome_copy(Display *dpy, XSelectionRequestEvent *sev,
   send_string(dpy, sev, gnome_copy, gnome_copy_uri, ARR_SIZE(gnome_copy_uri));
 }
 
+static void notify_requestor(Display *dpy, XSelectionRequestEvent *sev) {
+  XSelectionEvent ssev;
+
+  ssev.type = SelectionNotify;
+  ssev.requestor = sev->requestor;
+  ssev.selection = sev->selection;
+  ssev.target = sev->target;
+  ssev.property = sev->property;
+  ssev.time = sev->time;
+
+  XSendEvent(dpy, sev->requestor, True, NoEventMask, (XEvent *)&ssev);
+}
+
+static const char *media_type(const char *file) {
+  const char *extension = strrchr(file, '.');
+  if (extension && !strcmp(extension, ".gif")) {
+    return "image/gif";
+  }
+  return "video/mp4";
+}
+
+static int map_media(Display *dpy, const char *file, Media *media) {
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !st.st_size) {
+    close(fd);
+    return -1;
+  }
+  /* Pages are read in as the chunks go out and can be dropped again, the
+   * file stays readable through the mapping once it's removed */
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  media->data = data;
+  media->size = st.st_size;
+  /* Requests are limited in size, leave room for the header */
+  long max_request = XExtendedMaxRequestSize(dpy);
+  if (!max_request) {
+    max_request = XMaxRequestSize(dpy);
+  }
+  media->chunk = CLIPBOARD_CHUNK;
+  if ((size_t)max_request * 4 - 100 < media->chunk) {
+    media->chunk = (size_t)max_request * 4 - 100;
+  }
+  media->incr = XInternAtom(dpy, "INCR", False);
+  return 0;
+}
+
+static void send_media(Display *dpy, XSelectionRequestEvent *sev,
+                       Media *media, Transfer *transfers) {
+  if (media->size <= media->chunk) {
+    XChangeProperty(dpy, sev->requestor, sev->property, sev->target, 8,
+                    PropModeReplace, (const unsigned char *)media->data,
+                    media->size);
+    notify_requestor(dpy, sev);
+    return;
+  }
+
+  /* Reuse a finished slot or give up on the one started first */
+  Transfer *transfer = &transfers[0];
+  for (int i = 0; i < CLIPBOARD_TRANSFERS; ++i) {
+    if (transfers[i].requestor == None) {
+      transfer = &transfers[i];
+      break;
+    }
+    if (transfers[i].started < transfer->started) {
+      transfer = &transfers[i];
+    }
+  }
+  if (transfer->requestor != None) {
+    drop_transfer(dpy, transfers, transfer);
+  }
+  transfer->requestor = sev->requestor;
+  transfer->property = sev->property;
+  transfer->target = sev->target;
+  transfer->offset = 0;
+  transfer->done = 0;
+  transfer->started = transfer->progress = now_ms();
+
+  /* The deletions of the property tell when to send more, requestors that
+   * go away in the middle are dropped */
+  XSelectInput(dpy, sev->requestor, PropertyChangeMask | StructureNotifyMask);
+  long size = media->size;
+  XChangeProperty(dpy, sev->requestor, sev->property, media->incr, 32,
+                  PropModeReplace, (unsigned char *)&size, 1);
+  notify_requestor(dpy, sev);
+}
+
+static void continue_transfer(Display *dpy, XPropertyEvent *pev, Media *media,
+                              Transfer *transfers) {
+  if (pev->state != PropertyDelete) {
+    return;
+  }
+  for (int i = 0; i < CLIPBOARD_TRANSFERS; ++i) {
+    Transfer *transfer = &transfers[i];
+    if (transfer->requestor != pev->window ||
+        transfer->property != pev->atom) {
+      continue;
+    }
+    if (transfer->done) {
+      drop_transfer(dpy, transfers, transfer);
+      return;
+    }
+    /* An empty chunk ends the transfer */
+    size_t length = media->size - transfer->offset;
+    if (length > media->chunk) {
+      length = media->chunk;
+    }
+    XChangeProperty(dpy, transfer->requestor, transfer->property,
+                    transfer->target, 8, PropModeReplace,
+                    (const unsigned char *)media->data + transfer->offset,
+                    length);
+    transfer->offset += length;
+    transfer->done = !length;
+    transfer->progress = now_ms();
+    return;
+  }
+}
+
+/* A requestor that was destroyed can't be listened to anymore either */
+static void drop_requestor(Window requestor, Transfer *transfers) {
+  for (int i = 0; i < CLIPBOARD_TRANSFERS; ++i) {
+    if (transfers[i].requestor == requestor) {
+      transfers[i].requestor = None;
+    }
+  }
+}
+
+/* Gives up on stalled transfers, returns how long until the next one would
+ * stall or -1 when none is running */
+static int drop_stalled(Display *dpy, Transfer *transfers) {
+  long long now = now_ms();
+  int timeout = -1;
+  for (int i = 0; i < CLIPBOARD_TRANSFERS; ++i) {
+    Transfer *transfer = &transfers[i];
+    if (transfer->requestor == None) {
+      continue;
+    }
+    long long left = transfer->progress + CLIPBOARD_STALL_TIMEOUT - now;
+    if (left <= 0) {
+      drop_transfer(dpy, transfers, transfer);
+    } else if (timeout == -1 || left < timeout) {
+      timeout = left;
+    }
+  }
+  return timeout;
+}
+
+static int ignore_x_error(Display *dpy, XErrorEvent *error) {
+  /* Requestors can go away in the middle of a transfer */
+  return 0;
+}
+
 int copy_file(const char *file) {
   switch (fork()) {
   case -1: {
@@ -90,29 +301,59 @@ int copy_file(const char *file) {
     }
 
     Window owner = XCreateSimpleWindow(dpy, root, -10, -10, 1, 1, 0, 0, 0);
+    XSetErrorHandler(&ignore_x_error);
+
+    /* Apps that paste data rather than files get the recording itself */
+    Media media = {0};
+    int natoms = map_media(dpy, file, &media) ? XA_MEDIA : XA_LAST;
+    Transfer transfers[CLIPBOARD_TRANSFERS] = {0};
 
     Atom atoms[XA_LAST];
     atoms[XA_TARGETS] = XInternAtom(dpy, "TARGETS", False);
     atoms[XA_URI_LIST] = XInternAtom(dpy, "text/uri-list", False);
     atoms[XA_GNOME_COPY] =
         XInternAtom(dpy, "x-special/gnome-copied-files", False);
+    atoms[XA_MEDIA] = XInternAtom(dpy, media_type(file), False);
 
     Atom selection = XInternAtom(dpy, "CLIPBOARD", False);
     XSetSelectionOwner(dpy, selection, owner, CurrentTime);
+    int cleared = 0;
     XEvent ev;
     for (;;) {
+      int timeout = drop_stalled(dpy, transfers);
+      if (cleared && timeout == -1) {
+        XCloseDisplay(dpy);
+        exit(EXIT_SUCCESS);
+      }
+      /* Wake up in time to notice a transfer stalling */
+      if (timeout != -1 && !XPending(dpy)) {
+        struct pollfd pfd = {ConnectionNumber(dpy), POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0) {
+          continue;
+        }
+      }
       XNextEvent(dpy, &ev);
       switch (ev.type) {
-      case SelectionClear:
+      case SelectionClear: {
+        /* Pastes already started are still finished from the mapping */
         remove_file(file);
-        XCloseDisplay(dpy);
-        exit(EXIT_SUCCESS);
+        cleared = 1;
+        break;
+      }
+      case PropertyNotify: {
+        continue_transfer(dpy, &ev.xproperty, &media, transfers);
+        break;
+      }
+      case DestroyNotify: {
+        drop_requestor(ev.xdestroywindow.window, transfers);
+        break;
+      }
       case SelectionRequest: {
         XSelectionRequestEvent *sev =
             (XSelectionRequestEvent *)&ev.xselectionrequest;
         if (sev->property != None) {
           if (sev->target == atoms[XA_TARGETS]) {
-            send_targets_list(dpy, sev, atoms[XA_TARGETS], atoms, XA_LAST);
+            send_targets_list(dpy, sev, atoms[XA_TARGETS], atoms, natoms);
             break;
           } else if (sev->target == atoms[XA_URI_LIST]) {
             send_uri_list(dpy, sev, atoms[XA_URI_LIST], file);
@@ -120,6 +361,9 @@ int copy_file(const char *file) {
           } else if (sev->target == atoms[XA_GNOME_COPY]) {
             send_gnome_copy(dpy, sev, atoms[XA_GNOME_COPY], file);
             break;
+          } else if (sev->target == atoms[XA_MEDIA] && natoms == XA_LAST) {
+            send_media(dpy, sev, &media, transfers);
+            break;
           }
         }
         deny_selection_request(dpy, sev);
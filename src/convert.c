@@ -0,0 +1,363 @@
+/**
+    convert.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "convert.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+/* 8 bit fixed point BT.601 coefficients for red, green and blue */
+static const int y_coefficients[3] = {66, 129, 25};
+static const int u_coefficients[3] = {-38, -74, 112};
+static const int v_coefficients[3] = {112, -94, -18};
+
+typedef void (*ConvertRowsFunc)(const uint8_t *top, const uint8_t *bottom,
+                                int width, const int16_t *coefficients,
+                                uint8_t *y_top, uint8_t *y_bottom, uint8_t *u,
+                                uint8_t *v);
+/* One row of width pixels out of two rows twice as wide */
+typedef void (*HalveRowsFunc)(const uint8_t *top, const uint8_t *bottom,
+                              int width, uint8_t *dst);
+
+/* Coefficients in the byte order of the pixels, y, u and v one after the
+ * other with a 0 for the padding byte */
+static void order_coefficients(int red, int blue, int16_t *coefficients) {
+  const int *all[] = {y_coefficients, u_coefficients, v_coefficients};
+  for (int i = 0; i < 3; ++i) {
+    int16_t *c = coefficients + i * 4;
+    c[red] = all[i][0];
+    c[1] = all[i][1];
+    c[blue] = all[i][2];
+    c[3] = 0;
+  }
+}
+
+static int dot(const int16_t *c, int b0, int b1, int b2) {
+  return c[0] * b0 + c[1] * b1 + c[2] * b2;
+}
+
+/* Two rows of luma and one of chroma from each 2x2 block */
+static void convert_rows_scalar(const uint8_t *top, const uint8_t *bottom,
+                                int width, const int16_t *coefficients,
+                                uint8_t *y_top, uint8_t *y_bottom, uint8_t *u,
+                                uint8_t *v) {
+  for (int x = 0; x < width; x += 2) {
+    const uint8_t *p[] = {top + x * 4, top + x * 4 + 4, bottom + x * 4,
+                          bottom + x * 4 + 4};
+    uint8_t *y[] = {y_top + x, y_top + x + 1, y_bottom + x, y_bottom + x + 1};
+    int sum[3] = {0, 0, 0};
+    for (int i = 0; i < 4; ++i) {
+      *y[i] = ((dot(coefficients, p[i][0], p[i][1], p[i][2]) + 128) >> 8) + 16;
+      for (int c = 0; c < 3; ++c) {
+        sum[c] += p[i][c];
+      }
+    }
+    int b0 = (sum[0] + 2) >> 2, b1 = (sum[1] + 2) >> 2, b2 = (sum[2] + 2) >> 2;
+    u[x / 2] = ((dot(coefficients + 4, b0, b1, b2) + 128) >> 8) + 128;
+    v[x / 2] = ((dot(coefficients + 8, b0, b1, b2) + 128) >> 8) + 128;
+  }
+}
+
+static void halve_rows_scalar(const uint8_t *top, const uint8_t *bottom,
+                              int width, uint8_t *dst) {
+  for (int x = 0; x < width; ++x) {
+    const uint8_t *a = top + x * 8;
+    const uint8_t *b = bottom + x * 8;
+    for (int c = 0; c < 4; ++c) {
+      dst[x * 4 + c] = (a[c] + a[c + 4] + b[c] + b[c + 4] + 2) >> 2;
+    }
+  }
+}
+
+#ifdef CONVERT_X86
+/* The 4 coefficients of one plane, once for each pixel of a pair */
+__attribute__((target("sse4.1"))) static __m128i
+broadcast_coefficients(const int16_t *coefficients) {
+  __m128i c = _mm_loadl_epi64((const __m128i *)coefficients);
+  return _mm_unpacklo_epi64(c, c);
+}
+
+static void store_u32(uint8_t *dst, uint32_t value) {
+  memcpy(dst, &value, sizeof(value));
+}
+
+/* 4 pixels of luma as 32 bit integers */
+__attribute__((target("sse4.1"))) static __m128i luma_sse41(__m128i pixels,
+                                                             __m128i c) {
+  __m128i lo = _mm_cvtepu8_epi16(pixels);
+  __m128i hi = _mm_unpackhi_epi8(pixels, _mm_setzero_si128());
+  __m128i sum = _mm_hadd_epi32(_mm_madd_epi16(lo, c), _mm_madd_epi16(hi, c));
+  return _mm_add_epi32(
+      _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8),
+      _mm_set1_epi32(16));
+}
+
+__attribute__((target("sse4.1"))) static void
+convert_rows_sse41(const uint8_t *top, const uint8_t *bottom, int width,
+                   const int16_t *coefficients, uint8_t *y_top,
+                   uint8_t *y_bottom, uint8_t *u, uint8_t *v) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i yc = broadcast_coefficients(coefficients);
+  const __m128i uc = broadcast_coefficients(coefficients + 4);
+  const __m128i vc = broadcast_coefficients(coefficients + 8);
+  const __m128i round = _mm_set1_epi32(128);
+
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(top + x * 4));
+    __m128i b = _mm_loadu_si128((const __m128i *)(bottom + x * 4));
+
+    __m128i ya = luma_sse41(a, yc);
+    __m128i yb = luma_sse41(b, yc);
+    __m128i y = _mm_packus_epi16(_mm_packus_epi32(ya, yb), zero);
+    store_u32(y_top + x, _mm_cvtsi128_si32(y));
+    store_u32(y_bottom + x, _mm_extract_epi32(y, 1));
+
+    /* Channel sums of the two 2x2 blocks, then their averages */
+    __m128i lo = _mm_add_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                               _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    __m128i blocks = _mm_srli_epi16(
+        _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi16(2)), 2);
+
+    __m128i uv = _mm_hadd_epi32(_mm_madd_epi16(blocks, uc),
+                                _mm_madd_epi16(blocks, vc));
+    uv = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(uv, round), 8),
+                       _mm_set1_epi32(128));
+    uint32_t packed = _mm_cvtsi128_si32(
+        _mm_packus_epi16(_mm_packus_epi32(uv, zero), zero));
+    u[x / 2] = packed;
+    u[x / 2 + 1] = packed >> 8;
+    v[x / 2] = packed >> 16;
+    v[x / 2 + 1] = packed >> 24;
+  }
+  convert_rows_scalar(top + x * 4, bottom + x * 4, width - x, coefficients,
+                      y_top + x, y_bottom + x, u + x / 2, v + x / 2);
+}
+
+__attribute__((target("avx2"))) static __m256i luma_avx2(__m256i pixels,
+                                                          __m256i c) {
+  __m256i lo = _mm256_unpacklo_epi8(pixels, _mm256_setzero_si256());
+  __m256i hi = _mm256_unpackhi_epi8(pixels, _mm256_setzero_si256());
+  __m256i sum =
+      _mm256_hadd_epi32(_mm256_madd_epi16(lo, c), _mm256_madd_epi16(hi, c));
+  return _mm256_add_epi32(
+      _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8),
+      _mm256_set1_epi32(16));
+}
+
+__attribute__((target("avx2"))) static void
+convert_rows_avx2(const uint8_t *top, const uint8_t *bottom, int width,
+                  const int16_t *coefficients, uint8_t *y_top,
+                  uint8_t *y_bottom, uint8_t *u, uint8_t *v) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i yc =
+      _mm256_broadcastq_epi64(broadcast_coefficients(coefficients));
+  const __m256i uc =
+      _mm256_broadcastq_epi64(broadcast_coefficients(coefficients + 4));
+  const __m256i vc =
+      _mm256_broadcastq_epi64(broadcast_coefficients(coefficients + 8));
+  const __m256i round = _mm256_set1_epi32(128);
+  /* Dwords holding results from both 128 bit lanes, in pixel order */
+  const __m256i gather = _mm256_setr_epi32(0, 4, 1, 5, 0, 0, 0, 0);
+
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(top + x * 4));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(bottom + x * 4));
+
+    __m256i ya = luma_avx2(a, yc);
+    __m256i yb = luma_avx2(b, yc);
+    __m256i y = _mm256_permutevar8x32_epi32(
+        _mm256_packus_epi16(_mm256_packus_epi32(ya, yb), zero), gather);
+    _mm_storel_epi64((__m128i *)(y_top + x), _mm256_castsi256_si128(y));
+    _mm_storel_epi64((__m128i *)(y_bottom + x),
+                     _mm_srli_si128(_mm256_castsi256_si128(y), 8));
+
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                  _mm256_unpacklo_epi8(b, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                  _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    __m256i blocks = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi),
+                         _mm256_set1_epi16(2)),
+        2);
+
+    __m256i uv = _mm256_hadd_epi32(_mm256_madd_epi16(blocks, uc),
+                                   _mm256_madd_epi16(blocks, vc));
+    uv = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(uv, round), 8),
+                          _mm256_set1_epi32(128));
+    uv = _mm256_packus_epi16(_mm256_packus_epi32(uv, zero), zero);
+    uint32_t first = _mm256_extract_epi32(uv, 0);
+    uint32_t second = _mm256_extract_epi32(uv, 4);
+    u[x / 2] = first;
+    u[x / 2 + 1] = first >> 8;
+    u[x / 2 + 2] = second;
+    u[x / 2 + 3] = second >> 8;
+    v[x / 2] = first >> 16;
+    v[x / 2 + 1] = first >> 24;
+    v[x / 2 + 2] = second >> 16;
+    v[x / 2 + 3] = second >> 24;
+  }
+  convert_rows_sse41(top + x * 4, bottom + x * 4, width - x, coefficients,
+                     y_top + x, y_bottom + x, u + x / 2, v + x / 2);
+}
+
+/* Channel sums of 2x2 blocks as in the chroma above, two pixels out of
+ * every 16 bytes of both rows */
+__attribute__((target("sse2"))) static void
+halve_rows_sse2(const uint8_t *top, const uint8_t *bottom, int width,
+                uint8_t *dst) {
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 2 <= width; x += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(top + x * 8));
+    __m128i b = _mm_loadu_si128((const __m128i *)(bottom + x * 8));
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                               _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                               _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    __m128i blocks = _mm_srli_epi16(
+        _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi16(2)), 2);
+    _mm_storel_epi64((__m128i *)(dst + x * 4),
+                     _mm_packus_epi16(blocks, zero));
+  }
+  halve_rows_scalar(top + x * 8, bottom + x * 8, width - x, dst + x * 4);
+}
+
+__attribute__((target("avx2"))) static void
+halve_rows_avx2(const uint8_t *top, const uint8_t *bottom, int width,
+                uint8_t *dst) {
+  const __m256i zero = _mm256_setzero_si256();
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(top + x * 8));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(bottom + x * 8));
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                  _mm256_unpacklo_epi8(b, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                  _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    __m256i blocks = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi),
+                         _mm256_set1_epi16(2)),
+        2);
+    /* Each 128 bit lane holds two pixels in its low half */
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(blocks, zero), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i *)(dst + x * 4),
+                     _mm256_castsi256_si128(packed));
+  }
+  halve_rows_sse2(top + x * 8, bottom + x * 8, width - x, dst + x * 4);
+}
+#endif
+
+static ConvertRowsFunc convert_rows = convert_rows_scalar;
+static HalveRowsFunc halve_rows = halve_rows_scalar;
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+#ifdef CONVERT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    convert_rows = convert_rows_avx2;
+    halve_rows = halve_rows_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    convert_rows = convert_rows_sse41;
+  }
+  if (halve_rows == halve_rows_scalar && __builtin_cpu_supports("sse2")) {
+    halve_rows = halve_rows_sse2;
+  }
+#endif
+}
+
+void convert_i420(const uint8_t *src, int stride, int width, int height,
+                  int red, int blue, uint8_t *const planes[3],
+                  const int strides[3]) {
+  pthread_once(&convert_once, select_kernel);
+  int16_t coefficients[12];
+  order_coefficients(red, blue, coefficients);
+
+  for (int y = 0; y + 1 < height; y += 2) {
+    convert_rows(src + (size_t)y * stride, src + (size_t)(y + 1) * stride,
+                 width, coefficients, planes[0] + (size_t)y * strides[0],
+                 planes[0] + (size_t)(y + 1) * strides[0],
+                 planes[1] + (size_t)y / 2 * strides[1],
+                 planes[2] + (size_t)y / 2 * strides[2]);
+  }
+}
+
+/* Any other factor, the boxes are a whole number of pixels each */
+static void scale_box(const uint8_t *src, int stride, int width, int height,
+                      uint8_t *dst, int dst_stride, int dst_width,
+                      int dst_height) {
+  for (int y = 0; y < dst_height; ++y) {
+    int y0 = (long long)y * height / dst_height;
+    int y1 = (long long)(y + 1) * height / dst_height;
+    uint8_t *out = dst + (size_t)y * dst_stride;
+    for (int x = 0; x < dst_width; ++x) {
+      int x0 = (long long)x * width / dst_width;
+      int x1 = (long long)(x + 1) * width / dst_width;
+      unsigned int sum[4] = {0, 0, 0, 0};
+      for (int sy = y0; sy < y1; ++sy) {
+        const uint8_t *p = src + (size_t)sy * stride + (size_t)x0 * 4;
+        for (int sx = x0; sx < x1; ++sx, p += 4) {
+          sum[0] += p[0];
+          sum[1] += p[1];
+          sum[2] += p[2];
+          sum[3] += p[3];
+        }
+      }
+      unsigned int area = (x1 - x0) * (y1 - y0);
+      for (int c = 0; c < 4; ++c) {
+        out[x * 4 + c] = (sum[c] + area / 2) / area;
+      }
+    }
+  }
+}
+
+void convert_scale(const uint8_t *src, int stride, int width, int height,
+                   uint8_t *dst, int dst_stride, int dst_width,
+                   int dst_height) {
+  pthread_once(&convert_once, select_kernel);
+  if (dst_width != width / 2 || dst_height != height / 2) {
+    scale_box(src, stride, width, height, dst, dst_stride, dst_width,
+              dst_height);
+    return;
+  }
+  for (int y = 0; y < dst_height; ++y) {
+    halve_rows(src + (size_t)y * 2 * stride, src + ((size_t)y * 2 + 1) * stride,
+               dst_width, dst + (size_t)y * dst_stride);
+  }
+}
+
+size_t convert_i420_size(int width, int height) {
+  return (size_t)width * height + 2 * (size_t)(width / 2) * (height / 2);
+}
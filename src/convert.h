@@ -0,0 +1,44 @@
+/**
+    convert.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_CONVERT_H
+#define EVID_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Converts 32 bit pixels, with the red and blue channels at the given byte
+ * offsets, to planar BT.601 limited range yuv420p. width and height have to
+ * be even, anything past them in src is left out so an odd sized frame is
+ * cropped without a copy. */
+void convert_i420(const uint8_t *src, int stride, int width, int height,
+                  int red, int blue, uint8_t *const planes[3],
+                  const int strides[3]);
+
+/* Downscales 32 bit pixels by averaging the box of source pixels behind
+ * each destination one, dst_width and dst_height can't be larger than the
+ * source's. Halving both sizes, the usual case on HiDPI screens, is
+ * vectorized and leaves an odd last row or column out. */
+void convert_scale(const uint8_t *src, int stride, int width, int height,
+                   uint8_t *dst, int dst_stride, int dst_width,
+                   int dst_height);
+
+/* Size of a tightly packed yuv420p frame */
+size_t convert_i420_size(int width, int height);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+    daemon.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "file.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+static struct sockaddr_un address = {0};
+
+static void remove_socket(void) { unlink(address.sun_path); }
+
+static int get_address(void) {
+  address.sun_family = AF_UNIX;
+  int length = get_socket_file(address.sun_path, sizeof(address.sun_path));
+  return length > 0 && (size_t)length < sizeof(address.sun_path) ? 0 : -1;
+}
+
+static int connect_socket(void) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int daemon_listen(void) {
+  if (get_address()) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    int other = errno == EADDRINUSE ? connect_socket() : -1;
+    if (other != -1) {
+      // Somebody is already listening there
+      close(other);
+      close(fd);
+      return -1;
+    }
+    // Left behind by a daemon that didn't exit cleanly
+    unlink(address.sun_path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+      close(fd);
+      return -1;
+    }
+  }
+  if (listen(fd, 8) == -1) {
+    close(fd);
+    remove_socket();
+    return -1;
+  }
+  atexit(&remove_socket);
+  return fd;
+}
+
+int daemon_read_command(int listen_fd) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  /* accept4 doesn't hand the listening socket's O_NONBLOCK down, a client
+   * that never writes would block the daemon for good */
+  struct timeval timeout = {.tv_sec = DAEMON_READ_TIMEOUT / 1000,
+                            .tv_usec = DAEMON_READ_TIMEOUT % 1000 * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char command[16] = {0};
+  ssize_t length = read(fd, command, sizeof(command) - 1);
+  close(fd);
+  if (length <= 0) {
+    return -1;
+  }
+  command[strcspn(command, "\n")] = '\0';
+
+  if (!strcmp(command, DAEMON_RECORD_COMMAND)) {
+    return DAEMON_RECORD;
+  }
+  if (!strcmp(command, DAEMON_LAST_COMMAND)) {
+    return DAEMON_LAST;
+  }
+  error("unknown daemon command %s\n", command);
+  return -1;
+}
+
+void daemon_drain(int listen_fd) {
+  int fd;
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+    close(fd);
+  }
+}
+
+int daemon_trigger(const char *command) {
+  if (get_address()) {
+    return -1;
+  }
+  int fd = connect_socket();
+  if (fd == -1) {
+    return -1;
+  }
+  int length = strlen(command);
+  int ret = write(fd, command, length) == length ? 0 : -1;
+  close(fd);
+  return ret;
+}
@@ -0,0 +1,36 @@
+/**
+    daemon.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_DAEMON_H
+#define EVID_DAEMON_H
+
+#define DAEMON_RECORD 1
+#define DAEMON_LAST 2
+
+/* A client that connects without writing is dropped after this long */
+#define DAEMON_READ_TIMEOUT 500 /* ms */
+
+#define DAEMON_RECORD_COMMAND "record"
+#define DAEMON_LAST_COMMAND "last"
+
+int daemon_listen(void);
+int daemon_read_command(int listen_fd);
+void daemon_drain(int listen_fd);
+int daemon_trigger(const char *command);
+
+#endif
@@ -0,0 +1,362 @@
+/**
+    encoder.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "encoder.h"
+#include "convert.h"
+#include "util.h"
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBAV
+#include <libavutil/log.h>
+#include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+
+/* Timestamps are handed in nanoseconds, the codec works in microseconds */
+static const AVRational time_base = {1, 1000000};
+
+static int open_output(Encoder *encoder, const char *file) {
+  if (avformat_alloc_output_context2(&encoder->format, NULL, "mp4", file) <
+      0) {
+    return -1;
+  }
+  encoder->stream = avformat_new_stream(encoder->format, NULL);
+  if (!encoder->stream ||
+      avcodec_parameters_from_context(encoder->stream->codecpar,
+                                      encoder->codec) < 0) {
+    avformat_free_context(encoder->format);
+    encoder->format = NULL;
+    return -1;
+  }
+  encoder->stream->time_base = encoder->codec->time_base;
+
+  /* Packets go to disk as soon as they are muxed, in fragments of a second
+   * so whatever made it there is playable even if evid never gets to write
+   * the trailer */
+  encoder->format->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+  av_opt_set(encoder->format->priv_data, "movflags",
+             "+empty_moov+default_base_moof", 0);
+  av_opt_set_int(encoder->format->priv_data, "frag_duration", 1000000, 0);
+  if (avio_open(&encoder->format->pb, file, AVIO_FLAG_WRITE) < 0) {
+    avformat_free_context(encoder->format);
+    encoder->format = NULL;
+    return -1;
+  }
+  if (avformat_write_header(encoder->format, NULL) < 0) {
+    /* There's no trailer to write without a header */
+    avio_closep(&encoder->format->pb);
+    avformat_free_context(encoder->format);
+    encoder->format = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static int close_output(Encoder *encoder) {
+  int ret = 0;
+  if (encoder->format && encoder->format->pb) {
+    ret = av_write_trailer(encoder->format);
+    avio_closep(&encoder->format->pb);
+  }
+  avformat_free_context(encoder->format);
+  encoder->format = NULL;
+  return ret < 0 ? -1 : 0;
+}
+
+/* Closes the segment and goes on with the next one, starting at the
+ * keyframe in the packet */
+static int next_segment(Encoder *encoder) {
+  if (close_output(encoder)) {
+    return -1;
+  }
+  char file[PATH_MAX];
+  snprintf(file, sizeof(file), encoder->segment_pattern, ++encoder->segment);
+  if (open_output(encoder, file)) {
+    return -1;
+  }
+  encoder->cut = 0;
+  encoder->segment_start = encoder->packet->pts;
+  /* Every segment is a file of its own starting at 0 */
+  encoder->segment_offset = encoder->packet->dts;
+  return 0;
+}
+
+static int write_packets(Encoder *encoder) {
+  int ret;
+  while ((ret = avcodec_receive_packet(encoder->codec, encoder->packet)) >=
+         0) {
+    if (encoder->cut && encoder->packet->flags & AV_PKT_FLAG_KEY &&
+        next_segment(encoder)) {
+      return -1;
+    }
+    encoder->packet->pts -= encoder->segment_offset;
+    encoder->packet->dts -= encoder->segment_offset;
+    av_packet_rescale_ts(encoder->packet, encoder->codec->time_base,
+                         encoder->stream->time_base);
+    encoder->packet->stream_index = encoder->stream->index;
+    ret = av_interleaved_write_frame(encoder->format, encoder->packet);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int video_open(Encoder *encoder, Args *args, _Region region,
+                      const char *pix_fmt, const char *file) {
+  switch (args->verbosity) {
+  case QUIET: {
+    av_log_set_level(AV_LOG_QUIET);
+    break;
+  }
+  case INFO: {
+    av_log_set_level(AV_LOG_INFO);
+    break;
+  }
+  default: {
+    av_log_set_level(AV_LOG_DEBUG);
+    break;
+  }
+  }
+
+  /* Same as crop=trunc(iw/2)*2:trunc(ih/2)*2, yuv420p needs even sizes */
+  encoder->width = region.w & ~1;
+  encoder->height = region.h & ~1;
+  encoder->start = -1;
+  if (!encoder->width || !encoder->height) {
+    return -1;
+  }
+
+  const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+  if (!codec) {
+    error("libavcodec was built without libx264\n");
+    return -1;
+  }
+  const AVOutputFormat *mp4 = av_guess_format("mp4", NULL, NULL);
+  encoder->codec = avcodec_alloc_context3(codec);
+  encoder->frame = av_frame_alloc();
+  encoder->packet = av_packet_alloc();
+  if (!mp4 || !encoder->codec || !encoder->frame || !encoder->packet) {
+    encoder_close(encoder);
+    return -1;
+  }
+
+  AVCodecContext *c = encoder->codec;
+  c->width = encoder->width;
+  c->height = encoder->height;
+  c->pix_fmt = AV_PIX_FMT_YUV420P;
+  c->time_base = time_base;
+  av_parse_video_rate(&c->framerate, args->framerate);
+  /* Let x264 pick its frame and lookahead threads from the core count */
+  c->thread_count = 0;
+  if (mp4->flags & AVFMT_GLOBALHEADER) {
+    c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  av_opt_set(c->priv_data, "preset", "superfast", 0);
+  av_opt_set(c->priv_data, "crf", "18", 0);
+  /* Segments have to start on a frame that needs nothing before it */
+  av_opt_set(c->priv_data, "forced-idr", "1", 0);
+
+  if (avcodec_open2(c, codec, NULL) < 0) {
+    encoder_close(encoder);
+    return -1;
+  }
+
+  /* Frames are converted straight into these planes */
+  encoder->bgr = !strcmp(pix_fmt, "bgr0");
+  encoder->frame->format = c->pix_fmt;
+  encoder->frame->width = c->width;
+  encoder->frame->height = c->height;
+  if (av_frame_get_buffer(encoder->frame, 0) < 0) {
+    encoder_close(encoder);
+    return -1;
+  }
+
+  encoder->segment_pattern = NULL;
+  encoder->segment = 0;
+  encoder->segment_time = (long long)args->segment_time * 1000000;
+  encoder->segment_size = (long long)args->segment_size * 1024 * 1024;
+  encoder->segment_start = 0;
+  encoder->segment_offset = 0;
+  encoder->cut = 0;
+  char first[PATH_MAX];
+  if (encoder->segment_time || encoder->segment_size) {
+    encoder->segment_pattern = file;
+    snprintf(first, sizeof(first), file, 0);
+    file = first;
+  }
+  if (open_output(encoder, file)) {
+    encoder_close(encoder);
+    return -1;
+  }
+  return 0;
+}
+
+static int prepare_frame(Encoder *encoder, long long timestamp) {
+  if (encoder->start == -1) {
+    encoder->start = timestamp;
+  }
+  return av_frame_make_writable(encoder->frame) < 0 ? -1 : 0;
+}
+
+/* Whether the next segment should start at pts */
+static int segment_full(Encoder *encoder, long long pts) {
+  if (!encoder->segment_pattern || encoder->cut) {
+    return 0;
+  }
+  return (encoder->segment_time &&
+          pts - encoder->segment_start >= encoder->segment_time) ||
+         (encoder->segment_size &&
+          avio_tell(encoder->format->pb) >= encoder->segment_size);
+}
+
+static int send_frame(Encoder *encoder, long long timestamp) {
+  encoder->frame->pts = (timestamp - encoder->start) / 1000;
+  /* The cut happens once the keyframe comes out of the lookahead */
+  encoder->frame->pict_type = AV_PICTURE_TYPE_NONE;
+  if (segment_full(encoder, encoder->frame->pts)) {
+    encoder->frame->pict_type = AV_PICTURE_TYPE_I;
+    encoder->cut = 1;
+  }
+  if (avcodec_send_frame(encoder->codec, encoder->frame) < 0) {
+    return -1;
+  }
+  return write_packets(encoder) < 0 ? -1 : 0;
+}
+
+static int video_write(Encoder *encoder, const char *data, int stride,
+                       long long timestamp) {
+  if (prepare_frame(encoder, timestamp)) {
+    return -1;
+  }
+  convert_i420((const uint8_t *)data, stride, encoder->width,
+               encoder->height, encoder->bgr ? 2 : 0, encoder->bgr ? 0 : 2,
+               encoder->frame->data, encoder->frame->linesize);
+  return send_frame(encoder, timestamp);
+}
+
+static int video_write_yuv(Encoder *encoder, uint8_t *const planes[3],
+                           const int strides[3], long long timestamp) {
+  if (prepare_frame(encoder, timestamp)) {
+    return -1;
+  }
+  for (int p = 0; p < 3; ++p) {
+    int width = p ? encoder->width / 2 : encoder->width;
+    int height = p ? encoder->height / 2 : encoder->height;
+    for (int y = 0; y < height; ++y) {
+      memcpy(encoder->frame->data[p] + (size_t)y * encoder->frame->linesize[p],
+             planes[p] + (size_t)y * strides[p], width);
+    }
+  }
+  return send_frame(encoder, timestamp);
+}
+
+static int video_close(Encoder *encoder) {
+  int ret = 0;
+  if (encoder->format && encoder->format->pb) {
+    /* Flush the frames still buffered in the lookahead */
+    avcodec_send_frame(encoder->codec, NULL);
+    ret = write_packets(encoder);
+  }
+  if (close_output(encoder)) {
+    ret = -1;
+  }
+  av_packet_free(&encoder->packet);
+  av_frame_free(&encoder->frame);
+  avcodec_free_context(&encoder->codec);
+  return ret < 0 ? -1 : 0;
+}
+
+#endif
+
+int encoder_supported(Args *args) {
+  if (args->replay) {
+    return 0;
+  }
+  if (args->gif) {
+    // Low quality gifs are scaled by ffmpeg and keep using it
+    return args->gif == HQGIF;
+  }
+#ifdef HAVE_LIBAV
+  return !args->audio->subsystem;
+#else
+  return 0;
+#endif
+}
+
+int encoder_open(Encoder *encoder, Args *args, _Region region,
+                 const char *pix_fmt, const char *file) {
+  if (args->gif) {
+    encoder->gif = malloc(sizeof(Gif));
+    if (!encoder->gif || gif_open(encoder->gif, file, region.w, region.h,
+                                  !strcmp(pix_fmt, "bgr0"))) {
+      encoder_close(encoder);
+      return -1;
+    }
+    return 0;
+  }
+#ifdef HAVE_LIBAV
+  return video_open(encoder, args, region, pix_fmt, file);
+#else
+  return -1;
+#endif
+}
+
+int encoder_write(Encoder *encoder, const char *data, int stride,
+                  long long timestamp) {
+  if (encoder->gif) {
+    return gif_write(encoder->gif, data, stride, timestamp);
+  }
+#ifdef HAVE_LIBAV
+  return video_write(encoder, data, stride, timestamp);
+#else
+  return -1;
+#endif
+}
+
+int encoder_write_yuv(Encoder *encoder, uint8_t *const planes[3],
+                      const int strides[3], long long timestamp) {
+  if (encoder->gif) {
+    return -1;
+  }
+#ifdef HAVE_LIBAV
+  return video_write_yuv(encoder, planes, strides, timestamp);
+#else
+  (void)planes;
+  (void)strides;
+  (void)timestamp;
+  return -1;
+#endif
+}
+
+int encoder_close(Encoder *encoder) {
+  if (encoder->gif) {
+    int ret = gif_close(encoder->gif);
+    free(encoder->gif);
+    encoder->gif = NULL;
+    return ret;
+  }
+#ifdef HAVE_LIBAV
+  return video_close(encoder);
+#else
+  return -1;
+#endif
+}
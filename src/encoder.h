@@ -0,0 +1,69 @@
+/**
+    encoder.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_ENCODER_H
+#define EVID_ENCODER_H
+
+#include "gif.h"
+#include "types.h"
+
+#include <stdint.h>
+
+#ifdef HAVE_LIBAV
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#endif
+
+typedef struct Encoder Encoder;
+struct Encoder {
+#ifdef HAVE_LIBAV
+  AVFormatContext *format;
+  AVCodecContext *codec;
+  AVStream *stream;
+  AVFrame *frame;
+  AVPacket *packet;
+  const char *segment_pattern; /* printf pattern by index, NULL for a file */
+  int segment;                 /* index of the one being written */
+  long long segment_time;      /* microseconds per segment at most */
+  long long segment_size;      /* bytes per segment at most */
+  long long segment_start;     /* pts where the segment started */
+  long long segment_offset;    /* taken off the timestamps of the segment */
+  int cut; /* a keyframe was asked for, the next segment starts on it */
+#endif
+  Gif *gif; /* set when writing a gif instead of a video */
+  int bgr;    /* pixels are bgr0 rather than rgb0 */
+  int width;  /* output width, cropped to an even number */
+  int height; /* output height, cropped to an even number */
+  long long start; /* timestamp of the first frame in nanoseconds */
+};
+
+/* Whether the recording can be encoded in-process, everything else
+ * (audio, low quality gifs, replays) is still handed to ffmpeg */
+int encoder_supported(Args *args);
+/* file is a printf pattern of the segments' paths by index when args asks
+ * for segments, it has to outlive the encoder then */
+int encoder_open(Encoder *encoder, Args *args, _Region region,
+                 const char *pix_fmt, const char *file);
+int encoder_write(Encoder *encoder, const char *data, int stride,
+                  long long timestamp);
+/* Frames already converted to yuv420p of the encoder's size, videos only */
+int encoder_write_yuv(Encoder *encoder, uint8_t *const planes[3],
+                      const int strides[3], long long timestamp);
+int encoder_close(Encoder *encoder);
+
+#endif
@@ -16,10 +16,23 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 **/
 
+#define _GNU_SOURCE
+
 #include "evid.h"
 #include "actions.h"
+#include "capture.h"
 #include "clipboard.h"
+#include "daemon.h"
+#include "replay.h"
+#include "segment.h"
+#include "encoder.h"
 #include "file.h"
+#include "gifconv.h"
+#include "jobs.h"
+#include "notifier.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
 #include "types.h"
 #include "util.h"
 #include "x11_grab.h"
@@ -40,37 +53,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <bits/getopt_core.h>
 #include <linux/limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
-#define GRAB(dpy, window) grab_keys(dpy, window, SAVE | COPY)
-#define UNGRAB(dpy, window) ungrab_keys(dpy, window, SAVE | COPY)
-
-#define QUIET 0
-#define INFO 1
-#define DEBUG 2
-
-#define LQGIF 1
-#define HQGIF 2
-
 static pid_t subp = 0;
+/* A recording written straight to where it's saved or a replay snapshot,
+ * everything else is spooled without a name */
 static char tmp_file[FILENAME_MAX] = {0};
+static Replay *active_replay = NULL;
 
 static void shutdown(int signo) {
   if (subp) {
     kill(subp, signo);
     sleep(1);
     if (!waitpid(subp, NULL, WNOHANG)) {
-      kill(SIGKILL, subp);
+      kill(subp, SIGKILL);
       waitpid(subp, NULL, 0);
     }
   }
-  if (ARR_SIZE(tmp_file) > 0) {
+  if (tmp_file[0]) {
     remove_file(tmp_file);
   }
+  if (active_replay) {
+    replay_destroy(active_replay);
+  }
   exit(EXIT_FAILURE);
 }
 
@@ -84,6 +100,21 @@ static void process_args(Args *args, int argc, char **argv) {
 #endif
       {"gif", no_argument, &args->gif, LQGIF},
       {"show-region", no_argument, &args->show_region, 1},
+      {"damage", no_argument, &args->damage, 1},
+      {"fsync", no_argument, &args->fsync, 1},
+      {"replay", optional_argument, NULL, 'r'},
+      {"replay-max-size", required_argument, NULL, 'm'},
+      {"tmp-memory", required_argument, NULL, 'T'},
+      {"jobs", required_argument, NULL, 'J'},
+      {"scale", required_argument, NULL, 'x'},
+      {"max-size", required_argument, NULL, 'X'},
+      {"segment", optional_argument, NULL, 'S'},
+      {"segment-size", required_argument, NULL, 'Z'},
+      {"segment-list", no_argument, &args->segment_list, 1},
+      {"segment-command", required_argument, NULL, 'C'},
+      {"daemon", no_argument, &args->daemon, 1},
+      {"trigger", optional_argument, NULL, 't'},
+      {"monitor", optional_argument, NULL, 'M'},
       {"no-draw-mouse", no_argument, &args->draw_mouse, 0},
       {"framerate", required_argument, NULL, 'f'},
       {"audio", optional_argument, NULL, 'a'},
@@ -145,6 +176,90 @@ static void process_args(Args *args, int argc, char **argv) {
       }
       break;
     }
+    case ('r'): {
+      args->replay = optarg ? atoi(optarg) : REPLAY_DEFAULT_SECONDS;
+      if (args->replay <= 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('m'): {
+      args->replay_max_size = atoi(optarg);
+      if (args->replay_max_size <= 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('T'): {
+      char *end;
+      args->tmp_memory = strtol(optarg, &end, 10);
+      if (*end || end == optarg || args->tmp_memory < 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('J'): {
+      args->jobs = atoi(optarg);
+      if (args->jobs <= 0 || args->jobs > JOBS_MAX_WORKERS) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('x'): {
+      char *end;
+      args->scale = strtod(optarg, &end);
+      if (*end || end == optarg || args->scale <= 0 || args->scale > 1) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('X'): {
+      // Either WIDTHxHEIGHT or the longest side for both
+      char *end;
+      args->max_width = args->max_height = strtol(optarg, &end, 10);
+      if (*end == 'x') {
+        args->max_height = strtol(end + 1, &end, 10);
+      }
+      if (*end || args->max_width <= 0 || args->max_height <= 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('S'): {
+      int minutes = optarg ? atoi(optarg) : SEGMENT_DEFAULT_MINUTES;
+      if (minutes <= 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      args->segment_time = minutes * 60;
+      break;
+    }
+    case ('Z'): {
+      args->segment_size = atoi(optarg);
+      if (args->segment_size <= 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case ('C'): {
+      args->segment_command = optarg;
+      break;
+    }
+    case ('t'): {
+      args->trigger = optarg ? optarg : DAEMON_RECORD_COMMAND;
+      break;
+    }
+    case ('M'): {
+      args->monitor = optarg ? optarg : "";
+      break;
+    }
     case ('v'): {
       print_version();
       exit(EXIT_SUCCESS);
@@ -163,15 +278,33 @@ static void process_args(Args *args, int argc, char **argv) {
     }
   }
 
+  if (args->segment_time || args->segment_size) {
+    if (args->gif || args->replay) {
+      fprintf(stderr, "%s: segments can't be used with gifs or --replay\n",
+              PROGRAM_NAME);
+      exit(EXIT_FAILURE);
+    }
+#ifdef HAVE_ZENITY
+    // Segments need their names before the recording is over
+    args->use_zenity = 0;
+#endif
+  } else if (args->segment_list || args->segment_command) {
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+
   if (args->verbosity == DEBUG) {
     printf("Parsed arguments: \n\tGif: %d\n\tFramerate: "
-           "%s\n\tShow region: %d\n\tAudio subsystem: %s\n\tAudio input "
+           "%s\n\tShow region: %d\n\tDamage: %d\n\tReplay: %d\n\tAudio "
+           "subsystem: "
+           "%s\n\tAudio input "
            "device: %s\n\tOutput: %s\n"
 #ifdef HAVE_ZENITY
            "\tUse zenity: %d"
 #endif
            ,
-           args->gif, args->framerate, args->show_region,
+           args->gif, args->framerate, args->show_region, args->damage,
+           args->replay,
            args->audio->subsystem, args->audio->input, args->output
 #ifdef HAVE_ZENITY
            ,
@@ -181,58 +314,16 @@ static void process_args(Args *args, int argc, char **argv) {
   }
 }
 
-static void set_verbose(char **fargs, int verbose) {
-  if (verbose == DEBUG) {
-    fprintf(stdout, "Executing ffmpeg with command: ");
-    char **i = fargs;
-    for (; *i; ++i) {
-      fprintf(stdout, "%s ", *i);
-    }
-    fprintf(stdout, "\n");
-    *i++ = "-loglevel";
-    *i++ = "debug";
-    *i = NULL;
-  } else if (verbose == QUIET) {
-    close(2);
-    open("/dev/null", O_RDWR);
-  }
-}
-
-static void create_gif(Args *args, char *source, char *dest) {
-  pid_t pid = fork();
-  switch (pid) {
-  case -1: {
-    die("error forking the current process\n");
-  }
-  case 0: {
-    int fargsc = 0;
-    char *fargs[50];
-    fargs[fargsc++] = "ffmpeg";
-    fargs[fargsc++] = "-y";
-    fargs[fargsc++] = "-i";
-    fargs[fargsc++] = source;
-    fargs[fargsc++] = "-vf";
-    fargs[fargsc++] = "split[s0][s1];[s0]palettegen[p];[s1][p]paletteuse";
-    fargs[fargsc++] = dest;
-    fargs[fargsc] = NULL;
-    set_verbose(fargs, args->verbosity);
-    execvp(fargs[0], fargs);
-  }
-  default: {
-    int status = 0;
-    if (wait(&status) == -1 || status) {
-      remove_file(source);
-      die("failed to generate gif from %s\n", source);
-    }
-  }
-  }
-}
-
-static int exec_ffmpeg(Args *args, _Region selected_region, char *tmp_file) {
+static int exec_ffmpeg(Args *args, _Region selected_region, char *tmp_file,
+                       int spooled, Capture *capture, Replay *replay,
+                       Segments *segments) {
   int fargsc = 0;
-  char *fargs[50];
+  char *fargs[64];
   fargs[fargsc++] = "ffmpeg";
   fargs[fargsc++] = "-y";
+  // Machine readable progress, picked up by the supervise loop
+  fargs[fargsc++] = "-progress";
+  fargs[fargsc++] = STATS_PROGRESS_URL;
   if (args->audio->subsystem && args->audio->input && !args->gif) {
     fargs[fargsc++] = "-f";
     fargs[fargsc++] = args->audio->subsystem;
@@ -244,53 +335,156 @@ static int exec_ffmpeg(Args *args, _Region selected_region, char *tmp_file) {
     fargs[fargsc++] = "aac";
   }
   fargs[fargsc++] = "-f";
-  fargs[fargsc++] = "x11grab";
+  int yuv = capture && capture->yuv;
+  if (capture) {
+    fargs[fargsc++] = "rawvideo";
+    fargs[fargsc++] = "-pix_fmt";
+    fargs[fargsc++] = yuv ? "yuv420p" : (char *)capture->pix_fmt;
+  } else {
+    fargs[fargsc++] = "x11grab";
+  }
   fargs[fargsc++] = "-video_size";
-  char video_size[10];
+  char video_size[24];
   fargs[fargsc] = video_size;
-  snprintf(fargs[fargsc++], sizeof(video_size), "%dx%d", selected_region.w,
-           selected_region.h);
-  if (args->show_region) {
-    fargs[fargsc++] = "-show_region";
-    fargs[fargsc++] = "1";
+  if (capture) {
+    // evid's frames come downscaled, converted ones cropped to even sizes
+    snprintf(fargs[fargsc++], sizeof(video_size), "%dx%d",
+             yuv ? capture->width & ~1 : capture->width,
+             yuv ? capture->height & ~1 : capture->height);
+  } else {
+    snprintf(fargs[fargsc++], sizeof(video_size), "%dx%d", selected_region.w,
+             selected_region.h);
   }
   if (args->framerate) {
     fargs[fargsc++] = "-framerate";
     fargs[fargsc++] = args->framerate;
   }
-  if (!args->draw_mouse) {
-    fargs[fargsc++] = "-draw_mouse";
-    fargs[fargsc++] = "0";
+  char input_display[15];
+  if (capture) {
+    if (capture->vfr) {
+      // Frames are only written when something changed, time them on arrival
+      fargs[fargsc++] = "-use_wallclock_as_timestamps";
+      fargs[fargsc++] = "1";
+    }
+    // Frames are grabbed by evid and written to the standard input
+    fargs[fargsc++] = "-i";
+    fargs[fargsc++] = "pipe:0";
+  } else {
+    if (args->show_region) {
+      fargs[fargsc++] = "-show_region";
+      fargs[fargsc++] = "1";
+    }
+    if (!args->draw_mouse) {
+      fargs[fargsc++] = "-draw_mouse";
+      fargs[fargsc++] = "0";
+    }
+    fargs[fargsc++] = "-i";
+    char *display = getenv("DISPLAY");
+    if (!display) {
+      display = ":0";
+    }
+    fargs[fargsc] = input_display;
+    snprintf(fargs[fargsc++], sizeof(input_display), "%s+%d,%d", display,
+             selected_region.x, selected_region.y);
   }
-  fargs[fargsc++] = "-i";
-  char *display = getenv("DISPLAY");
-  if (!display) {
-    display = ":0";
+  if (capture && capture->vfr) {
+    // -fps_mode only exists since ffmpeg 5.1, -vsync is still understood
+    fargs[fargsc++] = "-vsync";
+    fargs[fargsc++] = "vfr";
   }
-  char input_display[15];
-  fargs[fargsc] = input_display;
-  snprintf(fargs[fargsc++], sizeof(input_display), "%s+%d,%d", display,
-           selected_region.x, selected_region.y);
-  if (args->gif == LQGIF) {
-    fargs[fargsc++] = "-vf";
-    fargs[fargsc++] = "scale=-2:-2:flags=lanczos";
+  // Only x11grab's frames still have to be downscaled
+  int width, height;
+  get_scaled_size(args, selected_region.w, selected_region.h, &width,
+                  &height);
+  int scaled = !capture && (width != (int)selected_region.w ||
+                            height != (int)selected_region.h);
+  char scale[48];
+  if (args->gif == LQGIF && !replay) {
+    if (scaled) {
+      snprintf(scale, sizeof(scale), "scale=%d:%d:flags=area", width, height);
+      fargs[fargsc++] = "-vf";
+      fargs[fargsc++] = scale;
+    }
+    if (spooled) {
+      fargs[fargsc++] = "-f";
+      fargs[fargsc++] = "gif";
+    }
   } else {
     fargs[fargsc++] = "-c:v";
     fargs[fargsc++] = "libx264";
-    fargs[fargsc++] = "-vf";
-    fargs[fargsc++] = "crop=trunc(iw/2)*2:trunc(ih/2)*2";
+    if (scaled && width >= 2 && height >= 2) {
+      snprintf(scale, sizeof(scale), "scale=%d:%d:flags=area", width & ~1,
+               height & ~1);
+      fargs[fargsc++] = "-vf";
+      fargs[fargsc++] = scale;
+    } else if (!yuv) {
+      fargs[fargsc++] = "-vf";
+      fargs[fargsc++] = "crop=trunc(iw/2)*2:trunc(ih/2)*2";
+    }
     fargs[fargsc++] = "-preset";
     fargs[fargsc++] = "superfast";
     fargs[fargsc++] = "-crf";
     fargs[fargsc++] = "18";
     fargs[fargsc++] = "-pix_fmt";
     fargs[fargsc++] = "yuv420p";
-    if (args->gif == HQGIF) {
+    if (args->gif == HQGIF && !replay) {
+      // A raw h264 stream would lose the frame timestamps
       fargs[fargsc++] = "-f";
-      fargs[fargsc++] = "h264";
+      fargs[fargsc++] = "matroska";
+    } else if (!replay && !segments) {
+      // Fragments of a second keep what was written playable even if
+      // ffmpeg never gets to finish the file
+      fargs[fargsc++] = "-movflags";
+      fargs[fargsc++] = "+empty_moov+default_base_moof";
+      fargs[fargsc++] = "-frag_duration";
+      fargs[fargsc++] = "1000000";
+      // There's no extension to guess it from in a pipe
+      if (spooled) {
+        fargs[fargsc++] = "-f";
+        fargs[fargsc++] = "mp4";
+      }
     }
   }
-  fargs[fargsc++] = tmp_file;
+  char replay_segments[PATH_MAX + sizeof(REPLAY_SEGMENT_PATTERN)];
+  char segment_time[12];
+  char key_frames[40];
+  if (replay) {
+    // Every segment has to start with a keyframe to be dropped on its own
+    fargs[fargsc++] = "-force_key_frames";
+    fargs[fargsc++] = "expr:gte(t,n_forced*" REPLAY_SEGMENT_TIME ")";
+    fargs[fargsc++] = "-f";
+    fargs[fargsc++] = "segment";
+    fargs[fargsc++] = "-segment_time";
+    fargs[fargsc++] = REPLAY_SEGMENT_TIME;
+    fargs[fargsc++] = "-segment_format";
+    fargs[fargsc++] = "mpegts";
+    snprintf(replay_segments, sizeof(replay_segments), "%s/%s", replay->dir,
+             REPLAY_SEGMENT_PATTERN);
+    fargs[fargsc++] = replay_segments;
+  } else if (segments) {
+    // ffmpeg only cuts by time, sizes are left to the in-process encoder
+    int seconds = args->segment_time ? args->segment_time
+                                     : SEGMENT_DEFAULT_MINUTES * 60;
+    snprintf(segment_time, sizeof(segment_time), "%d", seconds);
+    snprintf(key_frames, sizeof(key_frames), "expr:gte(t,n_forced*%d)",
+             seconds);
+    fargs[fargsc++] = "-force_key_frames";
+    fargs[fargsc++] = key_frames;
+    fargs[fargsc++] = "-f";
+    fargs[fargsc++] = "segment";
+    fargs[fargsc++] = "-segment_time";
+    fargs[fargsc++] = segment_time;
+    fargs[fargsc++] = "-segment_format";
+    fargs[fargsc++] = "mp4";
+    fargs[fargsc++] = "-segment_format_options";
+    fargs[fargsc++] = "movflags=+empty_moov+default_base_moof:frag_duration="
+                      "1000000";
+    fargs[fargsc++] = "-reset_timestamps";
+    fargs[fargsc++] = "1";
+    fargs[fargsc++] = segments->pattern;
+  } else {
+    fargs[fargsc++] = tmp_file;
+  }
   fargs[fargsc] = NULL;
   set_verbose(fargs, args->verbosity);
   return execvp(fargs[0], fargs);
@@ -308,10 +502,70 @@ static unsigned char get_matching_action(Display *dpy, XKeyEvent event) {
   if (event.keycode == COPY_KEYCODE(dpy) && modfield == COPY_MODFIELD) {
     return COPY;
   }
+  if (event.keycode == PAUSE_KEYCODE(dpy) && modfield == PAUSE_MODFIELD) {
+    return PAUSE;
+  }
   return 0;
 }
 
-static unsigned char run_supervise_loop(pid_t process_pid, Display *dpy,
+static int is_record_key(Display *dpy, XKeyEvent event) {
+  unsigned int modfield =
+      event.state & (ShiftMask | ControlMask | Mod1Mask | Mod4Mask);
+  return event.keycode == RECORD_KEYCODE(dpy) && modfield == RECORD_MODFIELD;
+}
+
+static void notify_behind(void) {
+#ifdef HAVE_NOTIFY
+  notifier_wait();
+  char warning_notification_summary[50];
+  snprintf(warning_notification_summary,
+           ARR_SIZE(warning_notification_summary), "%s: %s", PROGRAM_NAME,
+           "encoding is falling behind");
+  NotifyNotification *warning_notification = notify_notification_new(
+      warning_notification_summary,
+      "Frames are being dropped, try a lower framerate or a smaller region",
+      NULL);
+  notify_notification_show(warning_notification, NULL);
+  g_object_unref(warning_notification);
+#else
+  error("encoding is falling behind, frames are being dropped\n");
+#endif
+}
+
+static void notify_paused(Args *args, int paused) {
+  if (args->verbosity >= INFO) {
+    fprintf(stdout, "\nRecording %s\n", paused ? "paused" : "resumed");
+  }
+#ifdef HAVE_NOTIFY
+  notifier_wait();
+  char pause_notification_summary[50];
+  snprintf(pause_notification_summary, ARR_SIZE(pause_notification_summary),
+           "%s: %s", PROGRAM_NAME,
+           paused ? "recording paused" : "recording resumed");
+  NotifyNotification *pause_notification =
+      notify_notification_new(pause_notification_summary, NULL, NULL);
+  notify_notification_show(pause_notification, NULL);
+  g_object_unref(pause_notification);
+#endif
+}
+
+static void check_stats(Args *args, Stats *stats, Capture *capture) {
+  // ffmpeg prints its own progress, the in-process encoder doesn't
+  if (args->verbosity >= INFO && capture && capture->encoder) {
+    stats_print(stats, stdout, "\r");
+  }
+  if (stats->behind && !stats->warned) {
+    stats->warned = 1;
+    notify_behind();
+  }
+}
+
+/* With a replay buffer the recording keeps going on SAVE and COPY, the action
+ * is returned right away and only ABORT stops it. */
+static unsigned char run_supervise_loop(Args *args, pid_t process_pid,
+                                        Capture *capture, Replay *replay,
+                                        Segments *segments, const char *file,
+                                        Stats *stats, Display *dpy,
                                         Window *root, int *status) {
   unsigned char action = 0;
 
@@ -322,27 +576,116 @@ static unsigned char run_supervise_loop(pid_t process_pid, Display *dpy,
   Atom net_active_window = XInternAtom(dpy, "_NET_ACTIVE_WINDOW", False);
   Window active_window = 0;
 
+  // Segments are already where they're saved, there's nothing to copy
+  unsigned char actions = segments ? SAVE : SAVE | COPY;
+  // Pausing needs evid's own frames, without audio going on regardless
+  if (capture && capture_pausable(capture) &&
+      (!args->audio->subsystem || args->gif)) {
+    actions |= PAUSE;
+  }
   update_active_window(&active_window, dpy, root, &net_active_window);
-  GRAB(dpy, &active_window);
+  grab_keys(dpy, &active_window, actions);
 
-  while (!waitpid(process_pid, status, WNOHANG)) {
-    while (XPending(dpy)) {
+  /* Block until the X server, the encoder or a signal has something for us
+   * instead of polling them in a loop. */
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+
+  int child_fd = -1;
+#ifdef SYS_pidfd_open
+  if (process_pid) {
+    child_fd = syscall(SYS_pidfd_open, process_pid, 0);
+  }
+#endif
+  if (process_pid && child_fd == -1) {
+    // Kernels older than 5.3, get notified through SIGCHLD instead
+    sigaddset(&mask, SIGCHLD);
+  }
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (signal_fd == -1) {
+    die("failed to create a signal file descriptor: %s\n", strerror(errno));
+  }
+
+  enum {
+    POLL_X,
+    POLL_SIGNAL,
+    POLL_CHILD,
+    POLL_CAPTURE,
+    POLL_REPLAY,
+    POLL_SEGMENTS,
+    POLL_PROGRESS,
+    POLL_LAST
+  };
+  struct pollfd fds[POLL_LAST] = {
+      [POLL_X] = {.fd = ConnectionNumber(dpy), .events = POLLIN},
+      [POLL_SIGNAL] = {.fd = signal_fd, .events = POLLIN},
+      [POLL_CHILD] = {.fd = child_fd, .events = POLLIN},
+      [POLL_CAPTURE] = {.fd = capture ? capture->done_fd : -1,
+                        .events = POLLIN},
+      [POLL_REPLAY] = {.fd = replay ? replay->inotify_fd : -1,
+                       .events = POLLIN},
+      [POLL_SEGMENTS] = {.fd = segments ? segments->inotify_fd : -1,
+                         .events = POLLIN},
+      [POLL_PROGRESS] = {.fd = stats->fd, .events = POLLIN},
+  };
+
+  /* Without an ffmpeg child the recording is over when the capture thread
+   * (which also does the encoding) is done */
+  pid_t reaped = 0;
+  struct rusage usage;
+  while (process_pid ? !(reaped = wait4(process_pid, status, WNOHANG, &usage))
+                     : !(fds[POLL_CAPTURE].revents & POLLIN)) {
+    int handed_over = 0;
+    while (!handed_over && XPending(dpy)) {
       XEvent event;
       XNextEvent(dpy, &event);
       switch (event.type) {
       case PropertyNotify: {
         if (event.xproperty.atom == net_active_window) {
-          UNGRAB(dpy, &active_window);
+          ungrab_keys(dpy, &active_window, actions);
           update_active_window(&active_window, dpy, root, &net_active_window);
-          GRAB(dpy, &active_window);
+          grab_keys(dpy, &active_window, actions);
         }
         break;
       }
       case KeyPress:
       case KeyRelease: {
         action = get_matching_action(dpy, event.xkey);
+        if (action == PAUSE) {
+          // Toggled on the press, the encoder keeps going across pauses
+          if (event.type == KeyPress && (actions & PAUSE)) {
+            int paused = !atomic_load(&capture->paused);
+            capture_pause(capture, paused);
+            notify_paused(args, paused);
+          }
+          action = 0;
+          XAllowEvents(dpy, AsyncKeyboard, event.xkey.time);
+          XFlush(dpy);
+          break;
+        }
+        if (replay && action && action != ABORT) {
+          // Picked up by the caller on the press, the recording goes on
+          // meanwhile. The release comes once the keyboard is thawed and
+          // would take a second snapshot.
+          if (event.type == KeyPress) {
+            handed_over = 1;
+          } else {
+            action = 0;
+            XAllowEvents(dpy, AsyncKeyboard, event.xkey.time);
+            XFlush(dpy);
+          }
+          break;
+        }
         if (action) {
-          kill(process_pid, SIGTERM);
+          if (capture) {
+            // Closes the pipe so ffmpeg finishes the file on its own
+            capture_stop(capture);
+          } else {
+            kill(process_pid, SIGTERM);
+          }
         } else {
           XAllowEvents(dpy, ReplayKeyboard, event.xkey.time);
           XFlush(dpy);
@@ -351,9 +694,47 @@ static unsigned char run_supervise_loop(pid_t process_pid, Display *dpy,
       }
       }
     }
+
+    if (handed_over) {
+      break;
+    }
+
+    // Woken up regularly to sample the statistics
+    if (poll(fds, POLL_LAST, STATS_INTERVAL) == -1 && errno != EINTR) {
+      die("failed to wait for events: %s\n", strerror(errno));
+    }
+    if (fds[POLL_REPLAY].revents & POLLIN) {
+      replay_update(replay);
+    }
+    if (fds[POLL_SEGMENTS].revents & POLLIN) {
+      segments_update(segments);
+    }
+    if (fds[POLL_PROGRESS].revents & (POLLIN | POLLHUP) &&
+        stats_read(stats) == -1) {
+      fds[POLL_PROGRESS].fd = -1;
+    }
+    if (stats_update(stats, capture, file, 0)) {
+      check_stats(args, stats, capture);
+    }
+    if (fds[POLL_SIGNAL].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) == sizeof(info) &&
+          info.ssi_signo != SIGCHLD) {
+        shutdown(info.ssi_signo);
+      }
+    }
   }
 
-  UNGRAB(dpy, &active_window);
+  close(signal_fd);
+  if (child_fd != -1) {
+    close(child_fd);
+  }
+  if (reaped > 0) {
+    stats_child_exited(stats, usage.ru_maxrss);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  ungrab_keys(dpy, &active_window, actions);
   XAllowEvents(dpy, AsyncKeyboard, CurrentTime);
   XSync(dpy, True);
 
@@ -362,6 +743,7 @@ static unsigned char run_supervise_loop(pid_t process_pid, Display *dpy,
 
 static int notify_cancel() {
 #ifdef HAVE_NOTIFY
+  notifier_wait();
   char success_notification_summary[50];
   snprintf(success_notification_summary, ARR_SIZE(success_notification_summary),
            "%s: %s", PROGRAM_NAME, "recording was cancelled");
@@ -403,160 +785,746 @@ static int on_notification_timeout(gpointer loop) {
 }
 #endif
 
-int main(int argc, char *argv[]) {
+/* Statistics are written next to the saved file before telling the user */
+static void notify_saved(Args *args, char *new_file, Stats *stats) {
+  if (stats && args->verbosity >= INFO &&
+      stats_write_json(stats, new_file)) {
+    error("failed to write the statistics of %s\n", new_file);
+  }
+#ifdef HAVE_NOTIFY
+  notifier_wait();
+  GMainLoop *main_loop = g_main_loop_new(0, 1);
+  ActionPayload action_payload = {.loop = main_loop,
+                                  .target_file = new_file};
+  char success_notification_summary[50];
+  snprintf(success_notification_summary,
+           ARR_SIZE(success_notification_summary), "%s: %s", PROGRAM_NAME,
+           "recording saved successfuly");
+  NotifyNotification *success_notification = notify_notification_new(
+      success_notification_summary, new_file, NULL);
+  notify_notification_add_action(
+      success_notification, "default", "Show in file manager",
+      show_in_file_manager_callback, &action_payload, NULL);
+  notify_notification_show(success_notification, NULL);
+  int timeout = 5000;
+  notify_notification_set_timeout(success_notification, timeout);
+  g_signal_connect(success_notification, "closed",
+                   G_CALLBACK(on_notification_closed), &main_loop);
+  g_timeout_add(timeout, on_notification_timeout, &main_loop);
+  g_main_loop_run(main_loop);
+  g_main_loop_unref(main_loop);
+  g_object_unref(success_notification);
+#endif
+}
+
+typedef struct Save Save;
+struct Save {
+  Args *args;
+  char file[FILENAME_MAX]; /* empty when new_file is already in place */
+  char new_file[PATH_MAX];
+  Spool spool; /* saved instead of file when spooled */
+  int spooled;
+  int convert_gif; /* new_file is a gif made out of the recording */
+  Stats stats;
+  int has_stats;
+  time_t reported; /* when the progress was last shown */
 #ifdef HAVE_NOTIFY
-  notify_init(PROGRAM_NAME);
+  NotifyNotification *progress;
 #endif
+};
 
-  // Force to use x11
-  setenv("GDK_BACKEND", "x11", 1);
+static void report_save_progress(off_t copied, off_t total, void *data) {
+  Save *save = data;
+  time_t now = time(NULL);
+  if (copied < total && now == save->reported) {
+    return;
+  }
+  save->reported = now;
+  int percent = total > 0 ? copied * 100 / total : 100;
+  if (save->args->verbosity >= INFO) {
+    fprintf(stdout, "Saving %s: %d%% of %.1f MB\n", save->new_file, percent,
+            total / 1e6);
+  }
+#ifdef HAVE_NOTIFY
+  notifier_wait();
+  if (!save->progress) {
+    char progress_notification_summary[50];
+    snprintf(progress_notification_summary,
+             ARR_SIZE(progress_notification_summary), "%s: %s",
+             PROGRAM_NAME, "saving recording");
+    save->progress = notify_notification_new(progress_notification_summary,
+                                             save->new_file, NULL);
+  }
+  // Shown as a progress bar by most notification daemons
+  notify_notification_set_hint_int32(save->progress, "value", percent);
+  notify_notification_show(save->progress, NULL);
+#endif
+}
 
-  Args args = {0};
-  Audio audio = {0};
+/* Drops a recording that isn't kept */
+static void discard_recording(char *file, Spool *spool) {
+  if (spool) {
+    spool_destroy(spool);
+  } else {
+    remove_file(file);
+  }
+}
+
+static void run_save(void *data) {
+  Save *save = data;
+  Spool *spool = save->spooled ? &save->spool : NULL;
+  int failed = 0;
+  if (save->convert_gif) {
+    // The clip's length saves a probe, replay snapshots don't have one
+    failed = gifconv_run(save->args, spool ? spool->path : save->file,
+                         save->new_file,
+                         save->has_stats ? save->stats.duration : 0);
+    discard_recording(save->file, spool);
+    if (!failed && save->args->fsync) {
+      sync_file(save->new_file);
+    }
+  } else if (spool) {
+    failed = spool_save(spool, save->new_file, save->args->fsync,
+                        report_save_progress, save);
+    spool_destroy(spool);
+  } else if (save->file[0]) {
+    failed = move_file(save->file, save->new_file, save->args->fsync,
+                       report_save_progress, save);
+  } else if (save->args->fsync) {
+    sync_file(save->new_file);
+  }
+#ifdef HAVE_NOTIFY
+  if (save->progress) {
+    notify_notification_close(save->progress, NULL);
+    g_object_unref(save->progress);
+  }
+#endif
+  if (failed && save->convert_gif) {
+    error("failed to generate the gif\n");
+  } else if (failed && (spool || !save->file[0])) {
+    error("failed to save the recording\n");
+  } else if (failed) {
+    error("failed to save the recording, it's still in %s\n", save->file);
+  } else {
+    notify_saved(save->args, save->new_file,
+                 save->has_stats ? &save->stats : NULL);
+  }
+  free(save);
+}
+
+/* Converting, copying to another filesystem and even the notification take
+ * a while, they're queued so the next recording can start right away.
+ * file is moved to new_file, or converted to a gif there, and is NULL when
+ * new_file is already in place. A spool is saved instead of file when
+ * given, and is then taken over. */
+static void queue_save(Args *args, char *file, Spool *spool, char *new_file,
+                       int convert_gif, Stats *stats) {
+  Save *save = calloc(1, sizeof(Save));
+  if (!save) {
+    die("failed to allocate memory\n");
+  }
+  save->args = args;
+  if (spool) {
+    save->spool = *spool;
+    save->spooled = 1;
+  } else if (file) {
+    snprintf(save->file, sizeof(save->file), "%s", file);
+  }
+  snprintf(save->new_file, sizeof(save->new_file), "%s", new_file);
+  save->convert_gif = convert_gif;
+  if (stats) {
+    save->stats = *stats;
+    save->has_stats = 1;
+  }
+  int ahead = jobs_submit(run_save, save);
+  // Every worker is busy, it waits for one of those ahead to be done
+  if (ahead >= args->jobs && args->verbosity >= INFO) {
+    fprintf(stdout, "Queued %s behind %d recording%s still being saved\n",
+            new_file, ahead, ahead > 1 ? "s" : "");
+  }
+}
 
+/* Saves or copies a finished recording, file is removed afterwards unless
+ * the clipboard still needs it. A direct file was recorded where it's saved
+ * and only has to be left there, a copied one is moved to $TMPDIR. A spooled
+ * recording has no file and is always taken over. Fails when there's nowhere
+ * to save it. */
+static int handle_action(Args *args, unsigned char action, char *file,
+                          Spool *spool, int convert_gif, int direct,
+                          Stats *stats) {
+  switch (action) {
+  case SAVE: {
+    char new_file[PATH_MAX];
+    int res = 0;
+    if (direct) {
+      snprintf(new_file, sizeof(new_file), "%s", file);
+    } else {
+      res = get_output_file(new_file, sizeof(new_file), args);
+    }
+    if (res < 0) {
+      discard_recording(file, spool);
+      // Not worth taking a running daemon down for
 #ifdef HAVE_ZENITY
-  args.use_zenity = 0;
+      if (res == -2) {
+        notify_cancel();
+        return 0;
+      } else {
+        error("couldn't save the file in the default location, install "
+              "zenity or "
+              "define either the HOME or XDG_VIDEOS_DIR environment "
+              "variables\n");
+      }
+#else
+      error("couldn't save the file in the default location, "
+            "define either the HOME or XDG_VIDEOS_DIR environment "
+            "variables or check its permissions\n");
 #endif
-  args.framerate = "10";
-  args.audio = &audio;
-  args.verbosity = QUIET;
-  args.draw_mouse = 1;
-  args.show_region = 0;
-  args.gif = 0;
-  args.output = NULL;
+      return -1;
+    }
+    if (convert_gif || spool) {
+      queue_save(args, spool ? NULL : file, spool, new_file, convert_gif,
+                 stats);
+    } else if (!direct && rename(file, new_file)) {
+      queue_save(args, file, NULL, new_file, 0, stats);
+    } else {
+      queue_save(args, NULL, NULL, new_file, 0, stats);
+    }
+    break;
+  }
+  case COPY: {
+    char copy[FILENAME_MAX];
+    if (spool) {
+      // The clipboard hands out a path, the recording is linked in place of
+      // the empty file when it's already on disk in $TMPDIR
+      int failed = get_tmp_file(copy, sizeof(copy), args) <= 0 ||
+                   remove_file(copy) ||
+                   spool_save(spool, copy, 0, NULL, NULL);
+      spool_destroy(spool);
+      spool = NULL;
+      if (failed) {
+        notify_cancel();
+        break;
+      }
+      file = copy;
+    } else if (direct) {
+      // The clipboard removes the file it hands out once it's replaced, a
+      // recording made in place is taken out of the videos directory first
+      int created = get_tmp_file(copy, sizeof(copy), args) > 0;
+      if (!created || move_file(file, copy, 0, NULL, NULL)) {
+        if (created) {
+          remove_file(copy);
+        }
+        discard_recording(file, NULL);
+        notify_cancel();
+        break;
+      }
+      file = copy;
+    }
+    if (!copy_file(file)) {
+#ifdef HAVE_NOTIFY
+      notifier_wait();
+      char success_notification_summary[50];
+      snprintf(success_notification_summary,
+               ARR_SIZE(success_notification_summary), "%s: %s",
+               PROGRAM_NAME, "recording saved to clipboard");
+      NotifyNotification *success_notification =
+          notify_notification_new(success_notification_summary, NULL, NULL);
+      notify_notification_show(success_notification, NULL);
+      g_object_unref(success_notification);
+#endif
+      break;
+    }
+  }
+  default: {
+    discard_recording(file, spool);
+    notify_cancel();
+    break;
+  }
+  }
+  return 0;
+}
 
-  process_args(&args, argc, argv);
+/* Segments are already where they're saved, anything but saving removes
+ * them */
+static void finish_segments(Args *args, unsigned char action,
+                            Segments *segments, Stats *stats) {
+  if (action == SAVE && segments->finished) {
+    queue_save(args, NULL, NULL,
+               segments->list ? segments->list_path : segments->last, 0,
+               stats);
+  } else {
+    segments_remove(segments);
+    notify_cancel();
+  }
+  segments_destroy(segments);
+}
 
-  Display *dpy = XOpenDisplay(NULL);
-  if (!dpy) {
-    die("failed to open display %s\n", getenv("DISPLAY"));
+static int open_spool(Args *args, Spool *spool) {
+  if (spool_open(spool, (off_t)args->tmp_memory * 1024 * 1024)) {
+    error("failed to create the temporary recording: %s\n", strerror(errno));
+    return -1;
   }
+  return 0;
+}
 
-  Window root = DefaultRootWindow(dpy);
+/* Undoes whatever record() set up when the recording can't go on, the
+ * daemon keeps running afterwards */
+static int abort_recording(Replay *replay, Capture *capture, Encoder *encoder,
+                           Spool *spool, Segments *segments) {
+  if (subp > 0) {
+    kill(subp, SIGTERM);
+    waitpid(subp, NULL, 0);
+  }
+  subp = 0;
+  if (capture) {
+    capture_destroy(capture);
+  }
+  // The encoder may be writing to the spool, it has to let go of it first
+  if (encoder) {
+    encoder_close(encoder);
+  }
+  if (spool) {
+    spool_destroy(spool);
+  }
+  if (segments) {
+    segments_remove(segments);
+    segments_destroy(segments);
+  }
+  if (replay) {
+    active_replay = NULL;
+    replay_destroy(replay);
+  }
+  if (tmp_file[0]) {
+    remove_file(tmp_file);
+    tmp_file[0] = '\0';
+  }
+  return EXIT_FAILURE;
+}
+
+/* Selects a region (or records the given one again when reuse_region is set)
+ * and runs a whole recording including saving or copying the result. */
+static int record(Args *args, Display *dpy, Window root, Display *capture_dpy,
+                  _Region *region, int reuse_region) {
   _Region selected_region;
 
-  {
+  if (reuse_region) {
+    selected_region = *region;
+  } else if (args->monitor) {
+    if (select_monitor(dpy, root, args->monitor, &selected_region)) {
+      error("no monitor matches %s\n", args->monitor);
+      return EXIT_FAILURE;
+    }
+  } else {
     int r = select_region(dpy, root, &selected_region);
+    trace("region selected");
     if (r) {
-      XCloseDisplay(dpy);
       if (r != -2) {
-        die("failed to select a region\n");
+        error("failed to select a region\n");
+        return EXIT_FAILURE;
       }
       return EXIT_SUCCESS;
     }
   }
 
   if (selected_region.w == 0 || selected_region.h == 0) {
-    XCloseDisplay(dpy);
-    die("selected region is empty\n");
+    error("selected region is empty\n");
+    return EXIT_FAILURE;
   }
+  *region = selected_region;
 
-  if (get_tmp_file(tmp_file, sizeof(tmp_file), &args) <= 0) {
-    die("failed to get a temporary file\n");
-  }
-  subp = fork();
-  switch (subp) {
-  case -1: {
-    die("error forking the current process\n");
+  Replay replay = {0};
+  Replay *replayp = NULL;
+  if (args->replay) {
+    if (replay_init(&replay, args)) {
+      error("failed to create the replay buffer: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    replayp = &replay;
+    active_replay = replayp;
   }
-  case 0: {
-    exec_ffmpeg(&args, selected_region, tmp_file);
-    die("failed to launch ffmpeg, error: %s\n", strerror(errno));
+
+  Capture capture = {0};
+  Capture *capturep = NULL;
+  Encoder encoder = {0};
+  Encoder *encoderp = NULL;
+  int capture_pipe[2];
+  if (!capture_init(&capture, capture_dpy, args, selected_region)) {
+    capturep = &capture;
   }
-  default: {
-    signal(SIGTERM, &shutdown);
-    signal(SIGINT, &shutdown);
 
-    int status = 0;
-    unsigned char action = run_supervise_loop(subp, dpy, &root, &status);
+  Segments segments;
+  Segments *segmentsp = NULL;
+  if (args->segment_time || args->segment_size) {
+    char file[PATH_MAX];
+    if (get_output_file(file, sizeof(file), args) < 0 ||
+        segments_init(&segments, args, file)) {
+      error("failed to prepare the segments: %s\n", strerror(errno));
+      return abort_recording(replayp, capturep, NULL, NULL, NULL);
+    }
+    segmentsp = &segments;
+  }
 
-    if (WEXITSTATUS(status) == EXIT_FAILURE) {
-      return EXIT_FAILURE;
+  // Whatever needs no conversion afterwards is written where it's saved,
+  // sparing a copy when $TMPDIR is on another filesystem. The rest is
+  // spooled, in memory as long as it's small enough.
+  int direct = !replayp && !segmentsp &&
+               (args->gif != HQGIF || (capturep && encoder_supported(args))) &&
+               !get_direct_file(tmp_file, sizeof(tmp_file), args);
+  Spool spool;
+  Spool *spoolp = NULL;
+  if (!direct && !replayp && !segmentsp) {
+    if (open_spool(args, &spool)) {
+      return abort_recording(replayp, capturep, NULL, NULL, segmentsp);
     }
+    spoolp = &spool;
+  }
 
-    if (WEXITSTATUS(status) == EXIT_SUCCESS ||
-        (WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM) ||
-        WEXITSTATUS(status) == 0xFF) {
-      switch (action) {
-      case SAVE: {
-        char new_file[PATH_MAX];
-        int res = get_output_file(new_file, sizeof(new_file), &args);
-        if (res < 0) {
-          remove_file(tmp_file);
-#ifdef HAVE_ZENITY
-          if (res == -2) {
-            notify_cancel();
-            break;
-          } else {
-            die("couldn't save the file in the default location, install "
-                "zenity or "
-                "define either the HOME or XDG_VIDEOS_DIR environment "
-                "variables\n");
-          }
-#else
-          die("couldn't save the file in the default location"
-              "define either the HOME or XDG_VIDEOS_DIR environment "
-              "variables or check its permissions\n");
-#endif
-        }
-        if (args.gif == HQGIF) {
-          create_gif(&args, tmp_file, new_file);
-        } else {
-          move_file(tmp_file, new_file);
+  if (capturep) {
+    char *output = segmentsp ? segments.pattern
+                   : spoolp  ? spool.input_path
+                             : tmp_file;
+    // Frames reach the encoder downscaled
+    _Region encoded_region = selected_region;
+    encoded_region.w = capture.width;
+    encoded_region.h = capture.height;
+    if (encoder_supported(args) &&
+        !encoder_open(&encoder, args, encoded_region, capture.pix_fmt,
+                      output)) {
+      encoderp = &encoder;
+    } else {
+      if (direct && args->gif == HQGIF) {
+        // ffmpeg's recording still has to be turned into the gif
+        remove_file(tmp_file);
+        tmp_file[0] = '\0';
+        direct = 0;
+        if (open_spool(args, &spool)) {
+          return abort_recording(replayp, capturep, NULL, NULL, segmentsp);
         }
+        spoolp = &spool;
+      }
+      if (pipe(capture_pipe) == -1) {
+        error("failed to create the capture pipe\n");
+        return abort_recording(replayp, capturep, NULL, spoolp, segmentsp);
+      }
+    }
+  }
+  if (segmentsp && args->segment_size && !encoderp &&
+      args->verbosity >= INFO) {
+    fprintf(stdout, "Segments can only be cut by size when evid encodes "
+                    "the frames, cutting every %d minutes\n",
+            args->segment_time ? args->segment_time / 60
+                               : SEGMENT_DEFAULT_MINUTES);
+  }
+  if (args->damage && (!capturep || !capturep->vfr) &&
+      args->verbosity >= INFO) {
+    fprintf(stdout, "Damage tracking is not available, recording every "
+                    "frame\n");
+  }
 
-        remove_file(tmp_file);
-#ifdef HAVE_NOTIFY
-        GMainLoop *main_loop = g_main_loop_new(0, 1);
-        ActionPayload action_payload = {.loop = main_loop,
-                                        .target_file = new_file};
-        char success_notification_summary[50];
-        snprintf(success_notification_summary,
-                 ARR_SIZE(success_notification_summary), "%s: %s", PROGRAM_NAME,
-                 "recording saved successfuly");
-        NotifyNotification *success_notification = notify_notification_new(
-            success_notification_summary, new_file, NULL);
-        notify_notification_add_action(
-            success_notification, "default", "Show in file manager",
-            show_in_file_manager_callback, &action_payload, NULL);
-        notify_notification_show(success_notification, NULL);
-        int timeout = 5000;
-        notify_notification_set_timeout(success_notification, timeout);
-        g_signal_connect(success_notification, "closed",
-                         G_CALLBACK(on_notification_closed), &main_loop);
-        g_timeout_add(timeout, on_notification_timeout, &main_loop);
-        g_main_loop_run(main_loop);
-        g_main_loop_unref(main_loop);
-        g_object_unref(success_notification);
-#endif
-        break;
+  Stats stats;
+  int progress_pipe[2];
+  // Frames encoded in-process don't need an ffmpeg to supervise
+  if (!encoderp) {
+    if (pipe2(progress_pipe, O_CLOEXEC) == -1) {
+      error("failed to create the progress pipe\n");
+      if (capturep) {
+        close(capture_pipe[0]);
+        close(capture_pipe[1]);
       }
-      case COPY: {
-        if (!copy_file(tmp_file)) {
-#ifdef HAVE_NOTIFY
-          char success_notification_summary[50];
-          snprintf(success_notification_summary,
-                   ARR_SIZE(success_notification_summary), "%s: %s",
-                   PROGRAM_NAME, "recording saved to clipboard");
-          NotifyNotification *success_notification =
-              notify_notification_new(success_notification_summary, NULL, NULL);
-          notify_notification_show(success_notification, NULL);
-          g_object_unref(success_notification);
-#endif
-          break;
-        }
+      return abort_recording(replayp, capturep, NULL, spoolp, segmentsp);
+    }
+    subp = fork();
+    switch (subp) {
+    case -1: {
+      error("error forking the current process\n");
+      close(progress_pipe[0]);
+      close(progress_pipe[1]);
+      if (capturep) {
+        close(capture_pipe[0]);
+        close(capture_pipe[1]);
       }
-      default: {
-        notify_cancel();
-        break;
+      return abort_recording(replayp, capturep, NULL, spoolp, segmentsp);
+    }
+    case 0: {
+      if (capturep) {
+        dup2(capture_pipe[0], STDIN_FILENO);
+        close(capture_pipe[0]);
+        close(capture_pipe[1]);
+      }
+      // dup2 leaves close-on-exec set when both are the same descriptor
+      if (progress_pipe[1] == STATS_PROGRESS_FD) {
+        fcntl(STATS_PROGRESS_FD, F_SETFD, 0);
+      } else {
+        dup2(progress_pipe[1], STATS_PROGRESS_FD);
+      }
+      if (spoolp) {
+        dup2(spool.input, SPOOL_FFMPEG_FD);
+      }
+      exec_ffmpeg(args, selected_region,
+                  spoolp ? SPOOL_FFMPEG_URL : tmp_file, spoolp != NULL,
+                  capturep, replayp, segmentsp);
+      die("failed to launch ffmpeg, error: %s\n", strerror(errno));
+    }
+    }
+    trace("ffmpeg spawned");
+    close(progress_pipe[1]);
+    fcntl(progress_pipe[0], F_SETFL, O_NONBLOCK);
+    stats_init(&stats, progress_pipe[0], subp);
+  } else {
+    stats_init(&stats, -1, 0);
+  }
+  // The encoder or ffmpeg have theirs, the spool ends once they're done
+  if (spoolp) {
+    spool_close_input(spoolp);
+  }
+  const char *recording = spoolp ? spool.path : direct ? tmp_file : NULL;
+
+  signal(SIGTERM, &shutdown);
+  signal(SIGINT, &shutdown);
+  // A dead encoder is noticed through waitpid, not by getting killed
+  signal(SIGPIPE, SIG_IGN);
+
+  if (capturep) {
+    int fd = -1;
+    if (!encoderp) {
+      close(capture_pipe[0]);
+      fd = capture_pipe[1];
+    }
+    if (capture_start(capturep, fd, encoderp)) {
+      error("failed to start capturing frames\n");
+      // ffmpeg sees the end of its input and is stopped along with the rest
+      if (fd != -1) {
+        close(fd);
       }
+      stats_destroy(&stats);
+      return abort_recording(replayp, capturep, encoderp, spoolp, segmentsp);
+    }
+    trace("capture started");
+  }
+
+  int status = 0;
+  unsigned char action;
+  for (;;) {
+    action = run_supervise_loop(args, subp, capturep, replayp, segmentsp,
+                                recording, &stats, dpy, &root, &status);
+    if (!replayp || !action || action == ABORT) {
+      break;
+    }
+    // Save the last seconds while the recording goes on
+    if (get_tmp_file(tmp_file, sizeof(tmp_file), args) <= 0 ||
+        replay_snapshot(replayp, args, tmp_file)) {
+      error("failed to save the replay buffer\n");
+      continue;
+    }
+    handle_action(args, action, tmp_file, NULL, args->gif != 0, 0, NULL);
+    tmp_file[0] = '\0';
+  }
+  if (capturep) {
+    capture_stop(capturep);
+    if (encoderp) {
+      int failed = capturep->failed;
+      if (encoder_close(encoderp)) {
+        failed = 1;
       }
+      status = W_EXITCODE(failed ? EXIT_FAILURE : EXIT_SUCCESS, 0);
     }
   }
+  if (spoolp && spool_finish(spoolp)) {
+    status = W_EXITCODE(EXIT_FAILURE, 0);
   }
-#ifdef HAVE_NOTIFY
-  notify_uninit();
+  // The last one was closed along with the encoder or ffmpeg
+  if (segmentsp) {
+    segments_update(segmentsp);
+  }
+  // ffmpeg may have sent its last progress after the loop was left
+  if (stats.fd != -1) {
+    stats_read(&stats);
+  }
+  stats_update(&stats, capturep, recording, 1);
+  if (args->verbosity >= INFO) {
+    // Overwrites the progress line of the in-process encoder if any
+    stats_print(&stats, stdout, "\n");
+  }
+  stats_destroy(&stats);
+  if (capturep) {
+    capture_destroy(capturep);
+  }
+
+  subp = 0;
+  if (replayp) {
+    active_replay = NULL;
+    replay_destroy(replayp);
+    // Everything worth keeping was saved while recording
+    if (action == ABORT) {
+      notify_cancel();
+    }
+    return WEXITSTATUS(status) == EXIT_FAILURE && !action ? EXIT_FAILURE
+                                                          : EXIT_SUCCESS;
+  }
+  if (WEXITSTATUS(status) == EXIT_FAILURE) {
+    if (spoolp) {
+      spool_destroy(spoolp);
+    }
+    // Whatever made it into segments is kept
+    if (segmentsp) {
+      segments_destroy(segmentsp);
+    }
+    // A partial recording isn't left where recordings are saved
+    if (direct) {
+      remove_file(tmp_file);
+    }
+    tmp_file[0] = '\0';
+    return EXIT_FAILURE;
+  }
+
+  if (WEXITSTATUS(status) == EXIT_SUCCESS ||
+      (WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM) ||
+      WEXITSTATUS(status) == 0xFF) {
+    if (segmentsp) {
+      finish_segments(args, action, segmentsp, &stats);
+    } else {
+      // Gifs written in-process need no conversion
+      if (handle_action(args, action, tmp_file, spoolp,
+                        args->gif == HQGIF && !encoderp, direct, &stats)) {
+        tmp_file[0] = '\0';
+        return EXIT_FAILURE;
+      }
+    }
+  } else if (spoolp) {
+    spool_destroy(spoolp);
+  } else if (segmentsp) {
+    segments_destroy(segmentsp);
+  } else if (direct) {
+    remove_file(tmp_file);
+  }
+  tmp_file[0] = '\0';
+  return EXIT_SUCCESS;
+}
+
+static void run_daemon(Args *args, Display *dpy, Window root,
+                       Display *capture_dpy) {
+  int listen_fd = daemon_listen();
+  if (listen_fd == -1) {
+    die("failed to start the daemon, is another one running?\n");
+  }
+  signal(SIGTERM, &shutdown);
+  signal(SIGINT, &shutdown);
+
+  grab_record_key(dpy, &root);
+
+  _Region region = {0};
+  int recorded = 0;
+  struct pollfd fds[] = {{.fd = ConnectionNumber(dpy), .events = POLLIN},
+                         {.fd = listen_fd, .events = POLLIN}};
+  for (;;) {
+    int trigger = 0;
+    while (XPending(dpy)) {
+      XEvent event;
+      XNextEvent(dpy, &event);
+      if (event.type == KeyPress && is_record_key(dpy, event.xkey)) {
+        trigger = DAEMON_RECORD;
+      }
+    }
+    if (!trigger) {
+      if (poll(fds, ARR_SIZE(fds), -1) == -1 && errno != EINTR) {
+        die("failed to wait for events: %s\n", strerror(errno));
+      }
+      if (fds[1].revents & POLLIN) {
+        trigger = daemon_read_command(listen_fd);
+      }
+    }
+    if (trigger <= 0) {
+      continue;
+    }
+
+    trace_restart("recording triggered");
+    int reuse_region = trigger == DAEMON_LAST && recorded;
+    if (record(args, dpy, root, capture_dpy, &region, reuse_region) ==
+        EXIT_SUCCESS) {
+      recorded = 1;
+    }
+    // Triggers sent while recording would start another one right away
+    daemon_drain(listen_fd);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  // Force to use x11
+  setenv("GDK_BACKEND", "x11", 1);
+
+  Args args = {0};
+  Audio audio = {0};
+
+#ifdef HAVE_ZENITY
+  args.use_zenity = 0;
 #endif
+  args.framerate = "10";
+  args.audio = &audio;
+  args.verbosity = QUIET;
+  args.draw_mouse = 1;
+  args.show_region = 0;
+  args.gif = 0;
+  args.output = NULL;
+  args.replay = 0;
+  args.replay_max_size = REPLAY_DEFAULT_MAX_SIZE;
+  args.daemon = 0;
+  args.trigger = NULL;
+  args.monitor = NULL;
+  args.fsync = 0;
+  args.tmp_memory = SPOOL_DEFAULT_MEMORY;
+  args.segment_time = 0;
+  args.segment_size = 0;
+  args.segment_list = 0;
+  args.segment_command = NULL;
+  args.jobs = JOBS_DEFAULT_WORKERS;
+  args.scale = 1;
+  args.max_width = 0;
+  args.max_height = 0;
+
+  process_args(&args, argc, argv);
+
+  if (args.trigger) {
+    if (daemon_trigger(args.trigger)) {
+      fprintf(stderr, "%s: no daemon is listening, start one with --daemon\n",
+              PROGRAM_NAME);
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  trace_init(args.verbosity == DEBUG);
+  jobs_init(args.jobs);
+  // Only needed once the recording is over, don't wait for it
+  notifier_init();
+
+  // Xlib is used from the capture thread as well
+  if (!XInitThreads()) {
+    die("failed to initialize Xlib for threads\n");
+  }
+  Display *dpy = XOpenDisplay(NULL);
+  if (!dpy) {
+    die("failed to open display %s\n", getenv("DISPLAY"));
+  }
+  trace("display opened");
+  // Frames are grabbed from a thread of their own on a separate connection
+  Display *capture_dpy = XOpenDisplay(NULL);
+
+  Window root = DefaultRootWindow(dpy);
+  int ret = EXIT_SUCCESS;
+  if (args.daemon) {
+    run_daemon(&args, dpy, root, capture_dpy);
+  } else {
+    _Region region;
+    ret = record(&args, dpy, root, capture_dpy, &region, 0);
+  }
+
+  // Recordings still being saved are finished before exiting
+  jobs_wait();
+  jobs_uninit();
+  notifier_uninit();
+  if (capture_dpy) {
+    XCloseDisplay(capture_dpy);
+  }
   XCloseDisplay(dpy);
-  return EXIT_SUCCESS;
+  return ret;
 }
@@ -16,6 +16,8 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 **/
 
+#define _GNU_SOURCE
+
 #include "file.h"
 #include "util.h"
 
@@ -29,11 +31,16 @@
 #include <unistd.h>
 
 #include <sys/cdefs.h>
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 
+#include <linux/fs.h>
 #include <linux/limits.h>
 
+/* Small enough for the progress to move along */
+#define COPY_CHUNK (64 * 1024 * 1024)
+
 #ifdef HAVE_NOTIFY
 #include <gio/gio.h>
 #endif
@@ -49,15 +56,38 @@ void get_default_file_name(char *default_file_name, Args *args) {
   }
 }
 
-int get_tmp_file(char *tmp_file, size_t tmp_file_size, Args *args) {
-  char *tmp_dir = getenv("TMPDIR");
-  if (tmp_dir == NULL) {
-    tmp_dir = "/tmp";
-  }
+const char *get_tmp_dir(void) {
+  const char *tmp_dir = getenv("TMPDIR");
+  return tmp_dir ? tmp_dir : "/tmp";
+}
 
+int get_tmp_file(char *tmp_file, size_t tmp_file_size, Args *args) {
   char default_file_name[FILENAME_MAX];
   get_default_file_name(default_file_name, args);
-  return snprintf(tmp_file, tmp_file_size, "%s/%s", tmp_dir, default_file_name);
+  // Instances started within the same second get a name of their own
+  const char *extension = strrchr(default_file_name, '.');
+  int length = snprintf(tmp_file, tmp_file_size, "%s/%.*s-XXXXXX%s",
+                        get_tmp_dir(), (int)(extension - default_file_name),
+                        default_file_name, extension);
+  if (length <= 0 || (size_t)length >= tmp_file_size) {
+    return -1;
+  }
+  int fd = mkstemps(tmp_file, strlen(extension));
+  if (fd == -1) {
+    return -1;
+  }
+  close(fd);
+  return length;
+}
+
+int get_socket_file(char *socket_file, size_t socket_file_size) {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir) {
+    return snprintf(socket_file, socket_file_size, "%s/%s.sock", runtime_dir,
+                    PROGRAM_NAME);
+  }
+  return snprintf(socket_file, socket_file_size, "/tmp/%s-%d.sock",
+                  PROGRAM_NAME, getuid());
 }
 
 int get_output_file(char *new_file, size_t new_file_size, Args *args) {
@@ -124,6 +154,24 @@ int get_output_file(char *new_file, size_t new_file_size, Args *args) {
   return -1;
 }
 
+int get_direct_file(char *file, size_t file_size, Args *args) {
+#ifdef HAVE_ZENITY
+  // The dialog can only be shown once the recording is done
+  if (args->use_zenity) {
+    return -1;
+  }
+#endif
+  if (get_output_file(file, file_size, args) < 0) {
+    return -1;
+  }
+  // An existing file is only replaced once the recording is saved
+  struct stat st;
+  if (stat(file, &st) == 0 || errno != ENOENT) {
+    return -1;
+  }
+  return 0;
+}
+
 int remove_file(const char *file) {
   int rm = remove(file);
   if (rm) {
@@ -134,46 +182,111 @@ int remove_file(const char *file) {
   return rm;
 }
 
-void move_file(const char *source_file, const char *dest_file) {
-  int mv = rename(source_file, dest_file);
-  if (mv) {
-    if (errno == EXDEV) {
-      int oldfilefd = open(source_file, O_RDONLY);
-      if (oldfilefd == -1) {
-        die("couldn't open %s, failed with error: %s\n", source_file,
-            strerror(errno));
-      }
-      int newfilefd = open(dest_file, O_WRONLY | O_TRUNC | O_CREAT, 0755);
-      if (newfilefd == -1) {
-        close(oldfilefd);
-        die("couldn't open %s, failed with error: %s\n", dest_file,
-            strerror(errno));
-      }
-      struct stat st;
-      if (fstat(oldfilefd, &st) == -1) {
-        close(oldfilefd);
-        close(newfilefd);
-        die("fatal error obtaining file status, failed with "
-            "error: "
-            "%s\n",
-            strerror(errno));
+/* Sharing the extents when the filesystem can and going through
+ * copy_file_range otherwise. sendfile is only used by kernels that can't copy
+ * between filesystems (before 5.3). */
+int copy_fd(int in, int out, off_t size, CopyProgress progress, void *data) {
+  if (!ioctl(out, FICLONE, in)) {
+    if (progress) {
+      progress(size, size, data);
+    }
+    return 0;
+  }
+
+  int use_range = 1;
+  off_t copied = 0;
+  while (copied < size) {
+    ssize_t bytes;
+    if (use_range) {
+      bytes = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+      if (bytes == -1 && !copied &&
+          (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+           errno == EOPNOTSUPP)) {
+        use_range = 0;
+        continue;
       }
-      int sizeleft = st.st_size;
-      while (sizeleft > 0) {
-        int bytes = sendfile(newfilefd, oldfilefd, NULL, 64 * 1024 * 1024);
-        if (bytes == -1) {
-          close(oldfilefd);
-          close(newfilefd);
-          die("fatal error saving the file, failed with error: "
-              "%s\n",
-              strerror(errno));
-        }
-        sizeleft -= bytes;
+    } else {
+      bytes = sendfile(out, in, NULL, COPY_CHUNK);
+    }
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
       }
-      close(oldfilefd);
-      close(newfilefd);
+      return -1;
+    }
+    if (!bytes) {
+      // Truncated while being copied, the end of it would be lost
+      errno = ENODATA;
+      return -1;
+    }
+    copied += bytes;
+    if (progress) {
+      progress(copied, size, data);
+    }
+  }
+  return 0;
+}
+
+int move_file(const char *source_file, const char *dest_file, int sync,
+              CopyProgress progress, void *data) {
+  if (!rename(source_file, dest_file)) {
+    return sync ? sync_file(dest_file) : 0;
+  }
+  if (errno != EXDEV) {
+    error("couldn't move %s to %s, failed with error: %s\n", source_file,
+          dest_file, strerror(errno));
+    return -1;
+  }
+
+  int oldfilefd = open(source_file, O_RDONLY);
+  if (oldfilefd == -1) {
+    error("couldn't open %s, failed with error: %s\n", source_file,
+          strerror(errno));
+    return -1;
+  }
+  int newfilefd = open(dest_file, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  if (newfilefd == -1) {
+    error("couldn't open %s, failed with error: %s\n", dest_file,
+          strerror(errno));
+    close(oldfilefd);
+    return -1;
+  }
+  struct stat st;
+  int ret = 0;
+  if (fstat(oldfilefd, &st) == -1 ||
+      copy_fd(oldfilefd, newfilefd, st.st_size, progress, data) == -1 ||
+      (sync && fsync(newfilefd) == -1)) {
+    error("fatal error saving the file, failed with error: %s\n",
+          strerror(errno));
+    ret = -1;
+  }
+  close(oldfilefd);
+  if (close(newfilefd) == -1 && !ret) {
+    error("fatal error saving the file, failed with error: %s\n",
+          strerror(errno));
+    ret = -1;
+  }
+  if (ret) {
+    // The recording is still where it was
+    remove_file(dest_file);
+    return -1;
+  }
+  remove_file(source_file);
+  return 0;
+}
+
+int sync_file(const char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd == -1 || fsync(fd) == -1) {
+    error("couldn't flush %s to disk, failed with error: %s\n", file,
+          strerror(errno));
+    if (fd != -1) {
+      close(fd);
     }
+    return -1;
   }
+  close(fd);
+  return 0;
 }
 
 int mkdirp(const char *dir) {
@@ -20,13 +20,31 @@
 #define EVID_FILE_H
 #include "types.h"
 #include <stddef.h>
+#include <sys/types.h>
 
 void get_default_file_name(char *default_file_name, Args *args);
 
+const char *get_tmp_dir(void);
+/* Creates an empty file with a unique name in $TMPDIR */
 int get_tmp_file(char *tmp_file, size_t tmp_file_size, Args *args);
 int get_output_file(char *new_file, size_t new_file_size, Args *args);
-
-void move_file(const char *source_file, const char *dest_file);
+int get_socket_file(char *socket_file, size_t socket_file_size);
+/* Where a recording can be written right away to be saved in place, fails
+ * when the location isn't known yet or something is already there */
+int get_direct_file(char *file, size_t file_size, Args *args);
+
+/* Called as a copy goes on, copied reaches total when it's done */
+typedef void (*CopyProgress)(off_t copied, off_t total, void *data);
+
+/* Renames source_file to dest_file or copies it over when they're on
+ * different filesystems, sync flushes dest_file to disk before returning.
+ * source_file is only gone once dest_file is complete. */
+int move_file(const char *source_file, const char *dest_file, int sync,
+              CopyProgress progress, void *data);
+/* Copies the size bytes of in to out, both at their start, fails when in
+ * ends before that */
+int copy_fd(int in, int out, off_t size, CopyProgress progress, void *data);
+int sync_file(const char *file);
 int remove_file(const char *file);
 int mkdirp(const char *dir);
 
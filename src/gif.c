@@ -0,0 +1,330 @@
+/**
+    gif.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "gif.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PIXEL_MASK 0x00FFFFFF
+#define LZW_MIN_CODE_SIZE 8
+#define LZW_CLEAR (1 << LZW_MIN_CODE_SIZE)
+#define LZW_END (LZW_CLEAR + 1)
+#define LZW_MAX_CODE 4095
+#define LZW_HASH_BITS 13 /* the table is half full at most */
+#define LZW_HASH_SIZE (1 << LZW_HASH_BITS)
+
+typedef struct Lzw Lzw;
+struct Lzw {
+  FILE *file;
+  uint8_t block[255];
+  int block_size;
+  uint32_t bits;
+  int bits_count;
+  int code_size;
+  int next;
+  int32_t keys[LZW_HASH_SIZE];
+  uint16_t codes[LZW_HASH_SIZE];
+};
+
+static void put_short(FILE *file, int value) {
+  fputc(value & 0xFF, file);
+  fputc((value >> 8) & 0xFF, file);
+}
+
+static void flush_block(Lzw *lzw) {
+  if (lzw->block_size) {
+    fputc(lzw->block_size, lzw->file);
+    fwrite(lzw->block, 1, lzw->block_size, lzw->file);
+    lzw->block_size = 0;
+  }
+}
+
+static void reset_table(Lzw *lzw) {
+  memset(lzw->keys, -1, sizeof(lzw->keys));
+  lzw->next = LZW_END + 1;
+  lzw->code_size = LZW_MIN_CODE_SIZE + 1;
+}
+
+static void put_code(Lzw *lzw, int code) {
+  lzw->bits |= (uint32_t)code << lzw->bits_count;
+  lzw->bits_count += lzw->code_size;
+  while (lzw->bits_count >= 8) {
+    lzw->block[lzw->block_size++] = lzw->bits & 0xFF;
+    lzw->bits >>= 8;
+    lzw->bits_count -= 8;
+    if (lzw->block_size == sizeof(lzw->block)) {
+      flush_block(lzw);
+    }
+  }
+  /* Same point at which the decoder's table outgrows the code size */
+  if (lzw->next >= (1 << lzw->code_size) && lzw->code_size < 12) {
+    lzw->code_size++;
+  }
+}
+
+static void write_lzw(Lzw *lzw, const uint8_t *indices, size_t size) {
+  fputc(LZW_MIN_CODE_SIZE, lzw->file);
+  lzw->block_size = 0;
+  lzw->bits = 0;
+  lzw->bits_count = 0;
+  reset_table(lzw);
+  put_code(lzw, LZW_CLEAR);
+
+  int prefix = indices[0];
+  for (size_t i = 1; i < size; ++i) {
+    int c = indices[i];
+    int32_t key = (prefix << 8) | c;
+    uint32_t hash = ((uint32_t)key * 2654435761u) >> (32 - LZW_HASH_BITS);
+    while (lzw->keys[hash] != -1 && lzw->keys[hash] != key) {
+      hash = (hash + 1) & (LZW_HASH_SIZE - 1);
+    }
+    if (lzw->keys[hash] == key) {
+      prefix = lzw->codes[hash];
+      continue;
+    }
+
+    put_code(lzw, prefix);
+    if (lzw->next < LZW_MAX_CODE) {
+      lzw->keys[hash] = key;
+      lzw->codes[hash] = lzw->next++;
+    } else {
+      put_code(lzw, LZW_CLEAR);
+      reset_table(lzw);
+    }
+    prefix = c;
+  }
+  put_code(lzw, prefix);
+  put_code(lzw, LZW_END);
+  if (lzw->bits_count) {
+    lzw->block[lzw->block_size++] = lzw->bits & 0xFF;
+  }
+  flush_block(lzw);
+  fputc(0, lzw->file);
+}
+
+/* Bounding box of the pixels that changed, 0 if none did */
+static int changed_area(Gif *gif, int *x, int *y, int *w, int *h) {
+  if (!gif->has_previous) {
+    *x = *y = 0;
+    *w = gif->width;
+    *h = gif->height;
+    return 1;
+  }
+  int left = gif->width, right = -1, top = gif->height, bottom = -1;
+  for (int j = 0; j < gif->height; ++j) {
+    const uint32_t *a = gif->pending + (size_t)j * gif->width;
+    const uint32_t *b = gif->previous + (size_t)j * gif->width;
+    int first = 0;
+    while (first < gif->width && !((a[first] ^ b[first]) & PIXEL_MASK)) {
+      first++;
+    }
+    if (first == gif->width) {
+      continue;
+    }
+    int last = gif->width - 1;
+    while (last > first && !((a[last] ^ b[last]) & PIXEL_MASK)) {
+      last--;
+    }
+    if (first < left) {
+      left = first;
+    }
+    if (last > right) {
+      right = last;
+    }
+    if (top == gif->height) {
+      top = j;
+    }
+    bottom = j;
+  }
+  if (right == -1) {
+    return 0;
+  }
+  *x = left;
+  *y = top;
+  *w = right - left + 1;
+  *h = bottom - top + 1;
+  return 1;
+}
+
+static int write_frame(Gif *gif, int delay) {
+  int x, y, w, h;
+  int changed = changed_area(gif, &x, &y, &w, &h);
+  if (!changed) {
+    /* Only the delay grows, a single transparent pixel carries it */
+    x = y = 0;
+    w = h = 1;
+  }
+
+  size_t offset = (size_t)y * gif->width + x;
+  const uint32_t *pixels = gif->pending + offset;
+  const uint32_t *previous =
+      gif->has_previous ? gif->previous + offset : NULL;
+
+  Quantizer *quantizer = gif->quantizer;
+  quantize_decay(quantizer);
+  quantize_histogram(quantizer, pixels, previous, gif->width, w, h);
+  int colors = quantize_palette(quantizer, GIF_TRANSPARENT);
+  quantize_map(quantizer, pixels, previous, gif->width, w, h, gif->indices,
+               GIF_TRANSPARENT);
+
+  /* Graphic control extension, frames are drawn over the previous ones */
+  fputc(0x21, gif->file);
+  fputc(0xF9, gif->file);
+  fputc(4, gif->file);
+  fputc((1 << 2) | (previous ? 1 : 0), gif->file);
+  put_short(gif->file, delay);
+  fputc(GIF_TRANSPARENT, gif->file);
+  fputc(0, gif->file);
+
+  /* Image descriptor with a full local color table */
+  fputc(0x2C, gif->file);
+  put_short(gif->file, x);
+  put_short(gif->file, y);
+  put_short(gif->file, w);
+  put_short(gif->file, h);
+  fputc(0x80 | 7, gif->file);
+  uint8_t table[256][3] = {0};
+  memcpy(table, quantizer->palette, colors * sizeof(table[0]));
+  fwrite(table, 1, sizeof(table), gif->file);
+
+  Lzw *lzw = malloc(sizeof(Lzw));
+  if (!lzw) {
+    return -1;
+  }
+  lzw->file = gif->file;
+  write_lzw(lzw, gif->indices, (size_t)w * h);
+  free(lzw);
+
+  uint32_t *swap = gif->previous;
+  gif->previous = gif->pending;
+  gif->pending = swap;
+  gif->has_previous = 1;
+  gif->has_pending = 0;
+  gif->last_delay = delay;
+  return ferror(gif->file) ? -1 : 0;
+}
+
+static void copy_frame(Gif *gif, const char *data, int stride) {
+  for (int y = 0; y < gif->height; ++y) {
+    memcpy(gif->pending + (size_t)y * gif->width, data + (size_t)y * stride,
+           gif->width * sizeof(uint32_t));
+  }
+  gif->has_pending = 1;
+}
+
+static int same_frame(Gif *gif, const char *data, int stride) {
+  for (int y = 0; y < gif->height; ++y) {
+    if (memcmp(gif->pending + (size_t)y * gif->width,
+               data + (size_t)y * stride, gif->width * sizeof(uint32_t))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int gif_open(Gif *gif, const char *file, int width, int height, int bgr) {
+  memset(gif, 0, sizeof(*gif));
+  gif->width = width;
+  gif->height = height;
+  gif->start = -1;
+  gif->last_delay = GIF_DEFAULT_DELAY;
+  if (width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF) {
+    return -1;
+  }
+
+  size_t pixels = (size_t)width * height;
+  gif->previous = malloc(pixels * sizeof(uint32_t));
+  gif->pending = malloc(pixels * sizeof(uint32_t));
+  gif->indices = malloc(pixels);
+  gif->quantizer = malloc(sizeof(Quantizer));
+  gif->file = fopen(file, "wb");
+  if (!gif->previous || !gif->pending || !gif->indices || !gif->quantizer ||
+      !gif->file) {
+    gif_close(gif);
+    return -1;
+  }
+  quantize_init(gif->quantizer, bgr ? 2 : 0, bgr ? 0 : 2);
+
+  /* Header and logical screen without a global color table */
+  fwrite("GIF89a", 1, 6, gif->file);
+  put_short(gif->file, width);
+  put_short(gif->file, height);
+  fputc(0x70, gif->file);
+  fputc(0, gif->file);
+  fputc(0, gif->file);
+
+  /* Loop forever */
+  fputc(0x21, gif->file);
+  fputc(0xFF, gif->file);
+  fputc(11, gif->file);
+  fwrite("NETSCAPE2.0", 1, 11, gif->file);
+  fputc(3, gif->file);
+  fputc(1, gif->file);
+  put_short(gif->file, 0);
+  fputc(0, gif->file);
+  return ferror(gif->file) ? -1 : 0;
+}
+
+int gif_write(Gif *gif, const char *data, int stride, long long timestamp) {
+  if (gif->start == -1) {
+    gif->start = timestamp;
+  }
+  if (!gif->has_pending) {
+    copy_frame(gif, data, stride);
+    return 0;
+  }
+  if (same_frame(gif, data, stride)) {
+    return 0;
+  }
+
+  long long shown = (timestamp - gif->start + 5000000) / 10000000;
+  if (shown - gif->written < GIF_MIN_DELAY) {
+    /* Faster than a gif can play, the newest frame takes its place */
+    copy_frame(gif, data, stride);
+    return 0;
+  }
+  if (write_frame(gif, shown - gif->written)) {
+    return -1;
+  }
+  gif->written = shown;
+  copy_frame(gif, data, stride);
+  return 0;
+}
+
+int gif_close(Gif *gif) {
+  int ret = 0;
+  if (gif->file) {
+    if (gif->has_pending && write_frame(gif, gif->last_delay)) {
+      ret = -1;
+    }
+    fputc(0x3B, gif->file);
+    if (fclose(gif->file)) {
+      ret = -1;
+    }
+    gif->file = NULL;
+  }
+  free(gif->previous);
+  free(gif->pending);
+  free(gif->indices);
+  free(gif->quantizer);
+  gif->previous = gif->pending = NULL;
+  gif->indices = NULL;
+  gif->quantizer = NULL;
+  return ret;
+}
@@ -0,0 +1,58 @@
+/**
+    gif.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_GIF_H
+#define EVID_GIF_H
+
+#include "quantize.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Browsers play anything shorter than 2 centiseconds at 10 */
+#define GIF_MIN_DELAY 2
+#define GIF_DEFAULT_DELAY 10
+/* The last index marks the pixels left over from the previous frame */
+#define GIF_TRANSPARENT 255
+
+/* Streaming gif writer: every frame gets its own palette, built from the
+ * colors of the recording so far, and only the area that changed since the
+ * previous frame is written. Frames are held back until the next one arrives
+ * to know how long they're shown. */
+typedef struct Gif Gif;
+struct Gif {
+  FILE *file;
+  int width;
+  int height;
+  uint32_t *previous; /* last written frame */
+  uint32_t *pending;  /* frame waiting for its delay */
+  int has_previous;
+  int has_pending;
+  long long start;   /* timestamp of the first frame in nanoseconds */
+  long long written; /* centiseconds written so far */
+  int last_delay;
+  uint8_t *indices;
+  Quantizer *quantizer;
+};
+
+/* bgr tells whether the pixels are bgr0 instead of rgb0 */
+int gif_open(Gif *gif, const char *file, int width, int height, int bgr);
+int gif_write(Gif *gif, const char *data, int stride, long long timestamp);
+int gif_close(Gif *gif);
+
+#endif
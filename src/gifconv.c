@@ -0,0 +1,316 @@
+/**
+    gifconv.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "gifconv.h"
+#include "file.h"
+#include "util.h"
+
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+static pid_t spawn_ffmpeg(Args *args, char **fargs) {
+  pid_t pid = fork();
+  if (!pid) {
+    set_verbose(fargs, args->verbosity);
+    execvp(fargs[0], fargs);
+    _exit(127);
+  }
+  return pid;
+}
+
+static int wait_ffmpeg(pid_t pid) {
+  int status = 0;
+  if (pid == -1 || waitpid(pid, &status, 0) == -1 || status) {
+    return -1;
+  }
+  return 0;
+}
+
+static double probe_duration(const char *source) {
+  int fds[2];
+  if (pipe(fds)) {
+    return 0;
+  }
+  pid_t pid = fork();
+  if (!pid) {
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    execlp("ffprobe", "ffprobe", "-v", "error", "-show_entries",
+           "format=duration", "-of", "default=noprint_wrappers=1:nokey=1",
+           source, (char *)NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  char buffer[64] = {0};
+  size_t length = 0;
+  ssize_t n;
+  while (length < sizeof(buffer) - 1 &&
+         (n = read(fds[0], buffer + length, sizeof(buffer) - 1 - length)) >
+             0) {
+    length += n;
+  }
+  close(fds[0]);
+  if (wait_ffmpeg(pid)) {
+    return 0;
+  }
+  /* N/A when the container doesn't know, matroska written to a pipe */
+  double duration = strtod(buffer, NULL);
+  return duration > 0 ? duration : 0;
+}
+
+static int convert_whole(Args *args, const char *source, const char *dest) {
+  char *fargs[] = {"ffmpeg",
+                   "-y",
+                   "-i",
+                   (char *)source,
+                   "-vf",
+                   "split[s0][s1];[s0]palettegen[p];[s1][p]paletteuse",
+                   (char *)dest,
+                   NULL,
+                   NULL,
+                   NULL};
+  return wait_ffmpeg(spawn_ffmpeg(args, fargs));
+}
+
+/* Reads the signature, logical screen descriptor and global color table */
+static int read_header(FILE *in, uint8_t header[13], uint8_t *table,
+                       size_t *table_size) {
+  if (fread(header, 1, 13, in) != 13 || memcmp(header, "GIF8", 4)) {
+    return -1;
+  }
+  *table_size = header[10] & 0x80 ? 3 << ((header[10] & 7) + 1) : 0;
+  return fread(table, 1, *table_size, in) == *table_size ? 0 : -1;
+}
+
+/* Data sub-blocks up to the empty one, dropped when out is NULL */
+static int copy_sub_blocks(FILE *in, FILE *out) {
+  uint8_t block[255];
+  int size;
+  while ((size = fgetc(in)) > 0) {
+    if (fread(block, 1, size, in) != (size_t)size) {
+      return -1;
+    }
+    if (out && (fputc(size, out) == EOF ||
+                fwrite(block, 1, size, out) != (size_t)size)) {
+      return -1;
+    }
+  }
+  if (size == EOF || (out && fputc(0, out) == EOF)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Copies every block up to the trailer, the application extensions
+ * (looping) of all but the first chunk are left out */
+static int copy_blocks(FILE *in, FILE *out, int first) {
+  for (;;) {
+    int c = fgetc(in);
+    switch (c) {
+    case 0x21: {
+      int label = fgetc(in);
+      if (label == EOF) {
+        return -1;
+      }
+      if (label == 0xff && !first) {
+        if (copy_sub_blocks(in, NULL)) {
+          return -1;
+        }
+        break;
+      }
+      if (fputc(c, out) == EOF || fputc(label, out) == EOF ||
+          copy_sub_blocks(in, out)) {
+        return -1;
+      }
+      break;
+    }
+    case 0x2c: {
+      /* Image descriptor, local color table and LZW minimum code size */
+      uint8_t image[9 + 768 + 1];
+      if (fread(image, 1, 9, in) != 9) {
+        return -1;
+      }
+      size_t size = 9;
+      if (image[8] & 0x80) {
+        size += 3 << ((image[8] & 7) + 1);
+      }
+      size += 1;
+      if (fread(image + 9, 1, size - 9, in) != size - 9 ||
+          fputc(c, out) == EOF || fwrite(image, 1, size, out) != size ||
+          copy_sub_blocks(in, out)) {
+        return -1;
+      }
+      break;
+    }
+    case 0x3b: {
+      return 0;
+    }
+    default: {
+      return -1;
+    }
+    }
+  }
+}
+
+/* Chunks share their palette as their global color table, their frames
+ * can follow each other under the first one's */
+static int join_chunks(char chunks[][PATH_MAX], int count, const char *dest) {
+  FILE *out = fopen(dest, "wb");
+  if (!out) {
+    return -1;
+  }
+  uint8_t header[13];
+  uint8_t table[768];
+  size_t table_size = 0;
+  int ret = 0;
+  for (int i = 0; i < count && !ret; ++i) {
+    FILE *in = fopen(chunks[i], "rb");
+    if (!in) {
+      ret = -1;
+      break;
+    }
+    uint8_t chunk_header[13];
+    uint8_t chunk_table[768];
+    size_t chunk_table_size;
+    if (read_header(in, chunk_header, chunk_table, &chunk_table_size)) {
+      ret = -1;
+    } else if (!i) {
+      memcpy(header, chunk_header, sizeof(header));
+      memcpy(table, chunk_table, chunk_table_size);
+      table_size = chunk_table_size;
+      if (fwrite(header, 1, sizeof(header), out) != sizeof(header) ||
+          fwrite(table, 1, table_size, out) != table_size) {
+        ret = -1;
+      }
+    } else if (chunk_table_size != table_size ||
+               memcmp(chunk_table, table, table_size) ||
+               memcmp(chunk_header + 6, header + 6, 4)) {
+      /* A different palette or size, the frames can't be mixed */
+      ret = -1;
+    }
+    if (!ret) {
+      ret = copy_blocks(in, out, !i);
+    }
+    fclose(in);
+  }
+  if (!ret && fputc(0x3b, out) == EOF) {
+    ret = -1;
+  }
+  if (fclose(out)) {
+    ret = -1;
+  }
+  return ret;
+}
+
+static int convert_chunks(Args *args, const char *source, const char *dest,
+                          double duration, int count, const char *dir) {
+  char palette[PATH_MAX];
+  snprintf(palette, sizeof(palette), "%s/palette.png", dir);
+  double rate = GIFCONV_PALETTE_FRAMES / duration;
+  char sample[64];
+  snprintf(sample, sizeof(sample), "fps=%.3f,palettegen", rate);
+  char *palette_args[] = {"ffmpeg", "-y",    "-i", (char *)source, "-vf",
+                          sample,   palette, NULL, NULL,           NULL};
+  if (wait_ffmpeg(spawn_ffmpeg(args, palette_args))) {
+    return -1;
+  }
+
+  char chunks[GIFCONV_MAX_CHUNKS][PATH_MAX];
+  pid_t pids[GIFCONV_MAX_CHUNKS];
+  double length = duration / count;
+  for (int i = 0; i < count; ++i) {
+    snprintf(chunks[i], sizeof(chunks[i]), "%s/%03d.gif", dir, i);
+    char start[32];
+    char time[32];
+    snprintf(start, sizeof(start), "%.6f", i * length);
+    snprintf(time, sizeof(time), "%.6f", length);
+    int fargsc = 0;
+    char *fargs[20];
+    fargs[fargsc++] = "ffmpeg";
+    fargs[fargsc++] = "-y";
+    fargs[fargsc++] = "-ss";
+    fargs[fargsc++] = start;
+    /* The last one goes on to the end, whatever the probe missed */
+    if (i < count - 1) {
+      fargs[fargsc++] = "-t";
+      fargs[fargsc++] = time;
+    }
+    fargs[fargsc++] = "-i";
+    fargs[fargsc++] = (char *)source;
+    fargs[fargsc++] = "-i";
+    fargs[fargsc++] = palette;
+    fargs[fargsc++] = "-lavfi";
+    fargs[fargsc++] = "[0:v][1:v]paletteuse";
+    fargs[fargsc++] = "-f";
+    fargs[fargsc++] = "gif";
+    fargs[fargsc++] = chunks[i];
+    fargs[fargsc] = NULL;
+    pids[i] = spawn_ffmpeg(args, fargs);
+  }
+  int ret = 0;
+  for (int i = 0; i < count; ++i) {
+    if (wait_ffmpeg(pids[i])) {
+      ret = -1;
+    }
+  }
+  if (!ret) {
+    ret = join_chunks(chunks, count, dest);
+  }
+  for (int i = 0; i < count; ++i) {
+    unlink(chunks[i]);
+  }
+  unlink(palette);
+  return ret;
+}
+
+int gifconv_run(Args *args, const char *source, const char *dest,
+                double duration) {
+  if (duration <= 0) {
+    duration = probe_duration(source);
+  }
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int count = duration / GIFCONV_MIN_CHUNK;
+  if (count > cores) {
+    count = cores;
+  }
+  if (count > GIFCONV_MAX_CHUNKS) {
+    count = GIFCONV_MAX_CHUNKS;
+  }
+  if (count < 2) {
+    return convert_whole(args, source, dest);
+  }
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/%s-gif-XXXXXX", get_tmp_dir(), PROGRAM_NAME);
+  if (!mkdtemp(dir)) {
+    return convert_whole(args, source, dest);
+  }
+  int ret = convert_chunks(args, source, dest, duration, count, dir);
+  rmdir(dir);
+  if (ret) {
+    error("failed to convert the gif in chunks, trying in one go\n");
+    ret = convert_whole(args, source, dest);
+  }
+  return ret;
+}
@@ -0,0 +1,38 @@
+/**
+    gifconv.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_GIFCONV_H
+#define EVID_GIFCONV_H
+
+#include "types.h"
+
+#define GIFCONV_MIN_CHUNK 2.0 /* seconds, shorter aren't worth an ffmpeg */
+#define GIFCONV_MAX_CHUNKS 32
+/* The palette is built from about as many frames, spread over the clip */
+#define GIFCONV_PALETTE_FRAMES 250
+
+/* Converts the video at source into a gif at dest. ffmpeg builds a single
+ * palette from frames sampled across the whole clip, then as many ffmpegs
+ * as there are cores dither and encode a stretch of it each and their
+ * frames are joined behind the first one's header. Clips too short to be
+ * split, or whose chunks fail, go through one palettegen/paletteuse pass.
+ * duration is in seconds, probed with ffprobe when 0. */
+int gifconv_run(Args *args, const char *source, const char *dest,
+                double duration);
+
+#endif
@@ -0,0 +1,155 @@
+/**
+    jobs.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#define _GNU_SOURCE
+
+#include "jobs.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* From linux/ioprio.h, which not every system ships */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+typedef struct Job Job;
+struct Job {
+  JobRun run;
+  void *data;
+  Job *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static Job *head = NULL;
+static Job *tail = NULL;
+static pthread_t threads[JOBS_MAX_WORKERS];
+static int max_workers = JOBS_DEFAULT_WORKERS;
+static int workers = 0; /* started so far */
+static int idle = 0;    /* waiting for a job */
+static int pending = 0; /* queued or running */
+static int stopping = 0;
+
+/* Both are per thread on Linux and inherited by the processes it starts */
+static void lower_priority(void) {
+  pid_t tid = syscall(SYS_gettid);
+  struct sched_param param = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  setpriority(PRIO_PROCESS, tid, JOBS_NICE);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+static void *worker_loop(void *arg) {
+  lower_priority();
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!head && !stopping) {
+      idle++;
+      pthread_cond_wait(&queued, &lock);
+      idle--;
+    }
+    Job *job = head;
+    if (!job) {
+      break;
+    }
+    head = job->next;
+    if (!head) {
+      tail = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    job->run(job->data);
+    free(job);
+    pthread_mutex_lock(&lock);
+    if (!--pending) {
+      pthread_cond_broadcast(&done);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void jobs_init(int count) {
+  max_workers = count < 1                  ? 1
+                : count > JOBS_MAX_WORKERS ? JOBS_MAX_WORKERS
+                                           : count;
+}
+
+int jobs_submit(JobRun run, void *data) {
+  Job *job = malloc(sizeof(Job));
+  if (!job) {
+    die("failed to allocate memory\n");
+  }
+  job->run = run;
+  job->data = data;
+  job->next = NULL;
+
+  pthread_mutex_lock(&lock);
+  int ahead = pending;
+  if (tail) {
+    tail->next = job;
+  } else {
+    head = job;
+  }
+  tail = job;
+  pending++;
+  if (!idle && workers < max_workers) {
+    /* Signals are left to the main thread */
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    if (!pthread_create(&threads[workers], NULL, worker_loop, NULL)) {
+      workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (!workers) {
+      die("failed to start a background job\n");
+    }
+  }
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+  return ahead;
+}
+
+void jobs_wait(void) {
+  pthread_mutex_lock(&lock);
+  while (pending) {
+    pthread_cond_wait(&done, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void jobs_uninit(void) {
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_broadcast(&queued);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < workers; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  workers = 0;
+}
@@ -0,0 +1,41 @@
+/**
+    jobs.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_JOBS_H
+#define EVID_JOBS_H
+
+#define JOBS_DEFAULT_WORKERS 2
+#define JOBS_MAX_WORKERS 16
+#define JOBS_NICE 19
+
+typedef void (*JobRun)(void *data);
+
+/* What's left to do with a recording once it's over (converting, copying,
+ * notifying) is queued and run by a few worker threads at idle CPU and I/O
+ * priority, along with the processes they start, so the next recording can
+ * start right away. A burst of recordings waits its turn instead of running
+ * all at once. Workers are started as jobs come in, up to workers. */
+void jobs_init(int workers);
+/* data is handed to run on a worker and is run's to free. Returns how many
+ * jobs were still queued or running before it. */
+int jobs_submit(JobRun run, void *data);
+/* Waits for everything queued so far to be done */
+void jobs_wait(void);
+void jobs_uninit(void);
+
+#endif
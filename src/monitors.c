@@ -0,0 +1,118 @@
+/**
+    monitors.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "monitors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+
+static int get_root(Display *dpy, Window root, Monitor *monitor) {
+  Window wroot;
+  int x, y;
+  unsigned int w, h, border, depth;
+  if (!XGetGeometry(dpy, root, &wroot, &x, &y, &w, &h, &border, &depth)) {
+    return 0;
+  }
+  snprintf(monitor->name, sizeof(monitor->name), "root");
+  monitor->x = x;
+  monitor->y = y;
+  monitor->w = w;
+  monitor->h = h;
+  monitor->primary = 1;
+  return 1;
+}
+
+int monitors_get(Display *dpy, Window root, Monitor *monitors, int max) {
+  if (max < 1) {
+    return 0;
+  }
+#ifdef HAVE_XRANDR
+  int event_base, error_base, major, minor;
+  /* Monitors came with RandR 1.5 */
+  if (XRRQueryExtension(dpy, &event_base, &error_base) &&
+      XRRQueryVersion(dpy, &major, &minor) &&
+      (major > 1 || (major == 1 && minor >= 5))) {
+    int count = 0;
+    XRRMonitorInfo *info = XRRGetMonitors(dpy, root, True, &count);
+    if (info && count > 0) {
+      if (count > max) {
+        count = max;
+      }
+      for (int i = 0; i < count; ++i) {
+        Monitor *monitor = &monitors[i];
+        char *name = info[i].name ? XGetAtomName(dpy, info[i].name) : NULL;
+        snprintf(monitor->name, sizeof(monitor->name), "%s",
+                 name ? name : "");
+        if (name) {
+          XFree(name);
+        }
+        monitor->x = info[i].x;
+        monitor->y = info[i].y;
+        monitor->w = info[i].width;
+        monitor->h = info[i].height;
+        monitor->primary = info[i].primary;
+      }
+      XRRFreeMonitors(info);
+      return count;
+    }
+    if (info) {
+      XRRFreeMonitors(info);
+    }
+  }
+#endif
+  return get_root(dpy, root, monitors);
+}
+
+int monitors_at(Monitor *monitors, int count, int x, int y) {
+  int nearest = 0;
+  long long nearest_distance = -1;
+  for (int i = 0; i < count; ++i) {
+    Monitor *m = &monitors[i];
+    long long dx = x < m->x                ? m->x - x
+                   : x >= m->x + (int)m->w ? x - (m->x + (int)m->w - 1)
+                                           : 0;
+    long long dy = y < m->y                ? m->y - y
+                   : y >= m->y + (int)m->h ? y - (m->y + (int)m->h - 1)
+                                           : 0;
+    long long distance = dx * dx + dy * dy;
+    if (nearest_distance == -1 || distance < nearest_distance) {
+      nearest = i;
+      nearest_distance = distance;
+    }
+  }
+  return nearest;
+}
+
+int monitors_find(Monitor *monitors, int count, const char *name) {
+  for (int i = 0; i < count; ++i) {
+    if (!strcmp(monitors[i].name, name)) {
+      return i;
+    }
+  }
+  char *end;
+  long index = strtol(name, &end, 10);
+  if (*name && !*end && index >= 0 && index < count) {
+    return index;
+  }
+  return -1;
+}
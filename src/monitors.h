@@ -0,0 +1,44 @@
+/**
+    monitors.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_MONITORS_H
+#define EVID_MONITORS_H
+
+#include <X11/Xlib.h>
+
+#define MONITORS_MAX 16
+
+typedef struct Monitor Monitor;
+struct Monitor {
+  char name[32];
+  int x; /* offset from left of the root window */
+  int y; /* offset from top of the root window */
+  unsigned int w;
+  unsigned int h;
+  int primary;
+};
+
+/* Active monitors as XRandR sees them, the whole root as a single monitor
+ * without it. Returns how many were found. */
+int monitors_get(Display *dpy, Window root, Monitor *monitors, int max);
+/* The monitor containing the point, the closest one when it's in a gap */
+int monitors_at(Monitor *monitors, int count, int x, int y);
+/* Looks a monitor up by name (e.g. DP-1) or index, -1 if nothing matches */
+int monitors_find(Monitor *monitors, int count, const char *name);
+
+#endif
@@ -0,0 +1,76 @@
+/**
+    notifier.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "notifier.h"
+#include "evid.h"
+#include "trace.h"
+
+#ifdef HAVE_NOTIFY
+#include <libnotify/notify.h>
+
+#include <pthread.h>
+#include <signal.h>
+
+static pthread_t thread;
+static int started = 0;
+static int initialized = 0;
+static pthread_once_t joined = PTHREAD_ONCE_INIT;
+
+static void *init_loop(void *arg) {
+  initialized = notify_init(PROGRAM_NAME);
+  trace("notifications ready");
+  return NULL;
+}
+
+static void join(void) {
+  if (started) {
+    pthread_join(thread, NULL);
+  } else {
+    initialized = notify_init(PROGRAM_NAME);
+  }
+}
+
+void notifier_init(void) {
+  /* Signals are left to the main thread */
+  sigset_t mask, old_mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  started = !pthread_create(&thread, NULL, init_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+int notifier_wait(void) {
+  pthread_once(&joined, join);
+  return initialized;
+}
+
+void notifier_uninit(void) {
+  if (notifier_wait()) {
+    notify_uninit();
+  }
+}
+
+#else
+
+void notifier_init(void) {}
+
+int notifier_wait(void) { return 0; }
+
+void notifier_uninit(void) {}
+
+#endif
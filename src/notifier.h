@@ -0,0 +1,30 @@
+/**
+    notifier.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_NOTIFIER_H
+#define EVID_NOTIFIER_H
+
+/* libnotify is set up on a helper thread so that connecting to the session
+ * bus doesn't hold the selection overlay back. It has to be waited for
+ * before the first notification. */
+void notifier_init(void);
+/* Returns whether notifications can be shown */
+int notifier_wait(void);
+void notifier_uninit(void);
+
+#endif
@@ -0,0 +1,498 @@
+/**
+    quantize.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "quantize.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANTIZE_X86
+#include <immintrin.h>
+#endif
+
+#define PIXEL_MASK 0x00FFFFFF
+#define CHANNEL(pixel, offset) (((pixel) >> ((offset) * 8)) & 0xFF)
+#define BIN(r, g, b)                                                           \
+  ((((r) >> (8 - QUANTIZE_BITS)) << (2 * QUANTIZE_BITS)) |                     \
+   (((g) >> (8 - QUANTIZE_BITS)) << QUANTIZE_BITS) |                           \
+   ((b) >> (8 - QUANTIZE_BITS)))
+
+/* 4x4 Bayer matrix centered around 0, spreads a color over neighbouring
+ * bins */
+static const int8_t dither[4][4] = {{-8, 0, -6, 2},
+                                    {4, -4, 6, -2},
+                                    {-5, 3, -7, 1},
+                                    {7, -1, 5, -3}};
+
+/* Far enough from every color to never be picked */
+#define PALETTE_PADDING 4096
+
+typedef struct Box Box;
+struct Box {
+  int start;
+  int end;
+  uint64_t count;
+  int axis;  /* channel with the widest range */
+  int range;
+};
+
+static int compare_r(const void *a, const void *b) {
+  const QuantizeEntry *x = a, *y = b;
+  return x->color[0] - y->color[0];
+}
+
+static int compare_g(const void *a, const void *b) {
+  const QuantizeEntry *x = a, *y = b;
+  return x->color[1] - y->color[1];
+}
+
+static int compare_b(const void *a, const void *b) {
+  const QuantizeEntry *x = a, *y = b;
+  return x->color[2] - y->color[2];
+}
+
+static void shrink_box(Box *box, QuantizeEntry *entries) {
+  int min[3] = {255, 255, 255};
+  int max[3] = {0, 0, 0};
+  box->count = 0;
+  for (int i = box->start; i < box->end; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      if (entries[i].color[c] < min[c]) {
+        min[c] = entries[i].color[c];
+      }
+      if (entries[i].color[c] > max[c]) {
+        max[c] = entries[i].color[c];
+      }
+    }
+    box->count += entries[i].count;
+  }
+  box->axis = 0;
+  for (int c = 1; c < 3; ++c) {
+    if (max[c] - min[c] > max[box->axis] - min[box->axis]) {
+      box->axis = c;
+    }
+  }
+  box->range = max[box->axis] - min[box->axis];
+}
+
+static int clamp(int value) {
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/* Bin of every pixel in a row after adding the dither offsets, which repeat
+ * every 4 pixels */
+static void row_bins_scalar(const uint32_t *row, const uint32_t *previous,
+                            int width, int red, int blue,
+                            const int8_t *dither, uint16_t *bins) {
+  for (int x = 0; x < width; ++x) {
+    uint32_t pixel = row[x];
+    if (previous && !((pixel ^ previous[x]) & PIXEL_MASK)) {
+      bins[x] = QUANTIZE_UNCHANGED;
+      continue;
+    }
+    int offset = dither ? dither[x & 3] : 0;
+    bins[x] = BIN(clamp(CHANNEL(pixel, red) + offset),
+                  clamp(CHANNEL(pixel, 1) + offset),
+                  clamp(CHANNEL(pixel, blue) + offset));
+  }
+}
+
+static int nearest_scalar(const Quantizer *quantizer, int r, int g, int b) {
+  int best = 0;
+  int best_distance = 3 * 256 * 256;
+  for (int i = 0; i < quantizer->colors; ++i) {
+    int dr = quantizer->palette[i][0] - r;
+    int dg = quantizer->palette[i][1] - g;
+    int db = quantizer->palette[i][2] - b;
+    int distance = dr * dr + dg * dg + db * db;
+    if (distance < best_distance) {
+      best_distance = distance;
+      best = i;
+    }
+  }
+  return best;
+}
+
+#ifdef QUANTIZE_X86
+/* Saturating byte offsets for 4 pixels, padding bytes are left alone */
+static void dither_bytes(const int8_t *dither, uint8_t *add, uint8_t *sub) {
+  memset(add, 0, 16);
+  memset(sub, 0, 16);
+  for (int i = 0; dither && i < 4; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      add[i * 4 + c] = dither[i] > 0 ? dither[i] : 0;
+      sub[i * 4 + c] = dither[i] < 0 ? -dither[i] : 0;
+    }
+  }
+}
+
+__attribute__((target("sse4.1"))) static void
+row_bins_sse41(const uint32_t *row, const uint32_t *previous, int width,
+               int red, int blue, const int8_t *dither, uint16_t *bins) {
+  uint8_t add_bytes[16], sub_bytes[16];
+  dither_bytes(dither, add_bytes, sub_bytes);
+  const __m128i add = _mm_loadu_si128((const __m128i *)add_bytes);
+  const __m128i sub = _mm_loadu_si128((const __m128i *)sub_bytes);
+  const __m128i mask = _mm_set1_epi32(PIXEL_MASK);
+  const __m128i channel = _mm_set1_epi32((1 << QUANTIZE_BITS) - 1);
+  const __m128i unchanged = _mm_set1_epi32(QUANTIZE_UNCHANGED);
+  const __m128i red_shift = _mm_cvtsi32_si128(red * 8 + 8 - QUANTIZE_BITS);
+  const __m128i blue_shift = _mm_cvtsi32_si128(blue * 8 + 8 - QUANTIZE_BITS);
+
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i d = _mm_subs_epu8(_mm_adds_epu8(pixels, add), sub);
+    __m128i r = _mm_and_si128(_mm_srl_epi32(d, red_shift), channel);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(d, 16 - QUANTIZE_BITS), channel);
+    __m128i b = _mm_and_si128(_mm_srl_epi32(d, blue_shift), channel);
+    __m128i bin = _mm_or_si128(
+        _mm_or_si128(_mm_slli_epi32(r, 2 * QUANTIZE_BITS),
+                     _mm_slli_epi32(g, QUANTIZE_BITS)),
+        b);
+    if (previous) {
+      __m128i old = _mm_loadu_si128((const __m128i *)(previous + x));
+      __m128i same = _mm_cmpeq_epi32(
+          _mm_and_si128(_mm_xor_si128(pixels, old), mask),
+          _mm_setzero_si128());
+      bin = _mm_or_si128(bin, _mm_and_si128(same, unchanged));
+    }
+    _mm_storel_epi64((__m128i *)(bins + x), _mm_packus_epi32(bin, bin));
+  }
+  /* x is a multiple of 4, the dither pattern lines up */
+  row_bins_scalar(row + x, previous ? previous + x : NULL, width - x, red,
+                  blue, dither, bins + x);
+}
+
+__attribute__((target("avx2"))) static void
+row_bins_avx2(const uint32_t *row, const uint32_t *previous, int width,
+              int red, int blue, const int8_t *dither, uint16_t *bins) {
+  uint8_t add_bytes[16], sub_bytes[16];
+  dither_bytes(dither, add_bytes, sub_bytes);
+  const __m256i add = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)add_bytes));
+  const __m256i sub = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)sub_bytes));
+  const __m256i mask = _mm256_set1_epi32(PIXEL_MASK);
+  const __m256i channel = _mm256_set1_epi32((1 << QUANTIZE_BITS) - 1);
+  const __m256i unchanged = _mm256_set1_epi32(QUANTIZE_UNCHANGED);
+  const __m128i red_shift = _mm_cvtsi32_si128(red * 8 + 8 - QUANTIZE_BITS);
+  const __m128i blue_shift = _mm_cvtsi32_si128(blue * 8 + 8 - QUANTIZE_BITS);
+
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *)(row + x));
+    __m256i d = _mm256_subs_epu8(_mm256_adds_epu8(pixels, add), sub);
+    __m256i r = _mm256_and_si256(_mm256_srl_epi32(d, red_shift), channel);
+    __m256i g =
+        _mm256_and_si256(_mm256_srli_epi32(d, 16 - QUANTIZE_BITS), channel);
+    __m256i b = _mm256_and_si256(_mm256_srl_epi32(d, blue_shift), channel);
+    __m256i bin = _mm256_or_si256(
+        _mm256_or_si256(_mm256_slli_epi32(r, 2 * QUANTIZE_BITS),
+                        _mm256_slli_epi32(g, QUANTIZE_BITS)),
+        b);
+    if (previous) {
+      __m256i old = _mm256_loadu_si256((const __m256i *)(previous + x));
+      __m256i same = _mm256_cmpeq_epi32(
+          _mm256_and_si256(_mm256_xor_si256(pixels, old), mask),
+          _mm256_setzero_si256());
+      bin = _mm256_or_si256(bin, _mm256_and_si256(same, unchanged));
+    }
+    /* The pack works per 128 bit lane, gather both halves back together */
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(bin, bin),
+                                              0x08);
+    _mm_storeu_si128((__m128i *)(bins + x), _mm256_castsi256_si128(packed));
+  }
+  row_bins_sse41(row + x, previous ? previous + x : NULL, width - x, red,
+                 blue, dither, bins + x);
+}
+
+/* Lowest distance, the lowest index on ties like the scalar search */
+static int reduce_nearest(const int32_t *distances, const int32_t *indices,
+                          int count) {
+  int best = 0;
+  for (int i = 1; i < count; ++i) {
+    if (distances[i] < distances[best] ||
+        (distances[i] == distances[best] && indices[i] < indices[best])) {
+      best = i;
+    }
+  }
+  return indices[best];
+}
+
+__attribute__((target("sse4.1"))) static int
+nearest_sse41(const Quantizer *quantizer, int r, int g, int b) {
+  const __m128i vr = _mm_set1_epi32(r);
+  const __m128i vg = _mm_set1_epi32(g);
+  const __m128i vb = _mm_set1_epi32(b);
+  const __m128i step = _mm_set1_epi32(4);
+  __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+  __m128i best = _mm_set1_epi32(INT32_MAX);
+  __m128i best_index = _mm_setzero_si128();
+  for (int i = 0; i < quantizer->colors; i += 4) {
+    __m128i dr = _mm_sub_epi32(
+        _mm_loadu_si128((const __m128i *)(quantizer->palette_r + i)), vr);
+    __m128i dg = _mm_sub_epi32(
+        _mm_loadu_si128((const __m128i *)(quantizer->palette_g + i)), vg);
+    __m128i db = _mm_sub_epi32(
+        _mm_loadu_si128((const __m128i *)(quantizer->palette_b + i)), vb);
+    __m128i distance = _mm_add_epi32(
+        _mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)),
+        _mm_mullo_epi32(db, db));
+    __m128i closer = _mm_cmplt_epi32(distance, best);
+    best = _mm_min_epi32(distance, best);
+    best_index = _mm_blendv_epi8(best_index, index, closer);
+    index = _mm_add_epi32(index, step);
+  }
+  int32_t distances[4], indices[4];
+  _mm_storeu_si128((__m128i *)distances, best);
+  _mm_storeu_si128((__m128i *)indices, best_index);
+  return reduce_nearest(distances, indices, 4);
+}
+
+__attribute__((target("avx2"))) static int
+nearest_avx2(const Quantizer *quantizer, int r, int g, int b) {
+  const __m256i vr = _mm256_set1_epi32(r);
+  const __m256i vg = _mm256_set1_epi32(g);
+  const __m256i vb = _mm256_set1_epi32(b);
+  const __m256i step = _mm256_set1_epi32(8);
+  __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i best = _mm256_set1_epi32(INT32_MAX);
+  __m256i best_index = _mm256_setzero_si256();
+  for (int i = 0; i < quantizer->colors; i += 8) {
+    __m256i dr = _mm256_sub_epi32(
+        _mm256_loadu_si256((const __m256i *)(quantizer->palette_r + i)), vr);
+    __m256i dg = _mm256_sub_epi32(
+        _mm256_loadu_si256((const __m256i *)(quantizer->palette_g + i)), vg);
+    __m256i db = _mm256_sub_epi32(
+        _mm256_loadu_si256((const __m256i *)(quantizer->palette_b + i)), vb);
+    __m256i distance = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_mullo_epi32(dr, dr),
+                         _mm256_mullo_epi32(dg, dg)),
+        _mm256_mullo_epi32(db, db));
+    __m256i closer = _mm256_cmpgt_epi32(best, distance);
+    best = _mm256_min_epi32(distance, best);
+    best_index = _mm256_blendv_epi8(best_index, index, closer);
+    index = _mm256_add_epi32(index, step);
+  }
+  int32_t distances[8], indices[8];
+  _mm256_storeu_si256((__m256i *)distances, best);
+  _mm256_storeu_si256((__m256i *)indices, best_index);
+  return reduce_nearest(distances, indices, 8);
+}
+#endif
+
+static void set_planar_palette(Quantizer *quantizer) {
+  for (int i = 0; i < 256; ++i) {
+    int padding = i >= quantizer->colors;
+    quantizer->palette_r[i] = padding ? PALETTE_PADDING
+                                      : quantizer->palette[i][0];
+    quantizer->palette_g[i] = padding ? PALETTE_PADDING
+                                      : quantizer->palette[i][1];
+    quantizer->palette_b[i] = padding ? PALETTE_PADDING
+                                      : quantizer->palette[i][2];
+  }
+}
+
+void quantize_init(Quantizer *quantizer, int red, int blue) {
+  memset(quantizer->bins, 0, sizeof(quantizer->bins));
+  memset(quantizer->lookup, -1, sizeof(quantizer->lookup));
+  quantizer->red = red;
+  quantizer->blue = blue;
+  quantizer->colors = 0;
+
+  quantizer->row_bins = row_bins_scalar;
+  quantizer->nearest = nearest_scalar;
+#ifdef QUANTIZE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    quantizer->row_bins = row_bins_avx2;
+    quantizer->nearest = nearest_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    quantizer->row_bins = row_bins_sse41;
+    quantizer->nearest = nearest_sse41;
+  }
+#endif
+}
+
+void quantize_decay(Quantizer *quantizer) {
+  for (int i = 0; i < QUANTIZE_BINS; ++i) {
+    QuantizeBin *bin = &quantizer->bins[i];
+    bin->count >>= 1;
+    if (bin->count) {
+      bin->r >>= 1;
+      bin->g >>= 1;
+      bin->b >>= 1;
+    } else {
+      bin->r = bin->g = bin->b = 0;
+    }
+  }
+}
+
+void quantize_histogram(Quantizer *quantizer, const uint32_t *pixels,
+                        const uint32_t *previous, int stride, int width,
+                        int height) {
+  /* Large areas only count every few rows */
+  int step = 1;
+  while ((long long)width * ((height + step - 1) / step) >
+         QUANTIZE_MAX_SAMPLES) {
+    step++;
+  }
+
+  const int red = quantizer->red;
+  const int blue = quantizer->blue;
+  uint16_t *bins = quantizer->bins_row;
+  for (int y = 0; y < height; y += step) {
+    const uint32_t *row = pixels + (size_t)y * stride;
+    const uint32_t *previous_row = previous ? previous + (size_t)y * stride
+                                            : NULL;
+    quantizer->row_bins(row, previous_row, width, red, blue, NULL, bins);
+    for (int x = 0; x < width; ++x) {
+      if (bins[x] == QUANTIZE_UNCHANGED) {
+        continue;
+      }
+      QuantizeBin *bin = &quantizer->bins[bins[x]];
+      bin->count++;
+      bin->r += CHANNEL(row[x], red);
+      bin->g += CHANNEL(row[x], 1);
+      bin->b += CHANNEL(row[x], blue);
+    }
+  }
+}
+
+int quantize_palette(Quantizer *quantizer, int max_colors) {
+  QuantizeEntry *entries = quantizer->entries;
+  int count = 0;
+  for (int i = 0; i < QUANTIZE_BINS; ++i) {
+    QuantizeBin *bin = &quantizer->bins[i];
+    if (bin->count) {
+      entries[count].color[0] = bin->r / bin->count;
+      entries[count].color[1] = bin->g / bin->count;
+      entries[count].color[2] = bin->b / bin->count;
+      entries[count].count = bin->count;
+      entries[count].bin = i;
+      count++;
+    }
+  }
+
+  memset(quantizer->lookup, -1, sizeof(quantizer->lookup));
+  if (!count) {
+    memset(quantizer->palette[0], 0, sizeof(quantizer->palette[0]));
+    quantizer->colors = 1;
+    set_planar_palette(quantizer);
+    return quantizer->colors;
+  }
+
+  Box boxes[256];
+  int boxes_count = 1;
+  boxes[0].start = 0;
+  boxes[0].end = count;
+  shrink_box(&boxes[0], entries);
+
+  while (boxes_count < max_colors) {
+    /* Split the box covering the most pixels over the widest range */
+    int split = -1;
+    uint64_t best = 0;
+    for (int i = 0; i < boxes_count; ++i) {
+      uint64_t score = boxes[i].count * boxes[i].range;
+      if (boxes[i].end - boxes[i].start > 1 && score > best) {
+        best = score;
+        split = i;
+      }
+    }
+    if (split == -1) {
+      break;
+    }
+
+    Box *box = &boxes[split];
+    int (*compare[])(const void *, const void *) = {compare_r, compare_g,
+                                                    compare_b};
+    qsort(entries + box->start, box->end - box->start,
+          sizeof(QuantizeEntry), compare[box->axis]);
+
+    uint64_t half = box->count / 2;
+    uint64_t sum = 0;
+    int middle = box->start;
+    while (middle < box->end - 1 && sum + entries[middle].count <= half) {
+      sum += entries[middle++].count;
+    }
+    if (middle == box->start) {
+      middle++;
+    }
+
+    Box *new_box = &boxes[boxes_count++];
+    new_box->start = middle;
+    new_box->end = box->end;
+    box->end = middle;
+    shrink_box(box, entries);
+    shrink_box(new_box, entries);
+  }
+
+  for (int i = 0; i < boxes_count; ++i) {
+    uint64_t r = 0, g = 0, b = 0, n = 0;
+    for (int j = boxes[i].start; j < boxes[i].end; ++j) {
+      QuantizeBin *bin = &quantizer->bins[entries[j].bin];
+      r += bin->r;
+      g += bin->g;
+      b += bin->b;
+      n += bin->count;
+    }
+    quantizer->palette[i][0] = r / n;
+    quantizer->palette[i][1] = g / n;
+    quantizer->palette[i][2] = b / n;
+  }
+  quantizer->colors = boxes_count;
+  set_planar_palette(quantizer);
+  return quantizer->colors;
+}
+
+void quantize_map(Quantizer *quantizer, const uint32_t *pixels,
+                  const uint32_t *previous, int stride, int width, int height,
+                  uint8_t *indices, uint8_t transparent) {
+  const int center = 1 << (7 - QUANTIZE_BITS);
+  const int channel = (1 << QUANTIZE_BITS) - 1;
+  uint16_t *bins = quantizer->bins_row;
+  for (int y = 0; y < height; ++y) {
+    const uint32_t *row = pixels + (size_t)y * stride;
+    const uint32_t *previous_row = previous ? previous + (size_t)y * stride
+                                            : NULL;
+    quantizer->row_bins(row, previous_row, width, quantizer->red,
+                        quantizer->blue, dither[y & 3], bins);
+    uint8_t *out = indices + (size_t)y * width;
+    for (int x = 0; x < width; ++x) {
+      int bin = bins[x];
+      if (bin == QUANTIZE_UNCHANGED) {
+        out[x] = transparent;
+        continue;
+      }
+      int16_t index = quantizer->lookup[bin];
+      if (index < 0) {
+        /* Bins are matched by their center */
+        index = quantizer->nearest(
+            quantizer,
+            ((bin >> (2 * QUANTIZE_BITS)) << (8 - QUANTIZE_BITS)) | center,
+            (((bin >> QUANTIZE_BITS) & channel) << (8 - QUANTIZE_BITS)) |
+                center,
+            ((bin & channel) << (8 - QUANTIZE_BITS)) | center);
+        quantizer->lookup[bin] = index;
+      }
+      out[x] = index;
+    }
+  }
+}
@@ -0,0 +1,95 @@
+/**
+    quantize.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_QUANTIZE_H
+#define EVID_QUANTIZE_H
+
+#include <stdint.h>
+
+/* Colors are counted with 5 bits per channel */
+#define QUANTIZE_BITS 5
+#define QUANTIZE_BINS (1 << (3 * QUANTIZE_BITS))
+/* Enough samples for a good palette while the sums can't overflow */
+#define QUANTIZE_MAX_SAMPLES (1 << 20)
+#define QUANTIZE_MAX_WIDTH 65535
+/* Bin of the pixels equal to the previous frame */
+#define QUANTIZE_UNCHANGED 0xFFFF
+
+typedef struct QuantizeBin QuantizeBin;
+struct QuantizeBin {
+  uint32_t count;
+  uint32_t r;
+  uint32_t g;
+  uint32_t b;
+};
+
+typedef struct QuantizeEntry QuantizeEntry;
+struct QuantizeEntry {
+  uint8_t color[3];
+  uint32_t count;
+  int bin;
+};
+
+/* Pixels are 32 bits with the red and blue channels at the given byte
+ * offsets, the fourth byte is padding. */
+typedef struct Quantizer Quantizer;
+
+/* Kernels picked at runtime for the cpu, SSE4.1 and AVX2 on x86 with a scalar
+ * fallback elsewhere */
+typedef void (*QuantizeRowFunc)(const uint32_t *row, const uint32_t *previous,
+                                int width, int red, int blue,
+                                const int8_t *dither, uint16_t *bins);
+typedef int (*QuantizeNearestFunc)(const Quantizer *quantizer, int r, int g,
+                                   int b);
+
+struct Quantizer {
+  int red;
+  int blue;
+  QuantizeBin bins[QUANTIZE_BINS];
+  QuantizeEntry entries[QUANTIZE_BINS]; /* scratch space of the median cut */
+  uint8_t palette[256][3];
+  int colors;
+  /* The palette again, one channel per array and padded with colors far
+   * away from any pixel so whole vectors can be compared */
+  int32_t palette_r[256];
+  int32_t palette_g[256];
+  int32_t palette_b[256];
+  int16_t lookup[QUANTIZE_BINS]; /* closest palette entry, -1 if unknown */
+  uint16_t bins_row[QUANTIZE_MAX_WIDTH];
+  QuantizeRowFunc row_bins;
+  QuantizeNearestFunc nearest;
+};
+
+void quantize_init(Quantizer *quantizer, int red, int blue);
+/* Halves the weight of the colors counted so far, so the palette follows
+ * the recording without jumping around between frames */
+void quantize_decay(Quantizer *quantizer);
+/* Counts the pixels that differ from previous (all when it's NULL), strides
+ * are in pixels and width can't be over QUANTIZE_MAX_WIDTH */
+void quantize_histogram(Quantizer *quantizer, const uint32_t *pixels,
+                        const uint32_t *previous, int stride, int width,
+                        int height);
+/* Median cut over the counted colors, returns the number of colors */
+int quantize_palette(Quantizer *quantizer, int max_colors);
+/* Maps pixels to the palette with an ordered dither, the ones equal to
+ * previous become transparent */
+void quantize_map(Quantizer *quantizer, const uint32_t *pixels,
+                  const uint32_t *previous, int stride, int width, int height,
+                  uint8_t *indices, uint8_t transparent);
+
+#endif
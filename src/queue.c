@@ -0,0 +1,97 @@
+/**
+    queue.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "queue.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+int queue_init(Queue *queue, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  queue->cells = malloc(size * sizeof(QueueCell));
+  if (!queue->cells) {
+    return -1;
+  }
+  for (size_t i = 0; i < size; ++i) {
+    atomic_init(&queue->cells[i].sequence, i);
+  }
+  queue->mask = size - 1;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  return 0;
+}
+
+void queue_destroy(Queue *queue) {
+  free(queue->cells);
+  queue->cells = NULL;
+}
+
+int queue_push(Queue *queue, void *data) {
+  size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  QueueCell *cell;
+  for (;;) {
+    cell = &queue->cells[position & queue->mask];
+    size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+    if (!difference) {
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->head, &position, position + 1, memory_order_relaxed,
+              memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      /* The cell still holds what was pushed a lap ago */
+      return -1;
+    } else {
+      position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+  }
+  cell->data = data;
+  atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+  return 0;
+}
+
+void *queue_pop(Queue *queue) {
+  size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  QueueCell *cell;
+  for (;;) {
+    cell = &queue->cells[position & queue->mask];
+    size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+    if (!difference) {
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->tail, &position, position + 1, memory_order_relaxed,
+              memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return NULL;
+    } else {
+      position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
+  }
+  void *data = cell->data;
+  atomic_store_explicit(&cell->sequence, position + queue->mask + 1,
+                        memory_order_release);
+  return data;
+}
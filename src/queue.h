@@ -0,0 +1,52 @@
+/**
+    queue.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_QUEUE_H
+#define EVID_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define QUEUE_CACHE_LINE 64
+
+typedef struct QueueCell QueueCell;
+struct QueueCell {
+  atomic_size_t sequence;
+  void *data;
+};
+
+/* Bounded lock-free queue of pointers, any number of threads can push and
+ * pop at the same time. Each cell carries the position it expects next, so
+ * producers and consumers only ever contend on their own index. */
+typedef struct Queue Queue;
+struct Queue {
+  QueueCell *cells;
+  size_t mask;
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t head; /* next push */
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t tail; /* next pop */
+};
+
+/* capacity is rounded up to a power of two */
+int queue_init(Queue *queue, size_t capacity);
+void queue_destroy(Queue *queue);
+/* Returns -1 when the queue is full */
+int queue_push(Queue *queue, void *data);
+/* Returns NULL when the queue is empty */
+void *queue_pop(Queue *queue);
+
+#endif
@@ -0,0 +1,232 @@
+/**
+    replay.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "replay.h"
+#include "file.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LIST_FILE "list.ffconcat"
+
+static void segment_path(Replay *replay, int index, char *path, size_t size) {
+  char name[32];
+  snprintf(name, sizeof(name), REPLAY_SEGMENT_PATTERN, index);
+  snprintf(path, size, "%s/%s", replay->dir, name);
+}
+
+static void drop_oldest(Replay *replay) {
+  ReplaySegment *segment = &replay->segments[replay->first];
+  char path[PATH_MAX + 32];
+  segment_path(replay, segment->index, path, sizeof(path));
+  unlink(path);
+  replay->size -= segment->size;
+  replay->first = (replay->first + 1) % REPLAY_MAX_SEGMENTS;
+  replay->count--;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int replay_init(Replay *replay, Args *args) {
+  /* Prefer a tmpfs so the segments never touch the disk */
+  const char *base = getenv("XDG_RUNTIME_DIR");
+  if (!base) {
+    base = access("/dev/shm", W_OK) ? getenv("TMPDIR") : "/dev/shm";
+  }
+  if (!base) {
+    base = "/tmp";
+  }
+  snprintf(replay->dir, sizeof(replay->dir), "%s/%s-replay-XXXXXX", base,
+           PROGRAM_NAME);
+  if (!mkdtemp(replay->dir)) {
+    return -1;
+  }
+
+  replay->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (replay->inotify_fd == -1 ||
+      inotify_add_watch(replay->inotify_fd, replay->dir, IN_CLOSE_WRITE) ==
+          -1) {
+    replay_destroy(replay);
+    return -1;
+  }
+
+  replay->keep = args->replay / atoi(REPLAY_SEGMENT_TIME) + 1;
+  replay->max_size = (long long)args->replay_max_size * 1024 * 1024;
+  replay->size = 0;
+  replay->first = 0;
+  replay->count = 0;
+  return 0;
+}
+
+void replay_update(Replay *replay) {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while ((length = read(replay->inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      char *end;
+      int index = event->len ? strtol(event->name, &end, 10) : 0;
+      if (!event->len || strcmp(end, ".ts")) {
+        continue;
+      }
+
+      char path[PATH_MAX + 32];
+      struct stat st;
+      segment_path(replay, index, path, sizeof(path));
+      if (stat(path, &st) == -1) {
+        continue;
+      }
+      if (replay->count == REPLAY_MAX_SEGMENTS) {
+        drop_oldest(replay);
+      }
+      int last = (replay->first + replay->count) % REPLAY_MAX_SEGMENTS;
+      replay->segments[last].index = index;
+      replay->segments[last].size = st.st_size;
+      replay->size += st.st_size;
+      replay->count++;
+    }
+  }
+
+  /* Keep enough segments to cover the requested seconds, but never more
+   * than the memory cap allows */
+  while (replay->count > replay->keep ||
+         (replay->count > 1 && replay->size > replay->max_size)) {
+    drop_oldest(replay);
+  }
+}
+
+int replay_snapshot(Replay *replay, Args *args, const char *file) {
+  replay_update(replay);
+
+  DIR *dir = opendir(replay->dir);
+  if (!dir) {
+    return -1;
+  }
+  /* Finished segments plus the one still being written */
+  char *names[REPLAY_MAX_SEGMENTS + 1];
+  int count = 0;
+  struct dirent *entry;
+  int failed = 0;
+  while (!failed && (entry = readdir(dir)) && count < (int)ARR_SIZE(names)) {
+    const char *extension = strrchr(entry->d_name, '.');
+    if (extension && !strcmp(extension, ".ts")) {
+      /* A snapshot missing a segment would have a gap in the middle */
+      failed = !(names[count] = strdup(entry->d_name));
+      count += !failed;
+    }
+  }
+  closedir(dir);
+  if (failed) {
+    for (int i = 0; i < count; ++i) {
+      free(names[i]);
+    }
+    return -1;
+  }
+  qsort(names, count, sizeof(*names), &compare_names);
+
+  char list[PATH_MAX + sizeof(LIST_FILE)];
+  snprintf(list, sizeof(list), "%s/%s", replay->dir, LIST_FILE);
+  FILE *listp = fopen(list, "w");
+  if (!listp) {
+    for (int i = 0; i < count; ++i) {
+      free(names[i]);
+    }
+    return -1;
+  }
+  fprintf(listp, "ffconcat version 1.0\n");
+  for (int i = 0; i < count; ++i) {
+    fprintf(listp, "file '%s'\n", names[i]);
+    free(names[i]);
+  }
+  fclose(listp);
+  if (!count) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  switch (pid) {
+  case -1: {
+    return -1;
+  }
+  case 0: {
+    int fargsc = 0;
+    char *fargs[20];
+    fargs[fargsc++] = "ffmpeg";
+    fargs[fargsc++] = "-y";
+    fargs[fargsc++] = "-f";
+    fargs[fargsc++] = "concat";
+    fargs[fargsc++] = "-i";
+    fargs[fargsc++] = list;
+    fargs[fargsc++] = "-c";
+    fargs[fargsc++] = "copy";
+    if (args->gif) {
+      // Turned into a gif afterwards, like the HQGIF intermediate
+      fargs[fargsc++] = "-f";
+      fargs[fargsc++] = "matroska";
+    }
+    fargs[fargsc++] = (char *)file;
+    fargs[fargsc] = NULL;
+    if (args->verbosity == QUIET) {
+      close(2);
+      open("/dev/null", O_RDWR);
+    }
+    execvp(fargs[0], fargs);
+    die("failed to launch ffmpeg, error: %s\n", strerror(errno));
+  }
+  default: {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1 || status) {
+      return -1;
+    }
+  }
+  }
+  return 0;
+}
+
+void replay_destroy(Replay *replay) {
+  if (replay->inotify_fd != -1) {
+    close(replay->inotify_fd);
+    replay->inotify_fd = -1;
+  }
+  DIR *dir = opendir(replay->dir);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      if (entry->d_name[0] != '.') {
+        unlinkat(dirfd(dir), entry->d_name, 0);
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(replay->dir);
+}
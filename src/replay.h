@@ -0,0 +1,59 @@
+/**
+    replay.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_REPLAY_H
+#define EVID_REPLAY_H
+
+#include "types.h"
+
+#include <linux/limits.h>
+
+#define REPLAY_DEFAULT_SECONDS 30
+#define REPLAY_DEFAULT_MAX_SIZE 256 /* MB */
+
+/* Length of every segment in seconds, each one starts with a keyframe */
+#define REPLAY_SEGMENT_TIME "1"
+#define REPLAY_SEGMENT_PATTERN "%08d.ts"
+#define REPLAY_MAX_SEGMENTS 4096
+
+typedef struct ReplaySegment ReplaySegment;
+struct ReplaySegment {
+  int index;
+  long long size;
+};
+
+/* The last seconds of the recording kept as finished segments in a memory
+ * backed directory, oldest ones are dropped as new ones are closed. */
+typedef struct Replay Replay;
+struct Replay {
+  char dir[PATH_MAX];
+  int inotify_fd;
+  int keep;            /* finished segments needed to cover the seconds */
+  long long max_size;  /* bytes */
+  long long size;
+  ReplaySegment segments[REPLAY_MAX_SEGMENTS];
+  int first;
+  int count;
+};
+
+int replay_init(Replay *replay, Args *args);
+void replay_update(Replay *replay);
+int replay_snapshot(Replay *replay, Args *args, const char *file);
+void replay_destroy(Replay *replay);
+
+#endif
@@ -0,0 +1,189 @@
+/**
+    segment.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "segment.h"
+#include "file.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/wait.h>
+
+static void segment_path(Segments *segments, int index, char *path,
+                         size_t size) {
+  snprintf(path, size, segments->pattern, index);
+}
+
+/* printf and ffmpeg alike would take a % for a conversion */
+static size_t append_escaped(char *pattern, size_t length, size_t size,
+                             const char *string, size_t string_length) {
+  for (size_t i = 0; i < string_length && length + 2 < size; ++i) {
+    if (string[i] == '%') {
+      pattern[length++] = '%';
+    }
+    pattern[length++] = string[i];
+  }
+  pattern[length] = '\0';
+  return length;
+}
+
+/* Detached so nobody has to wait for it, the recording goes on meanwhile */
+static void run_command(const char *command, const char *file) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (fork() == 0) {
+      execl("/bin/sh", "sh", "-c", command, "sh", file, (char *)NULL);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+static void list_segment(Segments *segments, const char *name) {
+  fputs("file '", segments->list);
+  for (const char *c = name; *c; ++c) {
+    if (*c == '\'') {
+      fputs("'\\''", segments->list);
+    } else {
+      fputc(*c, segments->list);
+    }
+  }
+  fputs("'\n", segments->list);
+  fflush(segments->list);
+}
+
+int segments_init(Segments *segments, Args *args, const char *file) {
+  segments->inotify_fd = -1;
+  segments->list = NULL;
+  segments->finished = 0;
+  segments->next = 0;
+  segments->last[0] = '\0';
+  segments->command = args->segment_command;
+
+  const char *slash = strrchr(file, '/');
+  const char *base = slash ? slash + 1 : file;
+  if (!slash) {
+    snprintf(segments->dir, sizeof(segments->dir), ".");
+  } else if (slash == file) {
+    snprintf(segments->dir, sizeof(segments->dir), "/");
+  } else {
+    snprintf(segments->dir, sizeof(segments->dir), "%.*s",
+             (int)(slash - file), file);
+  }
+  const char *extension = strrchr(base, '.');
+  int base_length = extension ? extension - base : (int)strlen(base);
+  snprintf(segments->name, sizeof(segments->name), "%.*s-", base_length,
+           base);
+
+  size_t length = append_escaped(segments->pattern, 0,
+                                 sizeof(segments->pattern), segments->dir,
+                                 strlen(segments->dir));
+  length = append_escaped(segments->pattern, length, sizeof(segments->pattern),
+                          "/", 1);
+  length = append_escaped(segments->pattern, length, sizeof(segments->pattern),
+                          segments->name, strlen(segments->name));
+  snprintf(segments->pattern + length, sizeof(segments->pattern) - length,
+           "%%03d%s", SEGMENT_EXTENSION);
+
+  segments->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (segments->inotify_fd == -1 ||
+      inotify_add_watch(segments->inotify_fd, segments->dir, IN_CLOSE_WRITE) ==
+          -1) {
+    segments_destroy(segments);
+    return -1;
+  }
+
+  if (args->segment_list) {
+    snprintf(segments->list_path, sizeof(segments->list_path),
+             "%s/%.*s.ffconcat", segments->dir, base_length, base);
+    segments->list = fopen(segments->list_path, "w");
+    if (!segments->list) {
+      segments_destroy(segments);
+      return -1;
+    }
+    fputs("ffconcat version 1.0\n", segments->list);
+    fflush(segments->list);
+  }
+  return 0;
+}
+
+void segments_update(Segments *segments) {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  size_t name_length = strlen(segments->name);
+  ssize_t length;
+  while ((length = read(segments->inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (!event->len || strncmp(event->name, segments->name, name_length) ||
+          !isdigit((unsigned char)event->name[name_length])) {
+        continue;
+      }
+      char *end;
+      int index = strtol(event->name + name_length, &end, 10);
+      // Segments are finished in order, anything else was written after
+      if (strcmp(end, SEGMENT_EXTENSION) || index < segments->next) {
+        continue;
+      }
+
+      segments->next = index + 1;
+      segments->finished++;
+      segment_path(segments, index, segments->last, sizeof(segments->last));
+      if (segments->list) {
+        list_segment(segments, event->name);
+      }
+      if (segments->command) {
+        run_command(segments->command, segments->last);
+      }
+    }
+  }
+}
+
+void segments_remove(Segments *segments) {
+  char path[PATH_MAX];
+  /* Up to the one that may still have been written */
+  for (int index = 0; index <= segments->next; ++index) {
+    segment_path(segments, index, path, sizeof(path));
+    remove_file(path);
+  }
+  if (segments->list) {
+    fclose(segments->list);
+    segments->list = NULL;
+    remove_file(segments->list_path);
+  }
+}
+
+void segments_destroy(Segments *segments) {
+  if (segments->inotify_fd != -1) {
+    close(segments->inotify_fd);
+    segments->inotify_fd = -1;
+  }
+  if (segments->list) {
+    fclose(segments->list);
+    segments->list = NULL;
+  }
+}
@@ -0,0 +1,57 @@
+/**
+    segment.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_SEGMENT_H
+#define EVID_SEGMENT_H
+
+#include "types.h"
+
+#include <linux/limits.h>
+#include <stdio.h>
+
+#define SEGMENT_DEFAULT_MINUTES 5
+/* Extension of the segments, they're always mp4 */
+#define SEGMENT_EXTENSION ".mp4"
+
+/* Long recordings cut into numbered files next to where they're saved,
+ * each one starting with a keyframe. Finished ones are noticed as they're
+ * closed so they can be listed and handed over while the recording goes
+ * on. */
+typedef struct Segments Segments;
+struct Segments {
+  char dir[PATH_MAX];
+  char name[NAME_MAX + 1]; /* what comes before the index */
+  char pattern[PATH_MAX + 8]; /* printf pattern of the paths, by index */
+  int inotify_fd;
+  int finished;
+  int next; /* index of the one being written */
+  char last[PATH_MAX]; /* the last one finished */
+  FILE *list; /* ffconcat manifest, NULL unless asked for */
+  char list_path[PATH_MAX];
+  const char *command; /* run on every finished segment */
+};
+
+/* file is what the recording would have been saved as */
+int segments_init(Segments *segments, Args *args, const char *file);
+/* Takes in the segments finished so far */
+void segments_update(Segments *segments);
+/* Removes every segment written along with the manifest */
+void segments_remove(Segments *segments);
+void segments_destroy(Segments *segments);
+
+#endif
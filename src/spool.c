@@ -0,0 +1,243 @@
+/**
+    spool.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#define _GNU_SOURCE
+
+#include "spool.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/limits.h>
+#include <sys/mman.h>
+
+/* Kept clear of the descriptors children get theirs dup2'ed to */
+#define SPOOL_MIN_FD 10
+/* Moved at once, the pipe is grown to it as well */
+#define SPOOL_CHUNK (1024 * 1024)
+
+static int move_fd(int fd) {
+  if (fd == -1 || fd >= SPOOL_MIN_FD) {
+    return fd;
+  }
+  int moved = fcntl(fd, F_DUPFD_CLOEXEC, SPOOL_MIN_FD);
+  close(fd);
+  return moved;
+}
+
+static int open_disk_file(int *tmpfile) {
+  const char *dir = get_tmp_dir();
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1) {
+    *tmpfile = 1;
+    return fd;
+  }
+  // Filesystems without O_TMPFILE get a name that's gone right away
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s-XXXXXX", dir, PROGRAM_NAME);
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd != -1) {
+    unlink(path);
+  }
+  *tmpfile = 0;
+  return fd;
+}
+
+/* Moves what's in memory to disk under the same descriptor number */
+static int spill(Spool *spool) {
+  int tmpfile;
+  int disk = open_disk_file(&tmpfile);
+  if (disk == -1) {
+    return -1;
+  }
+  if (lseek(spool->fd, 0, SEEK_SET) == -1 ||
+      copy_fd(spool->fd, disk, atomic_load(&spool->size), NULL, NULL) ||
+      dup3(disk, spool->fd, O_CLOEXEC) == -1) {
+    lseek(spool->fd, 0, SEEK_END);
+    close(disk);
+    return -1;
+  }
+  close(disk);
+  spool->tmpfile = tmpfile;
+  atomic_store(&spool->spilled, 1);
+  return 0;
+}
+
+static ssize_t drain(Spool *spool) {
+  ssize_t moved =
+      splice(spool->output, NULL, spool->fd, NULL, SPOOL_CHUNK, SPLICE_F_MOVE);
+  if (moved != -1 || errno != EINVAL) {
+    return moved;
+  }
+  // Filesystems that can't be spliced to
+  char buffer[64 * 1024];
+  moved = read(spool->output, buffer, sizeof(buffer));
+  for (ssize_t written = 0; written < moved;) {
+    ssize_t bytes = write(spool->fd, buffer + written, moved - written);
+    if (bytes == -1 && errno != EINTR) {
+      return -1;
+    }
+    written += bytes > 0 ? bytes : 0;
+  }
+  return moved;
+}
+
+static void *drain_loop(void *arg) {
+  Spool *spool = arg;
+  // Signals are left to the main thread
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  for (;;) {
+    ssize_t moved = drain(spool);
+    if (moved == -1 && errno == EINTR) {
+      continue;
+    }
+    if (moved == -1) {
+      error("failed to keep the recording: %s\n", strerror(errno));
+      spool->failed = 1;
+      break;
+    }
+    if (!moved) {
+      return NULL;
+    }
+    long long size = atomic_fetch_add(&spool->size, moved) + moved;
+    if (!atomic_load(&spool->spilled) && size > spool->memory &&
+        spill(spool)) {
+      error("failed to move the recording to %s, keeping it in memory\n",
+            get_tmp_dir());
+      // Not worth trying again for every chunk
+      atomic_store(&spool->spilled, 1);
+    }
+  }
+
+  // The writers would block forever otherwise
+  char buffer[64 * 1024];
+  while (read(spool->output, buffer, sizeof(buffer)) > 0 || errno == EINTR) {
+  }
+  return NULL;
+}
+
+int spool_open(Spool *spool, off_t memory) {
+  spool->input = spool->output = -1;
+  spool->memory = memory;
+  spool->tmpfile = 0;
+  spool->failed = 0;
+  atomic_store(&spool->size, 0);
+  atomic_store(&spool->spilled, 0);
+
+  int fd = memory > 0 ? memfd_create(PROGRAM_NAME, MFD_CLOEXEC) : -1;
+  if (fd == -1) {
+    fd = open_disk_file(&spool->tmpfile);
+    atomic_store(&spool->spilled, 1);
+  }
+  spool->fd = move_fd(fd);
+  int fds[2];
+  if (spool->fd == -1 || pipe2(fds, O_CLOEXEC) == -1) {
+    spool_destroy(spool);
+    return -1;
+  }
+  spool->output = move_fd(fds[0]);
+  spool->input = move_fd(fds[1]);
+  if (spool->output == -1 || spool->input == -1) {
+    spool_destroy(spool);
+    return -1;
+  }
+  // Fewer and bigger chunks, it's fine if the limit doesn't allow it
+  fcntl(spool->output, F_SETPIPE_SZ, SPOOL_CHUNK);
+  snprintf(spool->input_path, sizeof(spool->input_path), "/proc/self/fd/%d",
+           spool->input);
+  snprintf(spool->path, sizeof(spool->path), "/proc/%d/fd/%d", getpid(),
+           spool->fd);
+
+  if (pthread_create(&spool->thread, NULL, drain_loop, spool)) {
+    close(spool->output);
+    spool->output = -1;
+    spool_destroy(spool);
+    return -1;
+  }
+  return 0;
+}
+
+void spool_close_input(Spool *spool) {
+  if (spool->input != -1) {
+    close(spool->input);
+    spool->input = -1;
+  }
+}
+
+int spool_finish(Spool *spool) {
+  spool_close_input(spool);
+  if (spool->output != -1) {
+    pthread_join(spool->thread, NULL);
+    close(spool->output);
+    spool->output = -1;
+  }
+  return spool->failed ? -1 : 0;
+}
+
+int spool_save(Spool *spool, const char *dest, int sync, CopyProgress progress,
+               void *data) {
+  off_t size = atomic_load(&spool->size);
+  // Files on disk only need a name when they're on the right filesystem
+  if (spool->tmpfile &&
+      !linkat(AT_FDCWD, spool->path, AT_FDCWD, dest, AT_SYMLINK_FOLLOW)) {
+    if (progress) {
+      progress(size, size, data);
+    }
+    return sync ? sync_file(dest) : 0;
+  }
+
+  int out = open(dest, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+  if (out == -1) {
+    error("couldn't open %s, failed with error: %s\n", dest, strerror(errno));
+    return -1;
+  }
+  int ret = 0;
+  if (lseek(spool->fd, 0, SEEK_SET) == -1 ||
+      copy_fd(spool->fd, out, size, progress, data) ||
+      (sync && fsync(out) == -1)) {
+    error("fatal error saving the file, failed with error: %s\n",
+          strerror(errno));
+    ret = -1;
+  }
+  if (close(out) == -1 && !ret) {
+    error("fatal error saving the file, failed with error: %s\n",
+          strerror(errno));
+    ret = -1;
+  }
+  if (ret) {
+    remove_file(dest);
+  }
+  return ret;
+}
+
+void spool_destroy(Spool *spool) {
+  spool_finish(spool);
+  if (spool->fd != -1) {
+    close(spool->fd);
+    spool->fd = -1;
+  }
+}
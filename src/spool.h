@@ -0,0 +1,67 @@
+/**
+    spool.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_SPOOL_H
+#define EVID_SPOOL_H
+
+#include "file.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/* ffmpeg writes a spooled recording to this descriptor */
+#define SPOOL_FFMPEG_FD 4
+#define SPOOL_FFMPEG_URL "pipe:4"
+
+#define SPOOL_DEFAULT_MEMORY 64 /* MB */
+
+/* A recording that isn't written where it's saved. Writers are handed the
+ * write end of a pipe, a thread moves what comes through into a memfd and
+ * over to an anonymous file in $TMPDIR once it outgrows the memory it's
+ * allowed. Nothing has a name: there's nothing to clean up and instances
+ * never collide, short clips don't touch the disk until they're saved. */
+typedef struct Spool Spool;
+struct Spool {
+  int fd;     /* what was written so far, always the same number */
+  int input;  /* for the writers, -1 once handed over */
+  int output; /* drained by the thread */
+  off_t memory; /* bytes kept in memory at most */
+  atomic_llong size;
+  atomic_int spilled; /* fd is on disk */
+  int tmpfile;        /* fd was opened with O_TMPFILE and can be linked */
+  int failed;
+  pthread_t thread;
+  char input_path[32]; /* names input for writers that want to open it */
+  char path[48];       /* names fd for readers, in this process's children */
+};
+
+/* memory is in bytes, 0 to go to disk right away */
+int spool_open(Spool *spool, off_t memory);
+/* Once every writer has its own descriptor, the end is noticed when they
+ * closed them */
+void spool_close_input(Spool *spool);
+/* Waits for what's still in the pipe, -1 if part of it was lost */
+int spool_finish(Spool *spool);
+/* Links the recording as dest when it's on the same filesystem, copies it
+ * otherwise */
+int spool_save(Spool *spool, const char *dest, int sync, CopyProgress progress,
+               void *data);
+void spool_destroy(Spool *spool);
+
+#endif
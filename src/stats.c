@@ -0,0 +1,238 @@
+/**
+    stats.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* VmHWM from /proc, the highest resident set size so far */
+static long read_peak_rss(pid_t pid) {
+  char path[32];
+  if (pid == -1) {
+    return 0;
+  }
+  if (pid) {
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  } else {
+    snprintf(path, sizeof(path), "/proc/self/status");
+  }
+  FILE *status = fopen(path, "r");
+  if (!status) {
+    return 0;
+  }
+  char line[128];
+  long peak = 0;
+  while (fgets(line, sizeof(line), status)) {
+    if (!strncmp(line, "VmHWM:", 6)) {
+      peak = strtol(line + 6, NULL, 10);
+      break;
+    }
+  }
+  fclose(status);
+  return peak;
+}
+
+void stats_init(Stats *stats, int fd, pid_t pid) {
+  memset(stats, 0, sizeof(*stats));
+  stats->fd = fd;
+  stats->pid = pid;
+  stats->start = stats->last = now_ns();
+}
+
+/* Values are "N/A" until ffmpeg knows better, which strtod turns into 0 */
+static void parse_progress(Stats *stats, char *line) {
+  char *value = strchr(line, '=');
+  if (!value) {
+    return;
+  }
+  *value++ = '\0';
+  if (!strcmp(line, "frame")) {
+    stats->frames = strtoul(value, NULL, 10);
+    if (stats->frames && !stats->first_frame) {
+      stats->first_frame = (now_ns() - stats->start) / 1e9;
+      trace("first frame encoded");
+    }
+  } else if (!strcmp(line, "fps")) {
+    stats->fps = strtod(value, NULL);
+  } else if (!strcmp(line, "bitrate")) {
+    stats->bitrate = strtod(value, NULL);
+  } else if (!strcmp(line, "total_size")) {
+    stats->size = strtoll(value, NULL, 10);
+  } else if (!strcmp(line, "out_time_us")) {
+    stats->duration = strtoll(value, NULL, 10) / 1e6;
+  } else if (!strcmp(line, "dup_frames")) {
+    stats->ffmpeg_dup = strtoul(value, NULL, 10);
+  } else if (!strcmp(line, "drop_frames")) {
+    stats->ffmpeg_drop = strtoul(value, NULL, 10);
+  } else if (!strcmp(line, "speed")) {
+    stats->speed = strtod(value, NULL);
+  }
+}
+
+int stats_read(Stats *stats) {
+  char buffer[1024];
+  for (;;) {
+    ssize_t size = read(stats->fd, buffer, sizeof(buffer));
+    if (size == -1 && errno == EINTR) {
+      continue;
+    }
+    if (size == -1 && errno == EAGAIN) {
+      return 0;
+    }
+    if (size <= 0) {
+      close(stats->fd);
+      stats->fd = -1;
+      return -1;
+    }
+    for (ssize_t i = 0; i < size; ++i) {
+      if (buffer[i] != '\n') {
+        /* Nothing ffmpeg reports is longer, cut the rest */
+        if (stats->line_length < sizeof(stats->line) - 1) {
+          stats->line[stats->line_length++] = buffer[i];
+        }
+        continue;
+      }
+      stats->line[stats->line_length] = '\0';
+      parse_progress(stats, stats->line);
+      stats->line_length = 0;
+    }
+  }
+}
+
+int stats_update(Stats *stats, Capture *capture, const char *file,
+                 int force) {
+  long long now = now_ns();
+  if (!force && now - stats->last < STATS_INTERVAL * 1000000LL) {
+    return 0;
+  }
+  stats->last = now;
+  /* Time spent paused is neither recorded nor encoded */
+  long long paused = capture ? capture_paused_time(capture) : 0;
+  stats->elapsed = (now - stats->start - paused) / 1e9;
+
+  long peak_rss = read_peak_rss(stats->pid);
+  if (peak_rss > stats->peak_rss) {
+    stats->peak_rss = peak_rss;
+  }
+
+  stats->dup = stats->ffmpeg_dup;
+  stats->drop = stats->ffmpeg_drop;
+  if (capture) {
+    stats->dup += atomic_load(&capture->duplicated);
+    stats->drop += atomic_load(&capture->dropped);
+  }
+  if (capture && capture->encoder) {
+    /* Nobody reports progress for the in-process encoder, count it here */
+    stats->frames = atomic_load(&capture->written);
+    long long first = atomic_load(&capture->first_written);
+    stats->first_frame = first ? (first - stats->start) / 1e9 : 0;
+    stats->fps = stats->elapsed > 0 ? stats->frames / stats->elapsed : 0;
+    long long until = atomic_load(&capture->written_until);
+    stats->duration = until > stats->start ? (until - stats->start) / 1e9 : 0;
+    /* Frames only come on changes with damage tracking, a still screen
+     * doesn't mean the encoder is late */
+    stats->speed = !capture->vfr && stats->elapsed > 0
+                       ? stats->duration / stats->elapsed
+                       : 0;
+    struct stat st;
+    if (file && !stat(file, &st)) {
+      stats->size = st.st_size;
+    }
+    stats->bitrate =
+        stats->duration > 0 ? stats->size * 8 / 1000.0 / stats->duration : 0;
+  } else if (paused && stats->elapsed > 0) {
+    /* ffmpeg's speed counts the pauses as time it fell behind */
+    stats->speed = stats->duration / stats->elapsed;
+  }
+
+  if (stats->elapsed >= STATS_WARMUP) {
+    unsigned long total = stats->frames + stats->drop;
+    if ((stats->speed > 0 && stats->speed < STATS_MIN_SPEED) ||
+        (total && (double)stats->drop / total > STATS_MAX_DROP_RATE)) {
+      stats->behind = 1;
+    }
+  }
+  return 1;
+}
+
+void stats_child_exited(Stats *stats, long peak_rss) {
+  stats->pid = -1;
+  if (peak_rss > stats->peak_rss) {
+    stats->peak_rss = peak_rss;
+  }
+}
+
+void stats_print(Stats *stats, FILE *stream, const char *end) {
+  fprintf(stream,
+          "frame=%lu fps=%.1f dup=%lu drop=%lu speed=%.2fx "
+          "bitrate=%.1fkbits/s rss=%ldkB%s",
+          stats->frames, stats->fps, stats->dup, stats->drop, stats->speed,
+          stats->bitrate, stats->peak_rss, end);
+  fflush(stream);
+}
+
+int stats_write_json(Stats *stats, const char *file) {
+  char path[PATH_MAX + 8];
+  snprintf(path, sizeof(path), "%s.json", file);
+  FILE *json = fopen(path, "w");
+  if (!json) {
+    return -1;
+  }
+  fprintf(json,
+          "{\n"
+          "  \"start\": %.6f,\n"
+          "  \"first_frame\": %.3f,\n"
+          "  \"elapsed\": %.3f,\n"
+          "  \"duration\": %.3f,\n"
+          "  \"frames\": %lu,\n"
+          "  \"fps\": %.2f,\n"
+          "  \"dup_frames\": %lu,\n"
+          "  \"drop_frames\": %lu,\n"
+          "  \"speed\": %.3f,\n"
+          "  \"bitrate_kbits\": %.1f,\n"
+          "  \"size\": %lld,\n"
+          "  \"peak_rss_kb\": %ld,\n"
+          "  \"fell_behind\": %s\n"
+          "}\n",
+          stats->start / 1e9, stats->first_frame, stats->elapsed,
+          stats->duration, stats->frames, stats->fps,
+          stats->dup, stats->drop, stats->speed, stats->bitrate, stats->size,
+          stats->peak_rss, stats->behind ? "true" : "false");
+  return fclose(json) ? -1 : 0;
+}
+
+void stats_destroy(Stats *stats) {
+  if (stats->fd != -1) {
+    close(stats->fd);
+    stats->fd = -1;
+  }
+}
@@ -0,0 +1,77 @@
+/**
+    stats.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_STATS_H
+#define EVID_STATS_H
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* ffmpeg writes its progress to this descriptor */
+#define STATS_PROGRESS_FD 3
+#define STATS_PROGRESS_URL "pipe:3"
+
+#define STATS_INTERVAL 1000 /* ms between two samples */
+#define STATS_WARMUP 3      /* seconds before judging the encoding speed */
+#define STATS_MIN_SPEED 0.9
+#define STATS_MAX_DROP_RATE 0.05
+
+/* Figures of the running recording, either parsed from ffmpeg's -progress
+ * output or counted by the in-process pipeline */
+typedef struct Stats Stats;
+struct Stats {
+  int fd;    /* progress pipe, -1 when encoding in-process */
+  pid_t pid; /* ffmpeg, 0 for evid itself, -1 once it's gone */
+  long long start;  /* monotonic, nanoseconds */
+  long long last;   /* when the last sample was taken */
+  double elapsed;   /* seconds, pauses left out */
+  double duration;  /* seconds of video encoded */
+  double first_frame; /* seconds until the first frame was out, 0 before */
+  unsigned long frames;
+  unsigned long dup;
+  unsigned long drop;
+  double fps;
+  double speed; /* compared to real time, 0 when unknown */
+  double bitrate; /* kbit/s */
+  long long size; /* bytes */
+  long peak_rss;  /* kB */
+  int behind;     /* the encoder can't keep up with the capture */
+  int warned;
+  /* as reported by ffmpeg, duplicates and drops of the capture get added */
+  unsigned long ffmpeg_dup;
+  unsigned long ffmpeg_drop;
+  char line[128];
+  size_t line_length;
+};
+
+void stats_init(Stats *stats, int fd, pid_t pid);
+/* Parses what ffmpeg wrote so far, -1 once the pipe is closed */
+int stats_read(Stats *stats);
+/* Refreshes the figures at most every STATS_INTERVAL unless forced, returns
+ * whether a sample was taken. file is what's being encoded. */
+int stats_update(Stats *stats, Capture *capture, const char *file, int force);
+/* Peak memory usage (kB) of the reaped ffmpeg, as told by wait4 */
+void stats_child_exited(Stats *stats, long peak_rss);
+void stats_print(Stats *stats, FILE *stream, const char *end);
+/* Summary of the recording saved as file.json */
+int stats_write_json(Stats *stats, const char *file);
+void stats_destroy(Stats *stats);
+
+#endif
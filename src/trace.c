@@ -0,0 +1,85 @@
+/**
+    trace.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int enabled = 0;
+static long long origin = 0; /* CLOCK_MONOTONIC, nanoseconds */
+
+static long long clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* When the kernel started the process, so that exec and loading the shared
+ * libraries are accounted for. starttime is in clock ticks since boot, which
+ * is as precise as it gets. */
+static long long process_start(void) {
+  long long now = clock_ns(CLOCK_MONOTONIC);
+  FILE *stat = fopen("/proc/self/stat", "r");
+  if (!stat) {
+    return now;
+  }
+  char line[1024];
+  unsigned long long start_ticks = 0;
+  if (fgets(line, sizeof(line), stat)) {
+    /* The command may contain spaces, fields are counted after it */
+    char *field = strrchr(line, ')');
+    for (int i = 2; field && i < 22; ++i) {
+      field = strchr(field + 1, ' ');
+    }
+    if (field) {
+      start_ticks = strtoull(field + 1, NULL, 10);
+    }
+  }
+  fclose(stat);
+  if (!start_ticks) {
+    return now;
+  }
+  long long since_boot = start_ticks * 1000000000LL / sysconf(_SC_CLK_TCK);
+  return now - (clock_ns(CLOCK_BOOTTIME) - since_boot);
+}
+
+void trace_init(int enable) {
+  enabled = enable;
+  if (enabled) {
+    origin = process_start();
+    trace("main entered");
+  }
+}
+
+void trace_restart(const char *phase) {
+  if (enabled) {
+    origin = clock_ns(CLOCK_MONOTONIC);
+    trace(phase);
+  }
+}
+
+void trace(const char *phase) {
+  if (enabled) {
+    double elapsed = (clock_ns(CLOCK_MONOTONIC) - origin) / 1e6;
+    fprintf(stdout, "Trace: %9.3f ms %s\n", elapsed, phase);
+  }
+}
@@ -19,6 +19,13 @@
 #ifndef EVID_TYPES_H
 #define EVID_TYPES_H
 
+#define QUIET 0
+#define INFO 1
+#define DEBUG 2
+
+#define LQGIF 1
+#define HQGIF 2
+
 typedef struct _Region _Region;
 struct _Region {
   int x;          /* offset from left of screen */
@@ -29,6 +36,7 @@ struct _Region {
   unsigned int h; /* height */
   unsigned int b; /* border_width */
   unsigned int d; /* depth */
+  unsigned long window; /* clicked window, 0 when an area was dragged */
 };
 
 typedef struct Audio Audio;
@@ -46,9 +54,25 @@ struct Args {
 #endif
   int draw_mouse;
   int show_region;
+  int damage;
+  int replay;          /* seconds kept, 0 when disabled */
+  int replay_max_size; /* MB */
   int gif;
   char *framerate;
   char *output;
+  int daemon;
+  char *trigger;
+  char *monitor; /* recorded without selecting, empty for the current one */
+  int fsync;     /* saved recordings are flushed to disk */
+  int tmp_memory; /* MB kept in memory before moving to $TMPDIR */
+  int jobs;       /* recordings saved at the same time at most */
+  double scale;   /* output size compared to the region's, at most 1 */
+  int max_width;  /* the output is shrunk to fit, 0 when unbounded */
+  int max_height;
+  int segment_time; /* seconds per segment, 0 when not cut by time */
+  int segment_size; /* MB per segment, 0 when not cut by size */
+  int segment_list; /* an ffconcat manifest is written next to them */
+  char *segment_command; /* run on every finished segment */
 };
 
 #endif
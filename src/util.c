@@ -18,6 +18,8 @@
 
 #include "util.h"
 #include "evid.h"
+#include "notifier.h"
+#include "types.h"
 
 #ifdef HAVE_NOTIFY
 #include "libnotify/notify.h"
@@ -25,15 +27,36 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+void set_verbose(char **fargs, int verbose) {
+  if (verbose == DEBUG) {
+    fprintf(stdout, "Executing ffmpeg with command: ");
+    char **i = fargs;
+    for (; *i; ++i) {
+      fprintf(stdout, "%s ", *i);
+    }
+    fprintf(stdout, "\n");
+    *i++ = "-loglevel";
+    *i++ = "debug";
+    *i = NULL;
+  } else if (verbose == QUIET) {
+    close(2);
+    open("/dev/null", O_RDWR);
+  }
+}
 
 static void verror(const char *errstr, va_list argp) {
 #ifdef HAVE_NOTIFY
+  notifier_wait();
   char error_notification_summary[20] = {0};
   char error_notification_body[100] = {0};
   snprintf(error_notification_summary, ARR_SIZE(error_notification_summary),
@@ -61,9 +84,34 @@ void die(const char *errstr, ...) {
   va_start(argp, errstr);
   verror(errstr, argp);
   va_end(argp);
+  // SIGINT may be blocked while it's being read from a signalfd
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
   raise(SIGINT);
 }
 
+void get_scaled_size(Args *args, int width, int height, int *scaled_width,
+                     int *scaled_height) {
+  double factor = args->scale;
+  if (args->max_width && width * factor > args->max_width) {
+    factor = (double)args->max_width / width;
+  }
+  if (args->max_height && height * factor > args->max_height) {
+    factor = (double)args->max_height / height;
+  }
+  /* A factor like 0.5 has to give exactly half */
+  *scaled_width = width * factor + 1e-6;
+  *scaled_height = height * factor + 1e-6;
+  if (*scaled_width < 1) {
+    *scaled_width = 1;
+  }
+  if (*scaled_height < 1) {
+    *scaled_height = 1;
+  }
+}
+
 void print_version(void) {
   fprintf(stdout, "%s version %s\n", PROGRAM_NAME, PROGRAM_VERSION);
 }
@@ -72,13 +120,39 @@ void print_usage(void) {
   fprintf(
       stdout,
       "Usage: %s [OPTIONS] \n Available options:\n -i|--info\toutput "
-      "runtime info to the console.\n -d|--debug\toutput debug info to the "
-      "console.\n -f|--framerate FRAMES\tsets the framerate of the "
+      "runtime info and recording statistics to the console, the statistics "
+      "are also saved next to the recording as json.\n -d|--debug\toutput "
+      "debug info to the console.\n -f|--framerate FRAMES\t"
+      "sets the framerate of the "
       "output video.\n -a|--audio SOURCE\tuses an audio source for the video, "
       "valid options are pulse and alsa with a comma separated input device, "
       "defaults to pulse,default.\n --no-draw-mouse\thides the pointer in the "
-      "output video.\n -g|--gif\toutputs the recording to a gif\n "
+      "output video.\n --damage\tonly grabs frames when the recorded area "
+      "changes, the output has a variable frame rate.\n --replay[=SECONDS]\t"
+      "keeps recording and saves or copies the last seconds (30 by default) "
+      "on every shortcut\n --replay-max-size MB\tmemory used by the replay "
+      "buffer at most, defaults to 256\n -g|--gif\toutputs "
+      "the recording to a gif\n "
       "-o|--output\tsaves the recording into this file or directory\n "
+      "--fsync\tflushes saved recordings to disk before reporting them "
+      "as saved\n --tmp-memory MB\tmemory a recording uses at most before "
+      "it's moved to $TMPDIR, defaults to 64, 0 writes it there right "
+      "away\n --jobs N\trecordings converted or saved in the background "
+      "at the same time, at idle priority, defaults to 2\n --scale FACTOR\t"
+      "downscales the recording while capturing, e.g. 0.5 for half the "
+      "size\n --max-size WxH\tdownscales the recording to fit, keeping its "
+      "proportions, a single number bounds both sides\n "
+      "--segment[=MINUTES]\tcuts the recording into numbered files "
+      "every 5 minutes or the given ones\n --segment-size MB\tcuts the "
+      "recording into numbered files of about this size\n --segment-list\t"
+      "lists the segments in an ffconcat manifest as they're finished\n "
+      "--segment-command CMD\truns CMD through the shell on every finished "
+      "segment, its path is passed as $1\n "
+      "--daemon\tstays resident and starts a recording on Super+Shift+R or "
+      "when triggered\n --trigger[=record|last]\tstarts a recording in the "
+      "running daemon, last records the previous region again\n "
+      "--monitor[=NAME]\trecords a whole monitor without selecting, the one "
+      "under the pointer or the given one (e.g. DP-1 or its index)\n "
       "-v|--version show program version\n"
 #ifdef HAVE_ZENITY
       " -z|--use-zenity\tuses a file selection dialog "
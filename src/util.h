@@ -20,12 +20,22 @@
 #define EVID_UTIL_H
 
 #include "evid.h"
+#include "types.h"
 
 #define ARR_SIZE(arr) (sizeof(arr) / sizeof(*arr))
 
 void error(const char *errstr, ...);
 void die(const char *errstr, ...);
 
+/* Has ffmpeg's command line printed and debug output turned on, or its
+ * stderr silenced, to go with verbose. fargs needs room for two more. */
+void set_verbose(char **fargs, int verbose);
+
+/* Size of the recording out of a width x height region, shrunk by the
+ * scale factor and to fit the maximum size while keeping its proportions */
+void get_scaled_size(Args *args, int width, int height, int *scaled_width,
+                     int *scaled_height);
+
 void print_version(void);
 void print_usage(void);
 
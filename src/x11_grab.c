@@ -28,6 +28,9 @@
 unsigned int special_modifiers[] = {0, Mod2Mask, LockMask,
                                     (Mod2Mask | LockMask)};
 
+/* The connection keys are grabbed on, errors on any other are left alone */
+static Display *grab_dpy = NULL;
+
 void update_active_window(Window *active_window, Display *dpy, Window *root,
                           Atom *net_active_window) {
   Atom actual_type;
@@ -46,7 +49,8 @@ void update_active_window(Window *active_window, Display *dpy, Window *root,
 }
 
 void grab_keys(Display *dpy, Window *window, unsigned char actions) {
-  XSetErrorHandler(&handle_x_error);
+  grab_dpy = dpy;
+  XErrorHandler previous = XSetErrorHandler(&handle_x_error);
   for (unsigned int mod = 0; mod < ARR_SIZE(special_modifiers); ++mod) {
     XGrabKey(dpy, XKeysymToKeycode(dpy, ABORT_KEYSYM),
              ABORT_MODFIELD | special_modifiers[mod], *window, False,
@@ -61,12 +65,18 @@ void grab_keys(Display *dpy, Window *window, unsigned char actions) {
                COPY_MODFIELD | special_modifiers[mod], *window, True,
                GrabModeSync, GrabModeSync);
     }
+    if ((PAUSE & actions) == PAUSE) {
+      XGrabKey(dpy, XKeysymToKeycode(dpy, PAUSE_KEYSYM),
+               PAUSE_MODFIELD | special_modifiers[mod], *window, True,
+               GrabModeSync, GrabModeSync);
+    }
   }
-  XSetErrorHandler(NULL);
+  XSetErrorHandler(previous);
 }
 
 void ungrab_keys(Display *dpy, Window *window, unsigned char actions) {
-  XSetErrorHandler(&handle_x_error);
+  grab_dpy = dpy;
+  XErrorHandler previous = XSetErrorHandler(&handle_x_error);
   for (unsigned int mod = 0; mod < ARR_SIZE(special_modifiers); mod++) {
     XUngrabKey(dpy, XKeysymToKeycode(dpy, ABORT_KEYSYM),
                ABORT_MODFIELD | special_modifiers[mod], *window);
@@ -78,11 +88,32 @@ void ungrab_keys(Display *dpy, Window *window, unsigned char actions) {
       XUngrabKey(dpy, XKeysymToKeycode(dpy, COPY_KEYSYM),
                  COPY_MODFIELD | special_modifiers[mod], *window);
     }
+    if ((PAUSE & actions) == PAUSE) {
+      XUngrabKey(dpy, XKeysymToKeycode(dpy, PAUSE_KEYSYM),
+                 PAUSE_MODFIELD | special_modifiers[mod], *window);
+    }
   }
-  XSetErrorHandler(NULL);
+  XSetErrorHandler(previous);
+}
+
+void grab_record_key(Display *dpy, Window *root) {
+  grab_dpy = dpy;
+  XErrorHandler previous = XSetErrorHandler(&handle_x_error);
+  for (unsigned int mod = 0; mod < ARR_SIZE(special_modifiers); ++mod) {
+    XGrabKey(dpy, RECORD_KEYCODE(dpy), RECORD_MODFIELD | special_modifiers[mod],
+             *root, False, GrabModeAsync, GrabModeAsync);
+  }
+  XSync(dpy, False);
+  XSetErrorHandler(previous);
 }
 
 int handle_x_error(Display *dpy, XErrorEvent *error) {
+  // The handler is process wide and swapped in while the capture thread
+  // runs on its own connection, where a followed window going away is
+  // expected and noticed from its DestroyNotify
+  if (error->display != grab_dpy) {
+    return 0;
+  }
   // Ignore BadAccess error on grabs
   switch (error->error_code) {
   case BadAccess: {
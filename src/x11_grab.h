@@ -24,6 +24,7 @@ void update_active_window(Window *active_window, Display *dpy, Window *root,
                           Atom *net_active_window);
 void grab_keys(Display *dpy, Window *window, unsigned char actions);
 void ungrab_keys(Display *dpy, Window *window, unsigned char actions);
+void grab_record_key(Display *dpy, Window *root);
 int handle_x_error(Display *dpy, XErrorEvent *error);
 
 #endif
@@ -16,6 +16,8 @@
 
 #include "xrectsel.h"
 #include "actions.h"
+#include "monitors.h"
+#include "trace.h"
 #include "util.h"
 #include "x11_grab.h"
 #include <X11/X.h>
@@ -29,18 +31,135 @@
 #include <X11/extensions/shape.h>
 #endif
 
+/* Splits what's left of a once b is taken out into up to 4 rectangles */
+static int subtract_rectangle(XRectangle a, XRectangle b, XRectangle *out) {
+  int ax2 = a.x + a.width, ay2 = a.y + a.height;
+  int bx2 = b.x + b.width, by2 = b.y + b.height;
+  int count = 0;
+  if (!a.width || !a.height) {
+    return 0;
+  }
+  if (!b.width || !b.height || b.x >= ax2 || bx2 <= a.x || b.y >= ay2 ||
+      by2 <= a.y) {
+    out[count++] = a;
+    return count;
+  }
+  int top = b.y > a.y ? b.y : a.y;
+  int bottom = by2 < ay2 ? by2 : ay2;
+  if (b.y > a.y) {
+    out[count++] = (XRectangle){a.x, a.y, a.width, b.y - a.y};
+  }
+  if (by2 < ay2) {
+    out[count++] = (XRectangle){a.x, by2, a.width, ay2 - by2};
+  }
+  if (b.x > a.x) {
+    out[count++] = (XRectangle){a.x, top, b.x - a.x, bottom - top};
+  }
+  if (bx2 < ax2) {
+    out[count++] = (XRectangle){bx2, top, ax2 - bx2, bottom - top};
+  }
+  return count;
+}
+
+/* Only repaints what differs between the old and the new selection, the
+ * overlay covers the whole root and a full redraw on every motion is a lot
+ * of pixels for the X server and the compositor on large screens */
+static void update_selection(Display *dpy, Window w, GC gc, XRectangle old,
+                             XRectangle new) {
+  XRectangle strips[4];
+  int count = subtract_rectangle(old, new, strips);
+  for (int i = 0; i < count; ++i) {
+    XClearArea(dpy, w, strips[i].x, strips[i].y, strips[i].width,
+               strips[i].height, False);
+  }
+  count = subtract_rectangle(new, old, strips);
+  if (count) {
+    XFillRectangles(dpy, w, gc, strips, count);
+  }
+}
+
+/* The selection sticks to the edges of its monitor when this close */
+#define SNAP_DISTANCE 8
+
+static int get_root_region(Display *dpy, Window root, _Region *rr) {
+  Window wroot;
+  if (False == XGetGeometry(dpy, root, &wroot, &rr->x, &rr->y, &rr->w, &rr->h,
+                            &rr->b, &rr->d)) {
+    error("failed to get root window geometry\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void set_region(_Region *rr, int x, int y, unsigned int w,
+                       unsigned int h, _Region *region) {
+  region->x = x;
+  region->y = y;
+  region->w = w;
+  region->h = h;
+  /* calculate right and bottom offset */
+  region->X = rr->w - x - w;
+  region->Y = rr->h - y - h;
+  /* those doesn't really make sense but should be set */
+  region->b = rr->b;
+  region->d = rr->d;
+  region->window = 0;
+}
+
+/* Keeps a coordinate on the monitor the selection started on */
+static int snap(int value, int low, int high) {
+  if (value < low + SNAP_DISTANCE) {
+    return low;
+  }
+  if (value > high - SNAP_DISTANCE) {
+    return high;
+  }
+  return value;
+}
+
+static int pointer_monitor(Display *dpy, Window root, Monitor *monitors,
+                           int count) {
+  Window wroot, child;
+  int x = 0, y = 0, wx, wy;
+  unsigned int mask;
+  XQueryPointer(dpy, root, &wroot, &child, &x, &y, &wx, &wy, &mask);
+  return monitors_at(monitors, count, x, y);
+}
+
+int select_monitor(Display *dpy, Window root, const char *name,
+                   _Region *region) {
+  _Region rr;
+  if (get_root_region(dpy, root, &rr)) {
+    return -1;
+  }
+  Monitor monitors[MONITORS_MAX];
+  int count = monitors_get(dpy, root, monitors, MONITORS_MAX);
+  int index = name && *name ? monitors_find(monitors, count, name)
+                            : pointer_monitor(dpy, root, monitors, count);
+  if (!count || index == -1) {
+    return -1;
+  }
+  Monitor *m = &monitors[index];
+  set_region(&rr, m->x, m->y, m->w, m->h, region);
+  return 0;
+}
+
 int select_region(Display *dpy, Window root, _Region *region) {
   _Region rr; /* root region */
-  _Region sr; /* selected region */
-
-  {
-    Window wroot;
-    if (False == XGetGeometry(dpy, root, &wroot, &rr.x, &rr.y, &rr.w, &rr.h,
-                              &rr.b, &rr.d)) {
-      error("failed to get root window geometry\n");
-      return -1;
-    }
+  if (get_root_region(dpy, root, &rr)) {
+    return -1;
+  }
+
+  /* The overlay only covers the monitor the pointer is on and follows it
+   * until the selection starts */
+  Monitor monitors[MONITORS_MAX];
+  int count = monitors_get(dpy, root, monitors, MONITORS_MAX);
+  if (!count) {
+    error("failed to find any monitor\n");
+    return -1;
   }
+  int current = pointer_monitor(dpy, root, monitors, count);
+  Monitor *m = &monitors[current];
 
   XVisualInfo vinfo;
   XMatchVisualInfo(dpy, DefaultScreen(dpy), 32, TrueColor, &vinfo);
@@ -52,7 +171,7 @@ int select_region(Display *dpy, Window root, _Region *region) {
   wa.background_pixel = 0xB0000000;
 
   Window w = XCreateWindow(
-      dpy, root, rr.x, rr.y, rr.w, rr.h, rr.b, vinfo.depth, InputOutput,
+      dpy, root, m->x, m->y, m->w, m->h, 0, vinfo.depth, InputOutput,
       vinfo.visual,
       CWColormap | CWBackPixel | CWBorderPixel | CWOverrideRedirect, &wa);
   Atom wm_state = XInternAtom(dpy, "_NET_WM_STATE", True);
@@ -74,12 +193,13 @@ int select_region(Display *dpy, Window root, _Region *region) {
 #endif
 
   XSizeHints *xh = XAllocSizeHints();
-  xh->width = rr.w;
-  xh->height = rr.h;
+  xh->width = m->w;
+  xh->height = m->h;
   xh->win_gravity = StaticGravity;
   XSetWMNormalHints(dpy, w, xh);
 
   XMapWindow(dpy, w);
+  trace("overlay mapped");
 
   GC sel_gc;
   XGCValues sel_gv;
@@ -88,6 +208,7 @@ int select_region(Display *dpy, Window root, _Region *region) {
   int x = 0, y = 0;
   unsigned int width = 0, height = 0;
   int start_x = 0, start_y = 0;
+  XRectangle drawn = {0}; /* in overlay coordinates */
 
   Cursor cursor;
   cursor = XCreateFontCursor(dpy, XC_tcross);
@@ -101,6 +222,7 @@ int select_region(Display *dpy, Window root, _Region *region) {
     error("failed to grab pointer\n");
     return -1;
   }
+  trace("pointer grabbed");
 
   sel_gv.subwindow_mode = IncludeInferiors;
   sel_gv.line_width = 2;
@@ -125,19 +247,44 @@ int select_region(Display *dpy, Window root, _Region *region) {
       }
     }
     case ButtonPress: {
+      update_selection(dpy, w, sel_gc, drawn, (XRectangle){0});
+      drawn = (XRectangle){0};
       btn_pressed = 1;
-      x = start_x = event.xbutton.x_root;
-      y = start_y = event.xbutton.y_root;
+      current = monitors_at(monitors, count, event.xbutton.x_root,
+                            event.xbutton.y_root);
+      m = &monitors[current];
+      XMoveResizeWindow(dpy, w, m->x, m->y, m->w, m->h);
+      x = start_x = snap(event.xbutton.x_root, m->x, m->x + m->w);
+      y = start_y = snap(event.xbutton.y_root, m->y, m->y + m->h);
       width = height = 0;
       break;
     }
     case MotionNotify: {
+      if (!btn_pressed) {
+        int under = monitors_at(monitors, count, event.xmotion.x_root,
+                                event.xmotion.y_root);
+        if (under != current) {
+          current = under;
+          m = &monitors[current];
+          XMoveResizeWindow(dpy, w, m->x, m->y, m->w, m->h);
+          XFlush(dpy);
+        }
+      }
       /* Draw only if button is pressed */
       if (btn_pressed) {
-        XClearWindow(dpy, w);
+        /* Skip to the latest position when the pointer moved faster than
+         * we draw, stopping at anything that isn't motion to keep order */
+        while (XPending(dpy)) {
+          XEvent next;
+          XPeekEvent(dpy, &next);
+          if (next.type != MotionNotify) {
+            break;
+          }
+          XNextEvent(dpy, &event);
+        }
 
-        x = event.xbutton.x_root;
-        y = event.xbutton.y_root;
+        x = snap(event.xmotion.x_root, m->x, m->x + m->w);
+        y = snap(event.xmotion.y_root, m->y, m->y + m->h);
 
         if (x > start_x) {
           width = x - start_x;
@@ -153,7 +300,9 @@ int select_region(Display *dpy, Window root, _Region *region) {
         }
 
         /* Draw Rectangle */
-        XFillRectangle(dpy, w, sel_gc, x, y, width, height);
+        XRectangle selection = {x - m->x, y - m->y, width, height};
+        update_selection(dpy, w, sel_gc, drawn, selection);
+        drawn = selection;
         XFlush(dpy);
       }
       break;
@@ -162,6 +311,15 @@ int select_region(Display *dpy, Window root, _Region *region) {
 #ifdef HAVE_XEXTENSIONS
       clicked_window = event.xbutton.subwindow;
 #endif
+      if (event.xbutton.button == Button3) {
+        /* Right click records the whole monitor */
+        m = &monitors[monitors_at(monitors, count, event.xbutton.x_root,
+                                  event.xbutton.y_root)];
+        x = m->x;
+        y = m->y;
+        width = m->w;
+        height = m->h;
+      }
       done = 1;
       break;
     }
@@ -201,24 +359,11 @@ int select_region(Display *dpy, Window root, _Region *region) {
       XTranslateCoordinates(dpy, clicked_window, attrs.root, 0, 0, &x, &y,
                             &stub);
     }
-    sr.x = x;
-    sr.y = y;
-    sr.w = attrs.width;
-    sr.h = attrs.height;
+    set_region(&rr, x, y, attrs.width, attrs.height, region);
+    region->window = clicked_window;
   } else {
-    sr.x = x;
-    sr.y = y;
-    sr.w = width;
-    sr.h = height;
+    set_region(&rr, x, y, width, height, region);
   }
 
-  /* calculate right and bottom offset */
-  sr.X = rr.w - sr.x - sr.w;
-  sr.Y = rr.h - sr.y - sr.h;
-  /* those doesn't really make sense but should be set */
-  sr.b = rr.b;
-  sr.d = rr.d;
-  *region = sr;
-
   return 0;
 }
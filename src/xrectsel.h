@@ -23,5 +23,9 @@
 #include <X11/Xlib.h>
 
 int select_region(Display *dpy, Window root, _Region *region);
+/* A whole monitor by name or index, the one under the pointer when name is
+ * empty */
+int select_monitor(Display *dpy, Window root, const char *name,
+                   _Region *region);
 
 #endif
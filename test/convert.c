@@ -0,0 +1,153 @@
+/**
+    convert.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+/* Every vector kernel the cpu has against the scalar one, and the halving
+ * path of convert_scale against plain box averaging */
+
+#include "../src/convert.c"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_WIDTH 131
+#define MAX_SIZE 80
+
+typedef struct Kernel Kernel;
+struct Kernel {
+  const char *name;
+  int supported;
+  ConvertRowsFunc convert_rows;
+  HalveRowsFunc halve_rows;
+};
+
+static void random_pixels(uint8_t *pixels, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    pixels[i] = test_random();
+  }
+}
+
+static void check_convert_rows(const Kernel *kernel) {
+  static uint8_t top[MAX_WIDTH * 4], bottom[MAX_WIDTH * 4];
+  uint8_t expected[4][MAX_WIDTH], planes[4][MAX_WIDTH];
+  const int orders[][2] = {{0, 2}, {2, 0}};
+  for (int width = 0; width <= MAX_WIDTH - 1; width += 2) {
+    for (int order = 0; order < 2; ++order) {
+      int16_t coefficients[12];
+      order_coefficients(orders[order][0], orders[order][1], coefficients);
+      random_pixels(top, sizeof(top));
+      random_pixels(bottom, sizeof(bottom));
+      convert_rows_scalar(top, bottom, width, coefficients, expected[0],
+                          expected[1], expected[2], expected[3]);
+      kernel->convert_rows(top, bottom, width, coefficients, planes[0],
+                           planes[1], planes[2], planes[3]);
+      CHECK(!memcmp(expected[0], planes[0], width) &&
+                !memcmp(expected[1], planes[1], width) &&
+                !memcmp(expected[2], planes[2], width / 2) &&
+                !memcmp(expected[3], planes[3], width / 2),
+            "%s convert_rows differs at width %d", kernel->name, width);
+    }
+  }
+}
+
+static void check_halve_rows(const Kernel *kernel) {
+  static uint8_t top[MAX_WIDTH * 8], bottom[MAX_WIDTH * 8];
+  uint8_t expected[MAX_WIDTH * 4], halved[MAX_WIDTH * 4];
+  for (int width = 0; width <= MAX_WIDTH; ++width) {
+    random_pixels(top, sizeof(top));
+    random_pixels(bottom, sizeof(bottom));
+    halve_rows_scalar(top, bottom, width, expected);
+    kernel->halve_rows(top, bottom, width, halved);
+    CHECK(!memcmp(expected, halved, width * 4),
+          "%s halve_rows differs at width %d", kernel->name, width);
+  }
+}
+
+/* Halving is box averaging over 2x2 blocks, whichever kernel is selected */
+static void check_scale(uint8_t *src, uint8_t *expected, uint8_t *scaled) {
+  int stride = MAX_SIZE * 4 + 12;
+  for (int height = 2; height <= 8; height += 2) {
+    for (int width = 2; width <= MAX_SIZE; width += 2) {
+      random_pixels(src, (size_t)stride * height);
+      scale_box(src, stride, width, height, expected, width * 2, width / 2,
+                height / 2);
+      convert_scale(src, stride, width, height, scaled, width * 2, width / 2,
+                    height / 2);
+      CHECK(!memcmp(expected, scaled, (size_t)width * height),
+            "halving %dx%d differs from box averaging", width, height);
+    }
+  }
+  /* Any other factor keeps a flat image flat */
+  const int sizes[][4] = {{80, 8, 27, 3}, {79, 7, 79, 7}, {64, 6, 1, 1},
+                          {45, 5, 30, 4}};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    const int *s = sizes[i];
+    for (int y = 0; y < s[1]; ++y) {
+      for (int x = 0; x < s[0]; ++x) {
+        memcpy(src + (size_t)y * stride + x * 4, "\x12\x34\x56\x78", 4);
+      }
+    }
+    convert_scale(src, stride, s[0], s[1], scaled, s[2] * 4, s[2], s[3]);
+    int flat = 1;
+    for (int p = 0; p < s[2] * s[3]; ++p) {
+      flat &= !memcmp(scaled + p * 4, "\x12\x34\x56\x78", 4);
+    }
+    CHECK(flat, "scaling %dx%d to %dx%d changed the colors", s[0], s[1], s[2],
+          s[3]);
+  }
+}
+
+int main(void) {
+#ifdef CONVERT_X86
+  __builtin_cpu_init();
+#endif
+  const Kernel kernels[] = {
+#ifdef CONVERT_X86
+      {"sse4.1", __builtin_cpu_supports("sse4.1"), convert_rows_sse41, NULL},
+      {"sse2", __builtin_cpu_supports("sse2"), NULL, halve_rows_sse2},
+      {"avx2", __builtin_cpu_supports("avx2"), convert_rows_avx2,
+       halve_rows_avx2},
+#endif
+      {"scalar", 1, convert_rows_scalar, halve_rows_scalar},
+  };
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i) {
+    if (!kernels[i].supported) {
+      printf("convert: %s isn't supported here, skipped\n", kernels[i].name);
+      continue;
+    }
+    if (kernels[i].convert_rows) {
+      check_convert_rows(&kernels[i]);
+    }
+    if (kernels[i].halve_rows) {
+      check_halve_rows(&kernels[i]);
+    }
+  }
+
+  uint8_t *src = malloc((MAX_SIZE * 4 + 12) * 8);
+  uint8_t *expected = malloc(MAX_SIZE * 4 * 8);
+  uint8_t *scaled = malloc(MAX_SIZE * 4 * 8);
+  if (!src || !expected || !scaled) {
+    return EXIT_FAILURE;
+  }
+  check_scale(src, expected, scaled);
+  free(src);
+  free(expected);
+  free(scaled);
+  return test_finish("convert");
+}
@@ -0,0 +1,90 @@
+/**
+    file.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+/* Copies either have the whole file or fail, keeping the source */
+
+#include "../src/file.c"
+#include "test.h"
+
+#define SIZE (3 * 1024 * 1024 + 5)
+
+static int write_file(const char *path, const unsigned char *data,
+                      size_t size) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+  size_t written = fwrite(data, 1, size, file);
+  return fclose(file) || written != size ? -1 : 0;
+}
+
+static int same_content(int fd, const unsigned char *data, size_t size) {
+  unsigned char *read = malloc(size + 1);
+  ssize_t bytes = read ? pread(fd, read, size + 1, 0) : -1;
+  int same = bytes == (ssize_t)size && !memcmp(read, data, size);
+  free(read);
+  return same;
+}
+
+int main(void) {
+  char dir[PATH_MAX / 2];
+  snprintf(dir, sizeof(dir), "%s/evid-test-XXXXXX", get_tmp_dir());
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  unsigned char *data = malloc(SIZE);
+  if (!data) {
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < SIZE; ++i) {
+    data[i] = test_random();
+  }
+  char source[PATH_MAX], dest[PATH_MAX];
+  snprintf(source, sizeof(source), "%s/source", dir);
+  snprintf(dest, sizeof(dest), "%s/dest", dir);
+  CHECK(!write_file(source, data, SIZE), "writing %s", source);
+
+  int in = open(source, O_RDONLY);
+  int out = open(dest, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  CHECK(!copy_fd(in, out, SIZE, NULL, NULL), "copy_fd failed");
+  CHECK(same_content(out, data, SIZE), "the copy differs");
+
+  /* A source shorter than it was said to be */
+  lseek(in, 0, SEEK_SET);
+  ftruncate(out, 0);
+  lseek(out, 0, SEEK_SET);
+  errno = 0;
+  CHECK(copy_fd(in, out, SIZE + 4096, NULL, NULL) == -1,
+        "copy_fd of a short source succeeded");
+  CHECK(errno == ENODATA, "copy_fd failed with %s", strerror(errno));
+  close(in);
+  close(out);
+
+  CHECK(!move_file(source, dest, 0, NULL, NULL), "move_file failed");
+  CHECK(access(source, F_OK), "%s is still there", source);
+  out = open(dest, O_RDONLY);
+  CHECK(same_content(out, data, SIZE), "the moved file differs");
+  close(out);
+
+  remove(dest);
+  rmdir(dir);
+  free(data);
+  return test_finish("file");
+}
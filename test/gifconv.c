@@ -0,0 +1,134 @@
+/**
+    gifconv.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+/* Joining chunks written by the gif encoder into one playable gif */
+
+#include "../src/gifconv.c"
+#include "../src/gif.h"
+#include "test.h"
+
+#define WIDTH 64
+#define HEIGHT 48
+#define CHUNKS 3
+#define FRAMES 5 /* per chunk */
+
+/* Walks the blocks, -1 when the file isn't well formed */
+static int count_frames(const char *path, int *extensions) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  uint8_t header[13];
+  uint8_t table[768];
+  size_t table_size;
+  int frames = 0;
+  *extensions = 0;
+  int ret = read_header(file, header, table, &table_size);
+  while (!ret) {
+    int c = fgetc(file);
+    if (c == 0x3b) {
+      break;
+    }
+    if (c == 0x21) {
+      if (fgetc(file) == 0xff) {
+        ++*extensions;
+      }
+      ret = copy_sub_blocks(file, NULL);
+    } else if (c == 0x2c) {
+      uint8_t image[9];
+      if (fread(image, 1, 9, file) != 9) {
+        ret = -1;
+        break;
+      }
+      if (image[8] & 0x80) {
+        fseek(file, 3 << ((image[8] & 7) + 1), SEEK_CUR);
+      }
+      /* LZW minimum code size */
+      fgetc(file);
+      ret = copy_sub_blocks(file, NULL);
+      ++frames;
+    } else {
+      ret = -1;
+    }
+  }
+  /* Nothing after the trailer */
+  if (!ret && fgetc(file) != EOF) {
+    ret = -1;
+  }
+  fclose(file);
+  return ret ? -1 : frames;
+}
+
+static int write_chunk(const char *path, int width, int height, int index) {
+  static char pixels[WIDTH * HEIGHT * 4];
+  Gif gif;
+  if (gif_open(&gif, path, width, height, 0)) {
+    return -1;
+  }
+  for (int i = 0; i < FRAMES; ++i) {
+    memset(pixels, index * 50 + i * 10, sizeof(pixels));
+    if (gif_write(&gif, pixels, width * 4,
+                  (index * FRAMES + i) * 100000000LL)) {
+      gif_close(&gif);
+      return -1;
+    }
+  }
+  return gif_close(&gif);
+}
+
+int main(void) {
+  char dir[PATH_MAX / 2];
+  snprintf(dir, sizeof(dir), "%s/evid-test-XXXXXX", get_tmp_dir());
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  char chunks[CHUNKS][PATH_MAX];
+  char dest[PATH_MAX];
+  snprintf(dest, sizeof(dest), "%s/joined.gif", dir);
+  int extensions;
+  for (int i = 0; i < CHUNKS; ++i) {
+    snprintf(chunks[i], PATH_MAX, "%s/%03d.gif", dir, i);
+    CHECK(!write_chunk(chunks[i], WIDTH, HEIGHT, i), "writing chunk %d", i);
+    CHECK(count_frames(chunks[i], &extensions) == FRAMES,
+          "chunk %d doesn't have %d frames", i, FRAMES);
+  }
+
+  CHECK(!join_chunks(chunks, CHUNKS, dest), "join_chunks failed");
+  int frames = count_frames(dest, &extensions);
+  CHECK(frames == CHUNKS * FRAMES, "%d frames joined instead of %d", frames,
+        CHUNKS * FRAMES);
+  /* Looping is only said once */
+  CHECK(extensions == 1, "%d application extensions", extensions);
+
+  /* Frames of another size can't be mixed in */
+  CHECK(!write_chunk(chunks[1], WIDTH / 2, HEIGHT, 1), "writing chunk 1");
+  CHECK(join_chunks(chunks, CHUNKS, dest), "joined chunks of another size");
+  /* Nor a truncated chunk */
+  CHECK(!write_chunk(chunks[1], WIDTH, HEIGHT, 1), "writing chunk 1");
+  CHECK(!truncate(chunks[1], 100), "truncating chunk 1");
+  CHECK(join_chunks(chunks, CHUNKS, dest), "joined a truncated chunk");
+
+  for (int i = 0; i < CHUNKS; ++i) {
+    remove(chunks[i]);
+  }
+  remove(dest);
+  rmdir(dir);
+  return test_finish("gifconv");
+}
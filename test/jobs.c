@@ -0,0 +1,89 @@
+/**
+    jobs.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+/* A burst of jobs on a pool of two idle priority workers */
+
+#include "../src/jobs.c"
+#include "test.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define WORKERS 2
+#define JOBS 6
+
+static atomic_int running = 0;
+static atomic_int peak = 0;
+static atomic_int finished = 0;
+static atomic_int not_idle = 0;
+
+static void run(void *data) {
+  int now = atomic_fetch_add(&running, 1) + 1;
+  int seen = atomic_load(&peak);
+  while (now > seen && !atomic_compare_exchange_weak(&peak, &seen, now)) {
+  }
+
+  pid_t tid = syscall(SYS_gettid);
+  int policy;
+  struct sched_param param;
+  int ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+  if (pthread_getschedparam(pthread_self(), &policy, &param) ||
+      policy != SCHED_IDLE || getpriority(PRIO_PROCESS, tid) != JOBS_NICE ||
+      ioprio >> IOPRIO_CLASS_SHIFT != IOPRIO_CLASS_IDLE) {
+    atomic_fetch_add(&not_idle, 1);
+  }
+
+  /* Long enough for the others to pile up */
+  struct timespec wait = {0, 20 * 1000 * 1000};
+  nanosleep(&wait, NULL);
+  atomic_fetch_sub(&running, 1);
+  atomic_fetch_add(&finished, 1);
+  free(data);
+}
+
+int main(void) {
+  jobs_init(WORKERS);
+  for (int i = 0; i < JOBS; ++i) {
+    int ahead = jobs_submit(run, malloc(1));
+    /* Nothing can be done yet */
+    CHECK(ahead == i, "job %d has %d jobs ahead", i, ahead);
+  }
+  jobs_wait();
+  CHECK(atomic_load(&finished) == JOBS, "%d jobs of %d done",
+        atomic_load(&finished), JOBS);
+  CHECK(atomic_load(&peak) == WORKERS, "%d jobs ran at once",
+        atomic_load(&peak));
+  CHECK(workers == WORKERS, "%d workers started", workers);
+  CHECK(!atomic_load(&not_idle), "%d jobs didn't run at idle priority",
+        atomic_load(&not_idle));
+
+  /* The workers are reused */
+  CHECK(!jobs_submit(run, malloc(1)), "jobs left after jobs_wait");
+  jobs_wait();
+  CHECK(atomic_load(&finished) == JOBS + 1, "the last job wasn't run");
+  CHECK(workers == WORKERS, "%d workers after reuse", workers);
+
+  /* The submitting thread keeps its priority */
+  int policy;
+  struct sched_param param;
+  pthread_getschedparam(pthread_self(), &policy, &param);
+  CHECK(policy != SCHED_IDLE, "the main thread went idle");
+  jobs_uninit();
+  return test_finish("jobs");
+}
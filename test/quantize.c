@@ -0,0 +1,124 @@
+/**
+    quantize.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+/* Every vector kernel the cpu has against the scalar one, byte for byte */
+
+#include "../src/quantize.c"
+#include "test.h"
+
+#include <string.h>
+
+typedef struct RowKernel RowKernel;
+struct RowKernel {
+  const char *name;
+  int supported;
+  QuantizeRowFunc row_bins;
+  QuantizeNearestFunc nearest;
+};
+
+static void random_row(uint32_t *row, uint32_t *previous, int width) {
+  for (int x = 0; x < width; ++x) {
+    row[x] = test_random();
+    /* About half of them as in the previous frame, some only differing in
+     * the padding byte which doesn't count as a change */
+    switch (test_random() % 4) {
+    case 0: {
+      previous[x] = row[x];
+      break;
+    }
+    case 1: {
+      previous[x] = row[x] ^ 0xFF000000;
+      break;
+    }
+    default: {
+      previous[x] = test_random();
+      break;
+    }
+    }
+  }
+}
+
+static void check_row_bins(const RowKernel *kernel) {
+  const int8_t *dithers[] = {NULL, dither[0], dither[1], dither[3]};
+  const int orders[][2] = {{0, 2}, {2, 0}};
+  uint32_t row[131], previous[131];
+  uint16_t expected[131], bins[131];
+  for (int width = 0; width <= 131; ++width) {
+    for (int round = 0; round < 8; ++round) {
+      random_row(row, previous, width);
+      const int8_t *d = dithers[round % 4];
+      const int *order = orders[round / 4];
+      const uint32_t *prev = round & 1 ? previous : NULL;
+      row_bins_scalar(row, prev, width, order[0], order[1], d, expected);
+      kernel->row_bins(row, prev, width, order[0], order[1], d, bins);
+      CHECK(!memcmp(expected, bins, width * sizeof(*bins)),
+            "%s row_bins differs at width %d round %d", kernel->name, width,
+            round);
+    }
+  }
+}
+
+static void check_nearest(const RowKernel *kernel, Quantizer *quantizer) {
+  for (int colors = 1; colors <= 256; ++colors) {
+    quantizer->colors = colors;
+    for (int i = 0; i < colors; ++i) {
+      /* Few distinct values so ties between entries happen */
+      for (int c = 0; c < 3; ++c) {
+        quantizer->palette[i][c] = test_random() % 8 * 32;
+      }
+    }
+    set_planar_palette(quantizer);
+    for (int sample = 0; sample < 64; ++sample) {
+      int r = test_random() % 256;
+      int g = test_random() % 256;
+      int b = test_random() % 256;
+      int expected = nearest_scalar(quantizer, r, g, b);
+      int got = kernel->nearest(quantizer, r, g, b);
+      CHECK(expected == got, "%s nearest gives %d instead of %d for %d colors",
+            kernel->name, got, expected, colors);
+    }
+  }
+}
+
+int main(void) {
+  Quantizer *quantizer = calloc(1, sizeof(Quantizer));
+  if (!quantizer) {
+    return EXIT_FAILURE;
+  }
+#ifdef QUANTIZE_X86
+  __builtin_cpu_init();
+#endif
+  const RowKernel kernels[] = {
+#ifdef QUANTIZE_X86
+      {"sse4.1", __builtin_cpu_supports("sse4.1"), row_bins_sse41,
+       nearest_sse41},
+      {"avx2", __builtin_cpu_supports("avx2"), row_bins_avx2, nearest_avx2},
+#endif
+      {"scalar", 1, row_bins_scalar, nearest_scalar},
+  };
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i) {
+    if (!kernels[i].supported) {
+      printf("quantize: %s isn't supported here, skipped\n", kernels[i].name);
+      continue;
+    }
+    check_row_bins(&kernels[i]);
+    check_nearest(&kernels[i], quantizer);
+  }
+  free(quantizer);
+  return test_finish("quantize");
+}
@@ -0,0 +1,139 @@
+/**
+    queue.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+/* Bounds of the ring and many threads pushing and popping at once */
+
+#include "../src/queue.c"
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS 100000 /* per producer */
+#define CAPACITY 64
+
+typedef struct Worker Worker;
+struct Worker {
+  Queue *queue;
+  int id;
+  atomic_int *popped;
+  atomic_uchar *seen;
+  int out_of_order;
+};
+
+/* Values are offset by one, NULL means empty */
+static void *encode(int producer, int item) {
+  return (void *)(uintptr_t)(producer * ITEMS + item + 1);
+}
+
+static void *produce(void *data) {
+  Worker *worker = data;
+  for (int i = 0; i < ITEMS; ++i) {
+    while (queue_push(worker->queue, encode(worker->id, i))) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+static void *consume(void *data) {
+  Worker *worker = data;
+  /* Each producer's values have to come out in the order they went in */
+  int last[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; ++i) {
+    last[i] = -1;
+  }
+  while (atomic_load(worker->popped) < PRODUCERS * ITEMS) {
+    void *value = queue_pop(worker->queue);
+    if (!value) {
+      sched_yield();
+      continue;
+    }
+    atomic_fetch_add(worker->popped, 1);
+    size_t index = (uintptr_t)value - 1;
+    atomic_fetch_add(&worker->seen[index], 1);
+    int producer = index / ITEMS;
+    int item = index % ITEMS;
+    if (item <= last[producer]) {
+      worker->out_of_order++;
+    }
+    last[producer] = item;
+  }
+  return NULL;
+}
+
+static void check_bounds(void) {
+  Queue queue;
+  CHECK(!queue_init(&queue, 5), "queue_init failed");
+  CHECK(queue.mask == 7, "capacity 5 gives %zu cells", queue.mask + 1);
+  CHECK(!queue_pop(&queue), "pop from an empty queue");
+  /* A few laps around the ring */
+  for (int lap = 0; lap < 3; ++lap) {
+    for (int i = 0; i < 8; ++i) {
+      CHECK(!queue_push(&queue, encode(0, i)), "push %d failed", i);
+    }
+    CHECK(queue_push(&queue, encode(0, 8)), "push into a full queue");
+    for (int i = 0; i < 8; ++i) {
+      void *value = queue_pop(&queue);
+      CHECK(value == encode(0, i), "pop %d gives %p", i, value);
+    }
+    CHECK(!queue_pop(&queue), "pop from an emptied queue");
+  }
+  queue_destroy(&queue);
+}
+
+static void check_threads(void) {
+  Queue queue;
+  CHECK(!queue_init(&queue, CAPACITY), "queue_init failed");
+  atomic_int popped = 0;
+  atomic_uchar *seen = calloc(PRODUCERS * ITEMS, sizeof(*seen));
+  if (!seen) {
+    exit(EXIT_FAILURE);
+  }
+  Worker producers[PRODUCERS], consumers[CONSUMERS];
+  pthread_t threads[PRODUCERS + CONSUMERS];
+  for (int i = 0; i < CONSUMERS; ++i) {
+    consumers[i] = (Worker){&queue, i, &popped, seen, 0};
+    pthread_create(&threads[i], NULL, consume, &consumers[i]);
+  }
+  for (int i = 0; i < PRODUCERS; ++i) {
+    producers[i] = (Worker){&queue, i, &popped, seen, 0};
+    pthread_create(&threads[CONSUMERS + i], NULL, produce, &producers[i]);
+  }
+  for (int i = 0; i < PRODUCERS + CONSUMERS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < PRODUCERS * ITEMS; ++i) {
+    CHECK(seen[i] == 1, "value %d popped %d times", i, seen[i]);
+  }
+  for (int i = 0; i < CONSUMERS; ++i) {
+    CHECK(!consumers[i].out_of_order, "consumer %d saw %d values out of order",
+          i, consumers[i].out_of_order);
+  }
+  CHECK(!queue_pop(&queue), "queue not empty after the run");
+  free(seen);
+  queue_destroy(&queue);
+}
+
+int main(void) {
+  check_bounds();
+  check_threads();
+  return test_finish("queue");
+}
@@ -0,0 +1,126 @@
+/**
+    spool.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+/* Recordings going through a spool come out of spool_save unchanged, kept
+ * in memory, spilled on the way or on disk from the start */
+
+#include "../src/spool.c"
+#include "test.h"
+
+#define MB (1024 * 1024)
+
+static unsigned char *random_data(size_t size) {
+  unsigned char *data = malloc(size);
+  if (!data) {
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = test_random();
+  }
+  return data;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t size) {
+  while (size) {
+    /* Odd sizes so chunks don't line up with the pipe */
+    size_t chunk = size < 100003 ? size : 100003;
+    ssize_t written = write(fd, data, chunk);
+    if (written == -1) {
+      return -1;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static int same_content(const char *path, const unsigned char *data,
+                        size_t size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return 0;
+  }
+  unsigned char *read = malloc(size + 1);
+  size_t bytes = read ? fread(read, 1, size + 1, file) : 0;
+  int same = read && bytes == size && !memcmp(read, data, size);
+  free(read);
+  fclose(file);
+  return same;
+}
+
+/* Through a descriptor of its own like ffmpeg, or the spool's input */
+static void round_trip(const char *dir, const char *name, off_t memory,
+                       size_t size, int own_fd, int spilled) {
+  Spool spool;
+  CHECK(!spool_open(&spool, memory), "%s: spool_open failed", name);
+  unsigned char *data = random_data(size);
+  int fd = spool.input;
+  if (own_fd) {
+    fd = open(spool.input_path, O_WRONLY | O_CLOEXEC);
+    spool_close_input(&spool);
+  }
+  CHECK(!write_all(fd, data, size), "%s: writing failed", name);
+  if (own_fd) {
+    close(fd);
+  }
+  CHECK(!spool_finish(&spool), "%s: spool_finish failed", name);
+  CHECK(atomic_load(&spool.size) == (long long)size, "%s: %lld bytes of %zu",
+        name, atomic_load(&spool.size), size);
+  CHECK(atomic_load(&spool.spilled) == spilled, "%s: %s disk", name,
+        spilled ? "not on" : "on");
+  /* Readers open it by path */
+  CHECK(same_content(spool.path, data, size), "%s: %s differs", name,
+        spool.path);
+
+  char dest[PATH_MAX];
+  snprintf(dest, sizeof(dest), "%s/%s", dir, name);
+  CHECK(!spool_save(&spool, dest, 0, NULL, NULL), "%s: spool_save failed",
+        name);
+  CHECK(same_content(dest, data, size), "%s: saved file differs", name);
+  remove(dest);
+  /* Over an older and longer file, which can't be linked over */
+  FILE *older = fopen(dest, "wb");
+  if (older) {
+    fwrite(data, 1, size, older);
+    fwrite(data, 1, size, older);
+    fputc(0, older);
+    fclose(older);
+  }
+  CHECK(!spool_save(&spool, dest, 1, NULL, NULL), "%s: saving over failed",
+        name);
+  CHECK(same_content(dest, data, size), "%s: saved over differs", name);
+  remove(dest);
+  spool_destroy(&spool);
+  free(data);
+}
+
+int main(void) {
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/evid-test-XXXXXX", get_tmp_dir());
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  round_trip(dir, "memory", 8 * MB, 3 * MB + 17, 0, 0);
+  round_trip(dir, "spilled", 1 * MB, 5 * MB + 3, 0, 1);
+  round_trip(dir, "disk", 0, 2 * MB + 1, 0, 1);
+  round_trip(dir, "writer", 1 * MB, 3 * MB, 1, 1);
+  round_trip(dir, "empty", 1 * MB, 0, 1, 0);
+  rmdir(dir);
+  return test_finish("spool");
+}
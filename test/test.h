@@ -0,0 +1,57 @@
+/**
+    test.h - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef EVID_TEST_H
+#define EVID_TEST_H
+
+/* Tests are programs of their own, built against the module they test and
+ * run by make test. They print what failed and exit with a failure. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_failures = 0;
+
+#define CHECK(condition, ...)                                                 \
+  do {                                                                        \
+    if (!(condition)) {                                                       \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                         \
+      fprintf(stderr, __VA_ARGS__);                                           \
+      fprintf(stderr, "\n");                                                  \
+      test_failures++;                                                        \
+    }                                                                         \
+  } while (0)
+
+/* Deterministic so a failure can be reproduced */
+static unsigned int test_seed = 1;
+
+static inline unsigned int test_random(void) {
+  test_seed = test_seed * 1103515245 + 12345;
+  return test_seed >> 8;
+}
+
+static inline int test_finish(const char *name) {
+  if (test_failures) {
+    fprintf(stderr, "%s: %d failed\n", name, test_failures);
+    return EXIT_FAILURE;
+  }
+  printf("%s: ok\n", name);
+  return EXIT_SUCCESS;
+}
+
+#endif
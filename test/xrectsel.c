@@ -0,0 +1,102 @@
+/**
+    xrectsel.c - part of evid
+    Copyright (C) 2022  Elias Menon
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+/* subtract_rectangle against painting both rectangles into a pixel grid */
+
+#include "../src/xrectsel.c"
+#include "test.h"
+
+#include <string.h>
+
+#define GRID 24
+
+static XRectangle random_rectangle(void) {
+  XRectangle rect;
+  rect.x = test_random() % GRID;
+  rect.y = test_random() % GRID;
+  /* Empty ones included */
+  rect.width = test_random() % (GRID - rect.x + 1);
+  rect.height = test_random() % (GRID - rect.y + 1);
+  return rect;
+}
+
+static int inside(XRectangle rect, int x, int y) {
+  return x >= rect.x && x < rect.x + rect.width && y >= rect.y &&
+         y < rect.y + rect.height;
+}
+
+static void check_subtraction(XRectangle a, XRectangle b) {
+  XRectangle strips[4];
+  int count = subtract_rectangle(a, b, strips);
+  CHECK(count >= 0 && count <= 4, "%d strips", count);
+  unsigned char covered[GRID][GRID];
+  memset(covered, 0, sizeof(covered));
+  for (int i = 0; i < count; ++i) {
+    CHECK(strips[i].width && strips[i].height, "strip %d is empty", i);
+    for (int y = strips[i].y; y < strips[i].y + strips[i].height; ++y) {
+      for (int x = strips[i].x; x < strips[i].x + strips[i].width; ++x) {
+        covered[y][x]++;
+      }
+    }
+  }
+  /* Every pixel of a outside of b exactly once, nothing else */
+  int wrong = 0;
+  for (int y = 0; y < GRID; ++y) {
+    for (int x = 0; x < GRID; ++x) {
+      int expected = inside(a, x, y) && !inside(b, x, y);
+      wrong += covered[y][x] != expected;
+    }
+  }
+  CHECK(!wrong,
+        "%d pixels wrong for %dx%d+%d+%d minus %dx%d+%d+%d in %d strips",
+        wrong, a.width, a.height, a.x, a.y, b.width, b.height, b.x, b.y,
+        count);
+}
+
+/* Pixels update_selection touches when the selection goes from old to new */
+static long repainted(XRectangle old, XRectangle new) {
+  XRectangle strips[4];
+  long area = 0;
+  int count = subtract_rectangle(old, new, strips);
+  for (int i = 0; i < count; ++i) {
+    area += strips[i].width * strips[i].height;
+  }
+  count = subtract_rectangle(new, old, strips);
+  for (int i = 0; i < count; ++i) {
+    area += strips[i].width * strips[i].height;
+  }
+  return area;
+}
+
+int main(void) {
+  for (int i = 0; i < 100000; ++i) {
+    check_subtraction(random_rectangle(), random_rectangle());
+  }
+  /* Same, containing and contained */
+  XRectangle a = {4, 4, 10, 10};
+  check_subtraction(a, a);
+  check_subtraction(a, (XRectangle){0, 0, GRID, GRID});
+  check_subtraction(a, (XRectangle){6, 6, 2, 2});
+  /* Growing a large selection by 5 pixels on each side only repaints the
+   * frame around it, whatever the size of the root */
+  long area = repainted((XRectangle){100, 100, 1000, 1000},
+                        (XRectangle){95, 95, 1010, 1010});
+  CHECK(area == 1010 * 1010 - 1000 * 1000, "growing repaints %ld pixels",
+        area);
+  return test_finish("xrectsel");
+}